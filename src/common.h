@@ -34,6 +34,7 @@ typedef unsigned char uchar;
 typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned long ulong;
+typedef unsigned long long ullong;
 
 #define as(ar) (sizeof(ar)/sizeof(ar[0]))
 
@@ -86,6 +87,8 @@ typedef unsigned long ulong;
 #define VERBOSE         0x800
 #define KEEPJOURNAL     0x1000
 #define ZERODELAY       0x2000
+#define PROFILE         0x4000
+#define NOFILES         0x8000
 
 extern int DFlags;
 extern int JLimit;
@@ -190,6 +193,8 @@ uchar arc4_getbyte( void );
 
 int bucketsForSize( int size );
 
+void parallel_for( void (*fn)( void *aux, void *item ), void *aux, void *items, int size, int count );
+
 typedef struct list_head {
 	struct list_head *next, *prev;
 } list_head_t;
@@ -198,7 +203,7 @@ typedef struct notifier {
 	struct notifier *next;
 	void (*cb)( int what, void *aux );
 	void *aux;
-#ifdef HAVE_SYS_POLL_H
+#if defined(HAVE_SYS_POLL_H) && !defined(HAVE_SYS_EPOLL_H)
 	int index;
 #else
 	int fd, events;
@@ -213,22 +218,74 @@ typedef struct notifier {
 # define POLLERR 8
 #endif
 
+ullong get_usecs( void );
+
 void init_notifier( notifier_t *sn, int fd, void (*cb)( int, void * ), void *aux );
 void conf_notifier( notifier_t *sn, int and_events, int or_events );
 void wipe_notifier( notifier_t *sn );
 
 typedef struct {
-	list_head_t links;
+	list_head_t links; /* for null timers */
 	void (*cb)( void *aux );
 	void *aux;
-	time_t timeout;
+	ullong timeout; /* monotonic milliseconds */
+	ullong seq;
+	uint heap_idx; /* 1-based; 0 if not in the heap */
 } wakeup_t;
 
 void init_wakeup( wakeup_t *tmr, void (*cb)( void * ), void *aux );
+/* The timeout is in milliseconds; 0 fires on the next loop iteration, -1 cancels. */
 void conf_wakeup( wakeup_t *tmr, int timeout );
 void wipe_wakeup( wakeup_t *tmr );
-static INLINE int pending_wakeup( wakeup_t *tmr ) { return tmr->links.next != 0; }
+static INLINE int pending_wakeup( wakeup_t *tmr ) { return tmr->links.next != 0 || tmr->heap_idx != 0; }
 
 void main_loop( void );
 
+typedef struct async_job {
+	struct async_job *next;
+	struct async_queue *queue;
+	void (*work)( struct async_job *job );  /* called on a worker thread */
+	void (*done)( struct async_job *job );  /* called on the main thread */
+	int canceled;
+	int ring_ops;  /* io_uring operations queued or outstanding */
+	struct async_op *ops, **ops_tail;  /* io_uring operations, in submission order */
+} async_job_t;
+
+/* An io_uring operation, as an alternative to the work callback of a job.
+ * Directory descriptors may be AT_FDCWD; files are direct descriptor slots. */
+enum { AOP_OPEN, AOP_WRITE, AOP_FSYNC, AOP_CLOSE, AOP_RENAME, AOP_UNLINK };
+
+typedef struct async_op {
+	struct async_op *next;
+	async_job_t *job;
+	char type;  /* AOP_* */
+	char link;  /* the next operation runs only if this one succeeds */
+	int dfd, ndfd, file, flags;
+	const char *path, *npath;
+	const void *buf;
+	uint len;
+	int res;
+} async_op_t;
+
+typedef struct async_queue {
+	async_job_t *head, **tail;  /* not worked on yet */
+	struct async_queue *next;  /* in the list of runnable queues, or of queues due for io_uring */
+	int busy;  /* a job is being worked on */
+	int ring_busy;  /* a job's io_uring operations are outstanding */
+	int pending;  /* submitted jobs which were not delivered yet */
+} async_queue_t;
+
+void init_async_queue( async_queue_t *q );
+void submit_async( async_queue_t *q, async_job_t *job );
+void wait_async( async_queue_t *q );
+void wait_all_async( void );
+void flush_async( async_queue_t *q );
+void cancel_async( async_queue_t *q );
+
+int uring_available( void );
+void queue_uring( async_job_t *job, async_op_t *op );
+void submit_uring( async_queue_t *q, async_job_t *job );
+int alloc_uring_file( void );
+void free_uring_file( int slot, int open );
+
 #endif
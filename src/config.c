@@ -202,6 +202,8 @@ getopt_helper( conffile_t *cfile, int *cops, channel_conf_t *conf )
 		conf->sync_state = expand_strdup( cfile->val );
 	else if (!strcasecmp( "CopyArrivalDate", cfile->cmd ))
 		conf->use_internal_date = parse_bool( cfile );
+	else if (!strcasecmp( "DetectMoves", cfile->cmd ))
+		conf->detect_moves = parse_bool( cfile );
 	else if (!strcasecmp( "MaxMessages", cfile->cmd ))
 		conf->max_messages = parse_int( cfile );
 	else if (!strcasecmp( "ExpireUnread", cfile->cmd ))
@@ -370,6 +372,7 @@ load_config( const char *where, int pseudo )
 			channel->max_messages = global_conf.max_messages;
 			channel->expire_unread = global_conf.expire_unread;
 			channel->use_internal_date = global_conf.use_internal_date;
+			channel->detect_moves = global_conf.detect_moves;
 			cops = 0;
 			max_size = -1;
 			while (getcline( &cfile ) && cfile.cmd) {
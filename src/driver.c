@@ -23,6 +23,7 @@
 #include "driver.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <string.h>
 
 driver_t *drivers[N_DRIVERS] = { &maildir_driver, &imap_driver };
@@ -44,10 +45,23 @@ free_generic_messages( message_t *msgs )
 	for (; msgs; msgs = tmsg) {
 		tmsg = msgs->next;
 		free( msgs->msgid );
+		free( msgs->objid );
 		free( msgs );
 	}
 }
 
+void
+free_msg_data( msg_data_t *data )
+{
+	free( data->data );
+	data->data = 0;
+	if (data->file) {
+		close( data->fd );
+		free( data->file );
+		data->file = 0;
+	}
+}
+
 void
 parse_generic_store( store_conf_t *store, conffile_t *cfg )
 {
@@ -64,6 +64,7 @@ typedef struct message {
 	struct message *next;
 	struct sync_rec *srec;
 	char *msgid; /* owned */
+	char *objid; /* owned; server's persistent object id (EMAILID), if any */
 	/* string_list_t *keywords; */
 	int size; /* zero implies "not fetched" */
 	uint uid;
@@ -82,6 +83,7 @@ typedef struct message {
 #define OPEN_APPEND     (1<<7)
 #define OPEN_FIND       (1<<8)
 #define OPEN_OLD_IDS    (1<<9)
+#define OPEN_NEW_IDS    (1<<10)
 
 #define UIDVAL_BAD ((uint)-1)
 
@@ -93,9 +95,14 @@ typedef struct store {
 
 typedef struct {
 	char *data;
+	char *file; /* if non-null, the contents are in this file instead of data; see DRV_FILE */
+	int fd; /* the file, opened for reading, so it cannot get lost; valid only if file is set */
 	int len;
 	time_t date;
+	const char *key; /* for link_msg(); may be null */
+	const char *tuid; /* for store_msg() of a file; TUIDL chars; may be null */
 	uchar flags;
+	uchar want_file; /* fetch_msg() may supply a file instead of the contents */
 } msg_data_t;
 
 #define DRV_OK          0
@@ -120,10 +127,22 @@ typedef struct {
    This flag says that the driver will act upon (DFlags & VERBOSE).
 */
 #define DRV_VERBOSE     2
+/*
+   This flag says that the driver implements link_msg().
+*/
+#define DRV_LINK        4
+/*
+   This flag says that the driver keeps messages in local files, which
+   fetch_msg() can supply instead of the contents, and which store_msg()
+   can store without reading them (via a link or a cheap copy). The TUID
+   of such a message is recorded separately from its contents.
+*/
+#define DRV_FILE        8
 
 #define LIST_INBOX      1
 #define LIST_PATH       2
 #define LIST_PATH_MAYBE 4
+#define LIST_BOX_STATUS 8
 
 #define xint int  // For auto-generation of appropriate printf() formats.
 
@@ -157,6 +176,8 @@ struct driver {
 	void (*cancel_store)( store_t *ctx );
 
 	/* List the mailboxes in this store. Flags are ORed LIST_* values.
+	 * With LIST_BOX_STATUS, the driver may additionally obtain the boxes'
+	 * status, to be reported by get_box_fingerprint().
 	 * The returned box list remains owned by the driver. */
 	void (*list_store)( store_t *ctx, int flags,
 	                    void (*cb)( int sts, string_list_t *boxes, void *aux ), void *aux );
@@ -167,6 +188,11 @@ struct driver {
 	/* Get the selected box' on-disk path, if applicable, null otherwise. */
 	const char *(*get_box_path)( store_t *ctx );
 
+	/* Get a string which changes whenever the selected box' contents change
+	 * (including flag changes), without opening the box. Null if unavailable.
+	 * The string remains owned by the driver and is valid until the next call. */
+	const char *(*get_box_fingerprint)( store_t *ctx );
+
 	/* Create the selected mailbox. */
 	void (*create_box)( store_t *ctx,
 	                    void (*cb)( int sts, void *aux ), void *aux );
@@ -202,22 +228,34 @@ struct driver {
 	 * and those named in the excs array (smaller than minuid).
 	 * The driver takes ownership of the excs array.
 	 * Messages starting with newuid need to have the TUID populated when OPEN_FIND is set.
-	 * Messages up to seenuid need to have the Message-Id populated when OPEN_OLD_IDS is set.
+	 * Messages up to seenuid need to have the Message-Id populated when OPEN_OLD_IDS is set;
+	 * likewise messages above seenuid when OPEN_NEW_IDS is set. The object id is populated
+	 * along with the Message-Id, if the driver knows it.
 	 * Messages up to seenuid need to have the size populated when OPEN_OLD_SIZE is set;
 	 * likewise messages above seenuid when OPEN_NEW_SIZE is set.
 	 * The returned message list remains owned by the driver. */
 	void (*load_box)( store_t *ctx, uint minuid, uint maxuid, uint newuid, uint seenuid, uint_array_t excs,
 	                  void (*cb)( int sts, message_t *msgs, int total_msgs, int recent_msgs, void *aux ), void *aux );
 
-	/* Fetch the contents and flags of the given message from the current mailbox. */
+	/* Fetch the contents and flags of the given message from the current mailbox.
+	 * The contents may be a file if requested; dispose of them with free_msg_data(). */
 	void (*fetch_msg)( store_t *ctx, message_t *msg, msg_data_t *data,
 	                   void (*cb)( int sts, void *aux ), void *aux );
 
 	/* Store the given message to either the current mailbox or the trash folder.
+	 * The contents are free()d by the driver.
+	 * They may be a file only if both drivers have DRV_FILE.
 	 * If the new copy's UID can be immediately determined, return it, otherwise 0. */
 	void (*store_msg)( store_t *ctx, msg_data_t *data, int to_trash,
 	                   void (*cb)( int sts, uint uid, void *aux ), void *aux );
 
+	/* Store a copy of a message which was previously stored (into any box of this
+	 * store) with the given key, without transferring its contents. Fails with
+	 * DRV_MSG_BAD if no such message is available (any more).
+	 * Otherwise like store_msg() into the current mailbox. */
+	void (*link_msg)( store_t *ctx, const char *key, int flags,
+	                  void (*cb)( int sts, uint uid, void *aux ), void *aux );
+
 	/* Index the messages which have newly appeared in the mailbox, including their
 	 * temporary UID headers. This is needed if store_msg() does not guarantee returning
 	 * a UID; otherwise the driver needs to implement only the OPEN_FIND flag.
@@ -262,12 +300,21 @@ struct driver {
 int count_generic_messages( message_t * );
 void free_generic_messages( message_t * );
 
+void free_msg_data( msg_data_t *data );
+
 void parse_generic_store( store_conf_t *store, conffile_t *cfg );
 
 store_t *proxy_alloc_store( store_t *real_ctx, const char *label );
+void proxy_dump_profile( void );
+
+extern FILE *RecordFile;
+extern int RecordBodies;
+
+int replay_load( const char *path );
+int replay_has_store( const char *name );
 
 #define N_DRIVERS 2
 extern driver_t *drivers[N_DRIVERS];
-extern driver_t maildir_driver, imap_driver, proxy_driver;
+extern driver_t maildir_driver, imap_driver, proxy_driver, replay_driver;
 
 #endif
@@ -95,6 +95,15 @@ typedef struct {
 
 typedef struct imap_cmd imap_cmd_t;
 
+typedef struct imap_box_status {
+	struct imap_box_status *next;
+	uint uidvalidity, uidnext, messages;
+	ullong highestmodseq;
+	char queried; // STATUS was sent
+	char valid; // STATUS was received, and the box was not touched since
+	char name[1]; // server-side name
+} imap_box_status_t;
+
 struct imap_store {
 	store_t gen;
 	const char *label; /* foreign */
@@ -109,11 +118,14 @@ struct imap_store {
 	char delimiter[2]; /* hierarchy delimiter */
 	list_t *ns_personal, *ns_other, *ns_shared; /* NAMESPACE info */
 	string_list_t *boxes; // _list results
+	imap_box_status_t *box_status, *status_box; // STATUS results; current STATUS response
 	char listed; // was _list already run with these flags?
+	char fingerprint[80];
 	// note that the message counts do _not_ reflect stats from msgs,
 	// but mailbox totals. also, don't trust them beyond the initial load.
 	int total_msgs, recent_msgs;
 	uint uidvalidity, uidnext;
+	ullong highestmodseq; // from SELECT; reset when we modify the box
 	message_t *msgs;
 	message_t **msgapp; /* FETCH results */
 	uint caps; /* CAPABILITY results */
@@ -217,7 +229,11 @@ enum CAPABILITY {
 	LITERALPLUS,
 	MOVE,
 	NAMESPACE,
-	COMPRESS_DEFLATE
+	COMPRESS_DEFLATE,
+	CONDSTORE,
+	LIST_STATUS,
+	OBJECTID,
+	X_GM_EXT_1
 };
 
 static const char *cap_list[] = {
@@ -232,7 +248,11 @@ static const char *cap_list[] = {
 	"LITERAL+",
 	"MOVE",
 	"NAMESPACE",
-	"COMPRESS=DEFLATE"
+	"COMPRESS=DEFLATE",
+	"CONDSTORE",
+	"LIST-STATUS",
+	"OBJECTID",
+	"X-GM-EXT-1"
 };
 
 #define RESP_OK       0
@@ -963,7 +983,7 @@ static int
 parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 {
 	list_t *tmp, *flags;
-	char *body = 0, *tuid = 0, *msgid = 0, *ep;
+	char *body = 0, *tuid = 0, *msgid = 0, *objid = 0, *ep;
 	imap_message_t *cur;
 	msg_data_t *msgdata;
 	imap_cmd_t *cmdp;
@@ -1020,6 +1040,18 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 				tmp = tmp->next;
 				if (!is_atom( tmp ) || (size = strtoul( tmp->val, &ep, 10 ), *ep))
 					error( "IMAP error: unable to parse RFC822.SIZE\n" );
+			} else if (!strcmp( "EMAILID", tmp->val )) {
+				tmp = tmp->next;
+				if (is_list( tmp ) && is_atom( tmp->child ) && !objid)
+					objid = nfstrdup( tmp->child->val );
+				else
+					error( "IMAP error: unable to parse EMAILID\n" );
+			} else if (!strcmp( "X-GM-MSGID", tmp->val )) {
+				tmp = tmp->next;
+				if (is_atom( tmp ) && !objid)
+					objid = nfstrdup( tmp->val );
+				else
+					error( "IMAP error: unable to parse X-GM-MSGID\n" );
 			} else if (!strcmp( "BODY[]", tmp->val )) {
 				tmp = tmp->next;
 				if (is_atom( tmp )) {
@@ -1082,14 +1114,14 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 	}
 
 	if (!uid) {
-		assert( !body && !tuid && !msgid );
+		assert( !body && !tuid && !msgid && !objid );
 		// Ignore async flag updates for now.
 	} else if ((cmdp = ctx->in_progress) && cmdp->param.lastuid) {
-		assert( !body && !tuid && !msgid );
+		assert( !body && !tuid && !msgid && !objid );
 		// Workaround for server not sending UIDNEXT and/or APPENDUID.
 		ctx->uidnext = uid + 1;
 	} else if (body) {
-		assert( !tuid && !msgid );
+		assert( !tuid && !msgid && !objid );
 		for (cmdp = ctx->in_progress; cmdp; cmdp = cmdp->next)
 			if (cmdp->param.uid == uid)
 				goto gotuid;
@@ -1114,6 +1146,7 @@ parse_fetch_rsp( imap_store_t *ctx, list_t *list, char *s ATTR_UNUSED )
 		cur->gen.size = size;
 		cur->gen.srec = 0;
 		cur->gen.msgid = msgid;
+		cur->gen.objid = objid;
 		if (tuid)
 			memcpy( cur->gen.tuid, tuid, TUIDL );
 		else
@@ -1177,6 +1210,13 @@ parse_response_code( imap_store_t *ctx, imap_cmd_t *cmd, char *s )
 			error( "IMAP error: malformed UIDNEXT status\n" );
 			return RESP_CANCEL;
 		}
+	} else if (!strcmp( "HIGHESTMODSEQ", arg )) {
+		if (!(arg = next_arg( &s )) ||
+		    (ctx->highestmodseq = strtoull( arg, &earg, 10 ), *earg))
+		{
+			error( "IMAP error: malformed HIGHESTMODSEQ status\n" );
+			return RESP_CANCEL;
+		}
 	} else if (!strcmp( "CAPABILITY", arg )) {
 		parse_capability( ctx, s );
 	} else if (!strcmp( "ALERT", arg )) {
@@ -1198,6 +1238,45 @@ parse_response_code( imap_store_t *ctx, imap_cmd_t *cmd, char *s )
 	return RESP_OK;
 }
 
+static imap_box_status_t *
+find_box_status( imap_store_t *ctx, const char *name, int create )
+{
+	imap_box_status_t *bs;
+	int nl;
+
+	for (bs = ctx->box_status; bs; bs = bs->next)
+		if (!strcmp( bs->name, name ))
+			return bs;
+	if (!create)
+		return 0;
+	nl = strlen( name );
+	bs = nfcalloc( sizeof(*bs) + nl );
+	memcpy( bs->name, name, nl + 1 );
+	bs->next = ctx->box_status;
+	ctx->box_status = bs;
+	return bs;
+}
+
+static void
+forget_box_status( imap_store_t *ctx, const char *name )
+{
+	imap_box_status_t *bs;
+
+	if ((bs = find_box_status( ctx, name, 0 )))
+		bs->valid = 0;
+}
+
+static void
+free_box_status( imap_box_status_t *bs )
+{
+	imap_box_status_t *nbs;
+
+	for (; bs; bs = nbs) {
+		nbs = bs->next;
+		free( bs );
+	}
+}
+
 static int parse_list_rsp_p1( imap_store_t *, list_t *, char * );
 static int parse_list_rsp_p2( imap_store_t *, list_t *, char * );
 
@@ -1296,11 +1375,65 @@ parse_list_rsp_p2( imap_store_t *ctx, list_t *list, char *cmd ATTR_UNUSED )
 	}
 	narg->next = ctx->boxes;
 	ctx->boxes = narg;
+	find_box_status( ctx, list->val, 1 );
   skip:
 	free_list( list );
 	return LIST_OK;
 }
 
+static int parse_status_rsp_p2( imap_store_t *, list_t *, char * );
+
+static int
+parse_status_rsp( imap_store_t *ctx, list_t *list, char *cmd )
+{
+	if (!is_atom( list )) {
+		error( "IMAP error: malformed STATUS response\n" );
+		free_list( list );
+		return LIST_BAD;
+	}
+	if (is_inbox( ctx, list->val, list->len ))
+		memcpy( list->val, "INBOX", 5 );
+	ctx->status_box = find_box_status( ctx, list->val, 1 );
+	free_list( list );
+	return parse_list( ctx, cmd, parse_status_rsp_p2 );
+}
+
+static int
+parse_status_rsp_p2( imap_store_t *ctx, list_t *list, char *cmd ATTR_UNUSED )
+{
+	imap_box_status_t *bs = ctx->status_box;
+	list_t *lp;
+	ullong val;
+	char *ep;
+
+	if (!is_list( list )) {
+	  bad:
+		error( "IMAP error: malformed STATUS response\n" );
+		free_list( list );
+		return LIST_BAD;
+	}
+	bs->valid = 0;
+	bs->highestmodseq = 0;
+	for (lp = list->child; lp; lp = lp->next->next) {
+		if (!is_atom( lp ) || !is_atom( lp->next ))
+			goto bad;
+		val = strtoull( lp->next->val, &ep, 10 );
+		if (*ep)
+			goto bad;
+		if (!strcmp( "UIDVALIDITY", lp->val ))
+			bs->uidvalidity = val;
+		else if (!strcmp( "UIDNEXT", lp->val ))
+			bs->uidnext = val;
+		else if (!strcmp( "MESSAGES", lp->val ))
+			bs->messages = val;
+		else if (!strcmp( "HIGHESTMODSEQ", lp->val ))
+			bs->highestmodseq = val;
+	}
+	bs->valid = 1;
+	free_list( list );
+	return LIST_OK;
+}
+
 static int
 prepare_name( char **buf, const imap_store_t *ctx, const char *prefix, const char *name )
 {
@@ -1424,6 +1557,9 @@ imap_socket_read( void *aux )
 			} else if (!strcmp( "NAMESPACE", arg )) {
 				resp = parse_list( ctx, cmd, parse_namespace_rsp );
 				goto listret;
+			} else if (!strcmp( "STATUS", arg )) {
+				resp = parse_list( ctx, cmd, parse_status_rsp );
+				goto listret;
 			} else if ((arg1 = next_arg( &cmd ))) {
 				if (!strcmp( "EXISTS", arg1 ))
 					ctx->total_msgs = atoi( arg );
@@ -1565,6 +1701,7 @@ imap_cleanup_store( imap_store_t *ctx )
 {
 	free_generic_messages( ctx->msgs );
 	free_string_list( ctx->boxes );
+	free_box_status( ctx->box_status );
 }
 
 static void
@@ -2437,6 +2574,7 @@ imap_select_box( store_t *gctx, const char *name )
 	ctx->msgapp = &ctx->msgs;
 
 	ctx->name = name;
+	ctx->highestmodseq = 0;
 	return DRV_OK;
 }
 
@@ -2446,6 +2584,31 @@ imap_get_box_path( store_t *gctx ATTR_UNUSED )
 	return 0;
 }
 
+static const char *
+imap_get_box_fingerprint( store_t *gctx )
+{
+	imap_store_t *ctx = (imap_store_t *)gctx;
+	imap_box_status_t *bs;
+	char *buf;
+
+	// Once the box is selected, the SELECT response tells the same.
+	if (ctx->highestmodseq && ctx->uidnext) {
+		nfsnprintf( ctx->fingerprint, sizeof(ctx->fingerprint), "%u %u %u %llu",
+		            ctx->uidvalidity, ctx->uidnext, ctx->total_msgs, ctx->highestmodseq );
+		return ctx->fingerprint;
+	}
+	if (!ctx->box_status || prepare_box( &buf, ctx ) < 0)
+		return 0;
+	bs = find_box_status( ctx, buf, 0 );
+	free( buf );
+	// Without a HIGHESTMODSEQ, flag changes would go unnoticed.
+	if (!bs || !bs->valid || !bs->highestmodseq)
+		return 0;
+	nfsnprintf( ctx->fingerprint, sizeof(ctx->fingerprint), "%u %u %u %llu",
+	            bs->uidvalidity, bs->uidnext, bs->messages, bs->highestmodseq );
+	return ctx->fingerprint;
+}
+
 typedef struct {
 	imap_cmd_t gen;
 	void (*callback)( int sts, int uidvalidity, void *aux );
@@ -2469,8 +2632,11 @@ imap_open_box( store_t *gctx,
 		return;
 	}
 
+	// We are about to modify the box, so the listed status becomes stale.
+	forget_box_status( ctx, buf );
 	ctx->uidvalidity = UIDVAL_BAD;
 	ctx->uidnext = 0;
+	ctx->highestmodseq = 0;
 
 	INIT_IMAP_CMD(imap_cmd_open_box_t, cmd, cb, aux)
 	cmd->gen.param.failok = 1;
@@ -2686,8 +2852,9 @@ imap_load_box( store_t *gctx, uint minuid, uint maxuid, uint newuid, uint seenui
 				                                  shifted_bit( ctx->opts, OPEN_NEW_SIZE, WantSize), seenuid );
 			if (ctx->opts & OPEN_FIND)
 				imap_set_range( ranges, &nranges, 0, WantTuids, newuid - 1 );
-			if (ctx->opts & OPEN_OLD_IDS)
-				imap_set_range( ranges, &nranges, WantMsgids, 0, seenuid );
+			if (ctx->opts & (OPEN_OLD_IDS | OPEN_NEW_IDS))
+				imap_set_range( ranges, &nranges, shifted_bit( ctx->opts, OPEN_OLD_IDS, WantMsgids ),
+				                                  shifted_bit( ctx->opts, OPEN_NEW_IDS, WantMsgids ), seenuid );
 			for (int r = 0; r < nranges; r++) {
 				sprintf( buf, "%u:%u", ranges[r].first, ranges[r].last );
 				imap_submit_load( ctx, buf, ranges[r].flags, sts );
@@ -2745,9 +2912,10 @@ static void
 imap_submit_load( imap_store_t *ctx, const char *buf, int flags, imap_load_box_state_t *sts )
 {
 	imap_exec( ctx, imap_refcounted_new_cmd( &sts->gen ), imap_submit_load_p2,
-	           "UID FETCH %s (UID%s%s%s%s%s%s%s)", buf,
+	           "UID FETCH %s (UID%s%s%s%s%s%s%s%s)", buf,
 	           (ctx->opts & OPEN_FLAGS) ? " FLAGS" : "",
 	           (flags & WantSize) ? " RFC822.SIZE" : "",
+	           !(flags & WantMsgids) ? "" : CAP(OBJECTID) ? " EMAILID" : CAP(X_GM_EXT_1) ? " X-GM-MSGID" : "",
 	           (flags & (WantTuids | WantMsgids)) ? " BODY.PEEK[HEADER.FIELDS (" : "",
 	           (flags & WantTuids) ? "X-TUID" : "",
 	           !(~flags & (WantTuids | WantMsgids)) ? " " : "",
@@ -2851,6 +3019,7 @@ imap_set_msg_flags( store_t *gctx, message_t *msg, uint uid, int add, int del,
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
+	ctx->highestmodseq = 0;
 	if (msg) {
 		uid = msg->uid;
 		add &= ~msg->flags;
@@ -2902,6 +3071,7 @@ imap_close_box( store_t *gctx,
 {
 	imap_store_t *ctx = (imap_store_t *)gctx;
 
+	ctx->highestmodseq = 0;
 	if (ctx->gen.conf->trash && CAP(UIDPLUS)) {
 		INIT_REFCOUNTED_STATE(imap_expunge_state_t, sts, cb, aux)
 		message_t *msg, *fmsg, *nmsg;
@@ -2967,6 +3137,7 @@ imap_trash_msg( store_t *gctx, message_t *msg,
 		cb( DRV_BOX_BAD, aux );
 		return;
 	}
+	forget_box_status( ctx, buf );
 	imap_exec( ctx, &cmd->gen, imap_done_simple_msg,
 	           CAP(MOVE) ? "UID MOVE %u \"%\\s\"" : "UID COPY %u \"%\\s\"", msg->uid, buf );
 	free( buf );
@@ -2992,6 +3163,8 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 	int d;
 	char flagstr[128], datestr[64];
 
+	if (!to_trash)
+		ctx->highestmodseq = 0;
 	d = 0;
 	if (data->flags) {
 		d = imap_make_flags( data->flags, flagstr );
@@ -3018,6 +3191,7 @@ imap_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
 			return;
 		}
 	}
+	forget_box_status( ctx, buf );
 	if (data->date) {
 		/* configure ensures that %z actually works. */
 		my_strftime( datestr, sizeof(datestr), "%d-%b-%Y %H:%M:%S %z", localtime( &data->date ) );
@@ -3039,6 +3213,16 @@ imap_store_msg_p2( imap_store_t *ctx ATTR_UNUSED, imap_cmd_t *cmd, int response
 	cmdp->callback( response, cmdp->out_uid, cmdp->callback_aux );
 }
 
+/******************* imap_link_msg *******************/
+
+static void
+imap_link_msg( store_t *gctx ATTR_UNUSED, const char *key ATTR_UNUSED, int flags ATTR_UNUSED,
+               void (*cb)( int sts, uint uid, void *aux ), void *aux )
+{
+	// Copying across boxes would need to know the source box and UID.
+	cb( DRV_MSG_BAD, 0, aux );
+}
+
 /******************* imap_find_new_msgs *******************/
 
 static void imap_find_new_msgs_p2( imap_store_t *, imap_cmd_t *, int );
@@ -3117,10 +3301,14 @@ typedef struct {
 	imap_cmd_refcounted_state_t gen;
 	void (*callback)( int sts, string_list_t *, void *aux );
 	void *callback_aux;
+	char want_status;
 } imap_list_store_state_t;
 
+#define STATUS_ITEMS "(UIDVALIDITY UIDNEXT MESSAGES HIGHESTMODSEQ)"
+
 static void imap_list_store_p2( imap_store_t *, imap_cmd_t *, int );
 static void imap_list_store_p3( imap_store_t *, imap_list_store_state_t * );
+static void imap_list_store_status_p2( imap_store_t *, imap_cmd_t *, int );
 
 static void
 imap_list_store( store_t *gctx, int flags,
@@ -3143,21 +3331,34 @@ imap_list_store( store_t *gctx, int flags,
 	// both      | P [I] | I [P] | I + P
 	// path      | P [i] | i [P] | P
 	//
+	//
+	// With LIST_BOX_STATUS, the boxes' status is obtained as well, so unchanged
+	// boxes need not be SELECTed later on. Without a HIGHESTMODSEQ, the status
+	// would be useless for that purpose, so CONDSTORE is required. If the server
+	// does not support LIST-STATUS (RFC 5819), we pipeline STATUS commands.
 	int pfx_is_empty = !*ctx->prefix;
 	int pfx_is_inbox = !pfx_is_empty && is_inbox( ctx, ctx->prefix, -1 );
+	const char *ret = "";
+	sts->want_status = 0;
+	if ((flags & LIST_BOX_STATUS) && CAP(CONDSTORE)) {
+		if (CAP(LIST_STATUS))
+			ret = " RETURN (STATUS " STATUS_ITEMS ")";
+		else
+			sts->want_status = 1;
+	}
 	if (((flags & (LIST_PATH | LIST_PATH_MAYBE)) || pfx_is_empty) && !pfx_is_inbox && !(ctx->listed & LIST_PATH)) {
 		ctx->listed |= LIST_PATH;
 		if (pfx_is_empty)
 			ctx->listed |= LIST_INBOX;
 		imap_exec( ctx, imap_refcounted_new_cmd( &sts->gen ), imap_list_store_p2,
-		           "LIST \"\" \"%\\s*\"", ctx->prefix );
+		           "LIST \"\" \"%\\s*\"%s", ctx->prefix, ret );
 	}
 	if (((flags & LIST_INBOX) || pfx_is_inbox) && !pfx_is_empty && !(ctx->listed & LIST_INBOX)) {
 		ctx->listed |= LIST_INBOX;
 		if (pfx_is_inbox)
 			ctx->listed |= LIST_PATH;
 		imap_exec( ctx, imap_refcounted_new_cmd( &sts->gen ), imap_list_store_p2,
-		           "LIST \"\" INBOX*" );
+		           "LIST \"\" INBOX*%s", ret );
 	}
 	imap_list_store_p3( ctx, sts );
 }
@@ -3166,8 +3367,29 @@ static void
 imap_list_store_p2( imap_store_t *ctx, imap_cmd_t *cmd, int response )
 {
 	imap_list_store_state_t *sts = (imap_list_store_state_t *)((imap_cmd_refcounted_t *)cmd)->state;
+	imap_box_status_t *bs;
 
 	transform_refcounted_box_response( &sts->gen, response );
+	if (sts->want_status && sts->gen.ret_val == DRV_OK) {
+		for (bs = ctx->box_status; bs; bs = bs->next) {
+			if (bs->queried)
+				continue;
+			bs->queried = 1;
+			imap_exec( ctx, imap_refcounted_new_cmd( &sts->gen ), imap_list_store_status_p2,
+			           "STATUS \"%\\s\" " STATUS_ITEMS, bs->name );
+		}
+	}
+	imap_list_store_p3( ctx, sts );
+}
+
+static void
+imap_list_store_status_p2( imap_store_t *ctx, imap_cmd_t *cmd, int response )
+{
+	imap_list_store_state_t *sts = (imap_list_store_state_t *)((imap_cmd_refcounted_t *)cmd)->state;
+
+	// A box which cannot be STATUSed is simply treated as having changed.
+	if (response == RESP_CANCEL)
+		sts->gen.ret_val = DRV_CANCELED;
 	imap_list_store_p3( ctx, sts );
 }
 
@@ -3534,6 +3756,7 @@ struct driver imap_driver = {
 	imap_list_store,
 	imap_select_box,
 	imap_get_box_path,
+	imap_get_box_fingerprint,
 	imap_create_box,
 	imap_open_box,
 	imap_get_uidnext,
@@ -3544,6 +3767,7 @@ struct driver imap_driver = {
 	imap_load_box,
 	imap_fetch_msg,
 	imap_store_msg,
+	imap_link_msg,
 	imap_find_new_msgs,
 	imap_set_msg_flags,
 	imap_trash_msg,
@@ -36,6 +36,13 @@
 #include <errno.h>
 #include <time.h>
 #include <utime.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
 
 #if !defined(_POSIX_SYNCHRONIZED_IO) || _POSIX_SYNCHRONIZED_IO <= 0
 # define fdatasync fsync
@@ -45,6 +52,19 @@
 #include <db.h>
 #endif /* USE_DB */
 
+#ifdef HAVE_LIBSSL
+#include <openssl/evp.h>
+#endif /* HAVE_LIBSSL */
+
+// Hard links to the messages stored with a key, so link_msg() can find them
+// regardless of the box they live in now and of their current file names.
+// Entries whose messages vanished are recognized by their link count; they
+// are kept for a while, as the message may re-appear in a box synced later.
+#define LINKS_DIR ".mbsynclinks"
+#define CACHE_FILE ".mbsynccache"
+#define UIDMAP_FILE ".mbsyncuidmap"
+#define LINKS_GRACE (7 * 24 * 60 * 60)
+
 #define SUB_UNSET      0
 #define SUB_VERBATIM   1
 #define SUB_MAILDIRPP  2
@@ -53,12 +73,13 @@
 typedef struct {
 	store_conf_t gen;
 	char *inbox;
-#ifdef USE_DB
 	int alt_map;
-#endif /* USE_DB */
 	char info_delimiter;
 	char sub_style;
 	char failed;
+#ifdef HAVE_LIBSSL
+	char dedup;
+#endif /* HAVE_LIBSSL */
 	char *info_prefix, *info_stop; /* precalculated from info_delimiter */
 } maildir_store_conf_t;
 
@@ -67,18 +88,59 @@ typedef struct {
 	char *base;
 } maildir_message_t;
 
+/* What maildir_scan() learned about a message. Maildir messages are never
+ * modified in place, so entries are keyed by the unique part of the file
+ * name and remain valid across flag changes and moves between new/ and cur/. */
+typedef struct {
+	char *key; /* own */
+	char *msgid; /* own; null if absent or unknown */
+	int size; /* -1 if unknown */
+	char tuid[TUIDL]; /* empty if absent or unknown */
+	uchar hdr; /* msgid and tuid are known */
+	uchar seen; /* the message was seen by the current scan */
+} cache_ent_t;
+
+DEFINE_ARRAY_TYPE(cache_ent_t)
+
 typedef struct {
+	const char *key; // not terminated; points into the UID map
+	uint klen;
+	uint uid;
+	uchar seen; // the message was seen by the current scan
+} uidmap_ent_t;
+
+DEFINE_ARRAY_TYPE(uidmap_ent_t)
+
+typedef struct maildir_store {
 	store_t gen;
 	uint opts;
 	int uvfd, uvok, is_inbox, fresh[3];
 	uint minuid, maxuid, newuid, seenuid, uidvalidity, nuid;
+	uint resuid, resend, resuv; // UIDs (resuid, resend] of UIDVALIDITY resuv are reserved for us
+	uint resgrow; // log2 of the minimal size of the next reservation
+	struct maildir_store *next_reserver; // in Reservers, if reserving is set
+	char reserving;
 	uint_array_t excs;
 	char *path; /* own */
 	char *trash;
+	int dfd[3], tfd[3]; // cur/, new/ and tmp/ of the box and the trash; see maildir_dir_fd()
+	char *links; // directory of link_msg() sources
+	int pruned_links; // messages were removed, so links may have become stale
 #ifdef USE_DB
 	DB *db;
 	char *usedb;
 #endif /* USE_DB */
+	char *uidmap; // own; path of UIDMAP_FILE, if the alternative scheme is used
+	int um_fd;
+	char *um_data; // contents of the UID map
+	size_t um_len;
+	ino_t um_ino;
+	off_t um_size;
+	uidmap_ent_t_array_alloc_t um_ents; // sorted by key, unique
+	int um_nlog; // log records in the UID map
+	char um_loaded;
+	char *um_pend; // log records yet to be appended
+	int um_pend_len, um_pend_size;
 	string_list_t *boxes; // _list results
 	char listed; // was _list already run with these flags?
 	// note that the message counts do _not_ reflect stats from msgs,
@@ -86,6 +148,15 @@ typedef struct {
 	int total_msgs, recent_msgs;
 	message_t *msgs;
 	wakeup_t lcktmr;
+	wakeup_t scantmr; // deferred load_box() scan
+	cache_ent_t_array_alloc_t cache; // contents of CACHE_FILE
+	int cache_sorted; // length of the sorted prefix of cache
+	char cache_loaded, cache_dirty;
+	void (*load_cb)( int sts, message_t *msgs, int total_msgs, int recent_msgs, void *aux );
+	void *load_aux;
+	char fingerprint[80];
+	async_queue_t io; // file operations offloaded by storing and flagging commands
+	int store_mem; // what pending stores hold; see maildir_store_charge()
 
 	void (*bad_callback)( void *aux );
 	void *bad_callback_aux;
@@ -98,6 +169,9 @@ static struct flock lck;
 
 static int MaildirCount;
 
+// Stores holding UID reservations, which are given back when exiting.
+static maildir_store_t *Reservers;
+
 static void ATTR_PRINTFLIKE(1, 2)
 debug( const char *msg, ... )
 {
@@ -219,6 +293,136 @@ maildir_validate_path( maildir_store_conf_t *conf )
 }
 
 static void lcktmr_timeout( void *aux );
+static void maildir_cache_free( maildir_store_t *ctx );
+static void maildir_forget_reservation( maildir_store_t *ctx );
+static void maildir_release_uids( maildir_store_t *ctx );
+static void maildir_uidmap_free( maildir_store_t *ctx );
+static int maildir_uidmap_compact( maildir_store_t *ctx, int reset );
+static int maildir_uidmap_flush( maildir_store_t *ctx );
+static int maildir_uidmap_check( maildir_store_t *ctx );
+static void scantmr_timeout( void *aux );
+
+static const char *subdirs[] = { "cur", "new", "tmp" };
+
+#ifdef HAVE_OPENAT
+# ifdef O_PATH
+#  define DIR_FD_FLAGS (O_PATH | O_DIRECTORY)
+# else
+#  define DIR_FD_FLAGS (O_RDONLY | O_DIRECTORY)
+# endif
+# define AT_FD(dfd) ((dfd) >= 0 ? (dfd) : AT_FDCWD)
+# define AT_NAME(dfd, path, off) ((dfd) >= 0 ? (path) + (off) : (path))
+#endif
+
+/* Return a descriptor of the subfolder sub of the mailbox at path, opening
+ * it on first use. Message files are accessed relative to it, which saves
+ * the kernel resolving the whole path (which may be expensive on network
+ * file systems) each time. -1 means that full paths need to be used. */
+static int
+maildir_dir_fd( int *fds, const char *path, int sub )
+{
+#ifdef HAVE_OPENAT
+	char buf[_POSIX_PATH_MAX];
+
+	if (fds[sub] < 0) {
+		nfsnprintf( buf, sizeof(buf), "%s/%s", path, subdirs[sub] );
+		fds[sub] = open( buf, DIR_FD_FLAGS );
+	}
+	return fds[sub];
+#else
+	(void)fds; (void)path; (void)sub;
+	return -1;
+#endif
+}
+
+static void
+maildir_close_dir_fds( int *fds )
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (fds[i] >= 0) {
+			close( fds[i] );
+			fds[i] = -1;
+		}
+	}
+}
+
+/* Wrappers for file operations on full paths, which use the directory
+ * descriptor dfd for the part of the path below path + off where possible. */
+
+static int
+maildir_open_at( int dfd, const char *path, int off, int flags )
+{
+#ifdef HAVE_OPENAT
+	return openat( AT_FD(dfd), AT_NAME(dfd, path, off), flags, 0600 );
+#else
+	(void)dfd; (void)off;
+	return open( path, flags, 0600 );
+#endif
+}
+
+static int
+maildir_stat_at( int dfd, const char *path, int off, struct stat *st )
+{
+#ifdef HAVE_OPENAT
+	return fstatat( AT_FD(dfd), AT_NAME(dfd, path, off), st, 0 );
+#else
+	(void)dfd; (void)off;
+	return stat( path, st );
+#endif
+}
+
+static int
+maildir_unlink_at( int dfd, const char *path, int off )
+{
+#ifdef HAVE_OPENAT
+	return unlinkat( AT_FD(dfd), AT_NAME(dfd, path, off), 0 );
+#else
+	(void)dfd; (void)off;
+	return unlink( path );
+#endif
+}
+
+static int
+maildir_rename_at( int odfd, const char *opath, int ooff, int ndfd, const char *npath, int noff )
+{
+#ifdef HAVE_OPENAT
+	return renameat( AT_FD(odfd), AT_NAME(odfd, opath, ooff), AT_FD(ndfd), AT_NAME(ndfd, npath, noff) );
+#else
+	(void)odfd; (void)ooff; (void)ndfd; (void)noff;
+	return rename( opath, npath );
+#endif
+}
+
+static int
+maildir_link_at( int odfd, const char *opath, int ooff, int ndfd, const char *npath, int noff )
+{
+#ifdef HAVE_OPENAT
+	return linkat( AT_FD(odfd), AT_NAME(odfd, opath, ooff), AT_FD(ndfd), AT_NAME(ndfd, npath, noff), 0 );
+#else
+	(void)odfd; (void)ooff; (void)ndfd; (void)noff;
+	return link( opath, npath );
+#endif
+}
+
+static int
+maildir_utime_at( int dfd, const char *path, int off, time_t date )
+{
+#if defined(HAVE_OPENAT) && defined(HAVE_UTIMENSAT)
+	struct timespec times[2];
+
+	times[0].tv_sec = times[1].tv_sec = date;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	return utimensat( AT_FD(dfd), AT_NAME(dfd, path, off), times, 0 );
+#else
+	struct utimbuf utimebuf;
+
+	(void)dfd; (void)off;
+	utimebuf.actime = utimebuf.modtime = date;
+	return utime( path, &utimebuf );
+#endif
+}
 
 static store_t *
 maildir_alloc_store( store_conf_t *gconf, const char *label ATTR_UNUSED )
@@ -229,7 +433,11 @@ maildir_alloc_store( store_conf_t *gconf, const char *label ATTR_UNUSED )
 	ctx->gen.driver = &maildir_driver;
 	ctx->gen.conf = gconf;
 	ctx->uvfd = -1;
+	ctx->dfd[0] = ctx->dfd[1] = ctx->dfd[2] = -1;
+	ctx->tfd[0] = ctx->tfd[1] = ctx->tfd[2] = -1;
+	init_async_queue( &ctx->io );
 	init_wakeup( &ctx->lcktmr, lcktmr_timeout, ctx );
+	init_wakeup( &ctx->scantmr, scantmr_timeout, ctx );
 	return &ctx->gen;
 }
 
@@ -248,9 +456,37 @@ maildir_connect_store( store_t *gctx,
 		cb( DRV_STORE_BAD, aux );
 		return;
 	}
+	if (conf->gen.path)
+		nfasprintf( &ctx->links, "%s" LINKS_DIR, conf->gen.path );
+	else
+		nfasprintf( &ctx->links, "%s/" LINKS_DIR, conf->inbox );
 	cb( DRV_OK, aux );
 }
 
+static void
+maildir_prune_links( maildir_store_t *ctx )
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	time_t cutoff;
+	int bl;
+	char buf[_POSIX_PATH_MAX];
+
+	if (!(dir = opendir( ctx->links )))
+		return;
+	cutoff = time( 0 ) - LINKS_GRACE;
+	bl = nfsnprintf( buf, sizeof(buf), "%s/", ctx->links );
+	while ((de = readdir( dir ))) {
+		if (*de->d_name == '.')
+			continue;
+		nfsnprintf( buf + bl, sizeof(buf) - bl, "%s", de->d_name );
+		if (!stat( buf, &st ) && st.st_nlink == 1 && st.st_ctime < cutoff)
+			unlink( buf );
+	}
+	closedir( dir );
+}
+
 static void
 free_maildir_messages( message_t *msg )
 {
@@ -268,6 +504,7 @@ maildir_cleanup( store_t *gctx )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 
+	cancel_async( &ctx->io );
 	free_maildir_messages( ctx->msgs );
 #ifdef USE_DB
 	if (ctx->db)
@@ -276,9 +513,16 @@ maildir_cleanup( store_t *gctx )
 #endif /* USE_DB */
 	free( ctx->path );
 	free( ctx->excs.data );
+	maildir_cache_free( ctx );
+	maildir_uidmap_free( ctx );
+	if (pending_wakeup( &ctx->lcktmr ))
+		maildir_release_uids( ctx );
+	maildir_forget_reservation( ctx );
 	if (ctx->uvfd >= 0)
 		close( ctx->uvfd );
+	maildir_close_dir_fds( ctx->dfd );
 	conf_wakeup( &ctx->lcktmr, -1 );
+	conf_wakeup( &ctx->scantmr, -1 );
 }
 
 static void
@@ -288,6 +532,11 @@ maildir_free_store( store_t *gctx )
 
 	maildir_cleanup( gctx );
 	wipe_wakeup( &ctx->lcktmr );
+	wipe_wakeup( &ctx->scantmr );
+	if (ctx->pruned_links)
+		maildir_prune_links( ctx );
+	maildir_close_dir_fds( ctx->tfd );
+	free( ctx->links );
 	free( ctx->trash );
 	free_string_list( ctx->boxes );
 	free( gctx );
@@ -414,6 +663,8 @@ maildir_list_recurse( maildir_store_t *ctx, int isBox, int flags,
 		pl = nfsnprintf( path + pathLen, _POSIX_PATH_MAX - pathLen, "%s", ent );
 		if (pl == 3 && (!memcmp( ent, "cur", 3 ) || !memcmp( ent, "new", 3 ) || !memcmp( ent, "tmp", 3 )))
 			continue;
+		if (equals( ent, pl, LINKS_DIR, strlen( LINKS_DIR ) ))
+			continue;
 		pl += pathLen;
 		if (inbox && equals( path, pl, inbox, inboxLen )) {
 			// Inbox nested into Path.
@@ -517,7 +768,6 @@ maildir_list_store( store_t *gctx, int flags,
 	}
 }
 
-static const char *subdirs[] = { "cur", "new", "tmp" };
 
 typedef struct {
 	char *base;
@@ -542,6 +792,160 @@ maildir_free_scan( msg_t_array_alloc_t *msglist )
 	}
 }
 
+static void
+maildir_cache_free( maildir_store_t *ctx )
+{
+	int i;
+
+	for (i = 0; i < ctx->cache.array.size; i++) {
+		free( ctx->cache.array.data[i].key );
+		free( ctx->cache.array.data[i].msgid );
+	}
+	free( ctx->cache.array.data );
+	ARRAY_INIT( &ctx->cache );
+	ctx->cache_sorted = 0;
+	ctx->cache_loaded = ctx->cache_dirty = 0;
+}
+
+/* The unique part of a message file name, i.e., without the UID and flags. */
+static const char *
+maildir_cache_key( maildir_store_conf_t *conf, const char *base, char *buf, int bufsz )
+{
+	const char *u, *ru, *e;
+	int l;
+
+	if (!(e = strchr( base, conf->info_delimiter )))
+		e = base + strlen( base );
+	if ((u = strstr( base, ",U=" )) && u < e) {
+		for (ru = u + 3; isdigit( (uchar)*ru ); ru++);
+		l = nfsnprintf( buf, bufsz, "%.*s%.*s", (int)(u - base), base, (int)(e - ru), ru );
+	} else {
+		l = nfsnprintf( buf, bufsz, "%.*s", (int)(e - base), base );
+	}
+	// Such keys would break the file format; those messages are just not cached.
+	return strpbrk( buf, " \n" ) || !l ? 0 : buf;
+}
+
+static int
+maildir_cache_compare( const void *l, const void *r )
+{
+	return strcmp( ((const cache_ent_t *)l)->key, ((const cache_ent_t *)r)->key );
+}
+
+static void
+maildir_cache_sort( maildir_store_t *ctx )
+{
+	if (ctx->cache_sorted != ctx->cache.array.size) {
+		qsort( ctx->cache.array.data, ctx->cache.array.size, sizeof(cache_ent_t), maildir_cache_compare );
+		ctx->cache_sorted = ctx->cache.array.size;
+	}
+}
+
+static cache_ent_t *
+maildir_cache_find( maildir_store_t *ctx, const char *key )
+{
+	cache_ent_t ce;
+
+	ce.key = (char *)key;
+	return bsearch( &ce, ctx->cache.array.data, ctx->cache_sorted, sizeof(cache_ent_t), maildir_cache_compare );
+}
+
+static cache_ent_t *
+maildir_cache_add( maildir_store_t *ctx, const char *key )
+{
+	cache_ent_t *ce = cache_ent_t_array_append( &ctx->cache );
+
+	memset( ce, 0, sizeof(*ce) );
+	ce->key = nfstrdup( key );
+	ce->size = -1;
+	ce->seen = 1;
+	ctx->cache_dirty = 1;
+	return ce;
+}
+
+/* Lines are "<key> <size>", followed by " <tuid> <msgid>" if the header
+ * was parsed. Absent values are written as "-". The Message-ID goes last,
+ * as it may contain spaces. */
+static void
+maildir_cache_load( maildir_store_t *ctx )
+{
+	FILE *f;
+	cache_ent_t *ce;
+	char *p, *q;
+	char buf[_POSIX_PATH_MAX + 1100];
+
+	ctx->cache_loaded = 1;
+	nfsnprintf( buf, sizeof(buf), "%s/" CACHE_FILE, ctx->path );
+	if (!(f = fopen( buf, "r" ))) {
+		if (errno != ENOENT)
+			sys_error( "Maildir warning: cannot read %s", buf );
+		return;
+	}
+	while (fgets( buf, sizeof(buf), f )) {
+		if (!(p = strchr( buf, '\n' )))
+			break;  // Truncated
+		*p = 0;
+		if (!(p = strchr( buf, ' ' )))
+			continue;
+		*p++ = 0;
+		ce = maildir_cache_add( ctx, buf );
+		ce->seen = 0;
+		ce->size = strtol( p, &q, 10 );
+		if (*q == ' ' && (p = strchr( q + 1, ' ' ))) {
+			if (p - (q + 1) == TUIDL)
+				memcpy( ce->tuid, q + 1, TUIDL );
+			if (strcmp( p + 1, "-" ))
+				ce->msgid = nfstrdup( p + 1 );
+			ce->hdr = 1;
+		}
+	}
+	fclose( f );
+	ctx->cache_dirty = 0;
+	maildir_cache_sort( ctx );
+}
+
+static void
+maildir_cache_save( maildir_store_t *ctx )
+{
+	FILE *f;
+	cache_ent_t *ce;
+	int i;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+
+	for (i = 0; i < ctx->cache.array.size; i++)
+		if (!ctx->cache.array.data[i].seen)
+			ctx->cache_dirty = 1;
+	if (!ctx->cache_dirty)
+		return;
+	maildir_cache_sort( ctx );
+	nfsnprintf( buf, sizeof(buf), "%s/" CACHE_FILE, ctx->path );
+	nfsnprintf( nbuf, sizeof(nbuf), "%s/" CACHE_FILE ".new", ctx->path );
+	if (!(f = fopen( nbuf, "w" ))) {
+		sys_error( "Maildir warning: cannot write %s", nbuf );
+		return;
+	}
+	for (i = 0; i < ctx->cache.array.size; i++) {
+		ce = &ctx->cache.array.data[i];
+		if (!ce->seen)
+			continue;
+		fprintf( f, "%s %d", ce->key, ce->size );
+		if (ce->hdr) {
+			if (ce->tuid[0])
+				fprintf( f, " %.*s", TUIDL, ce->tuid );
+			else
+				fputs( " -", f );
+			fprintf( f, " %s", ce->msgid ? ce->msgid : "-" );
+		}
+		putc( '\n', f );
+	}
+	if (fclose( f ) || rename( nbuf, buf )) {
+		sys_error( "Maildir warning: cannot write %s", buf );
+		unlink( nbuf );
+		return;
+	}
+	ctx->cache_dirty = 0;
+}
+
 #define _24_HOURS (3600 * 24)
 
 static int
@@ -652,7 +1056,7 @@ make_key( const char *info_stop, DBT *tkey, char *name )
 #endif /* USE_DB */
 
 static int
-maildir_store_uidval( maildir_store_t *ctx )
+maildir_write_uidval( maildir_store_t *ctx )
 {
 	int n;
 #ifdef USE_DB
@@ -687,7 +1091,17 @@ maildir_store_uidval( maildir_store_t *ctx )
 			return DRV_BOX_BAD;
 		}
 	}
-	conf_wakeup( &ctx->lcktmr, 2 );
+	return DRV_OK;
+}
+
+static int
+maildir_store_uidval( maildir_store_t *ctx )
+{
+	int ret;
+
+	if ((ret = maildir_write_uidval( ctx )) != DRV_OK)
+		return ret;
+	conf_wakeup( &ctx->lcktmr, 2000 );
 	return DRV_OK;
 }
 
@@ -696,6 +1110,7 @@ maildir_init_uidval( maildir_store_t *ctx )
 {
 	ctx->uidvalidity = time( 0 );
 	ctx->nuid = 0;
+	maildir_forget_reservation( ctx );
 	ctx->uvok = 0;
 #ifdef USE_DB
 	if (ctx->db) {
@@ -703,6 +1118,11 @@ maildir_init_uidval( maildir_store_t *ctx )
 		ctx->db->truncate( ctx->db, 0, &count, 0 );
 	}
 #endif /* USE_DB */
+	if (ctx->uidmap) {
+		int ret;
+		if ((ret = maildir_uidmap_compact( ctx, 1 )) != DRV_OK)
+			return ret;
+	}
 	return maildir_store_uidval( ctx );
 }
 
@@ -737,6 +1157,8 @@ maildir_uidval_lock( maildir_store_t *ctx )
 		error( "Maildir error: cannot fcntl lock UIDVALIDITY.\n" );
 		return DRV_BOX_BAD;
 	}
+	if (ctx->uidmap && maildir_uidmap_check( ctx ) != DRV_OK)
+		return DRV_BOX_BAD;
 
 #ifdef USE_DB
 	if (ctx->usedb) {
@@ -783,13 +1205,54 @@ maildir_uidval_lock( maildir_store_t *ctx )
 		}
 	}
 	ctx->uvok = 1;
-	conf_wakeup( &ctx->lcktmr, 2 );
+	conf_wakeup( &ctx->lcktmr, 2000 );
 	return DRV_OK;
 }
 
+static void
+maildir_forget_reservation( maildir_store_t *ctx )
+{
+	maildir_store_t **ctxp;
+
+	if (ctx->reserving) {
+		for (ctxp = &Reservers; *ctxp != ctx; ctxp = &(*ctxp)->next_reserver);
+		*ctxp = ctx->next_reserver;
+		ctx->reserving = 0;
+	}
+	ctx->resuid = ctx->resend = 0;
+}
+
+/* Give back the reserved UIDs which were not handed out, unless somebody
+ * else assigned UIDs in the meantime. Must be called with the lock held. */
+static void
+maildir_release_uids( maildir_store_t *ctx )
+{
+	if (ctx->resuid < ctx->resend && ctx->nuid == ctx->resend && ctx->resuv == ctx->uidvalidity) {
+		ctx->nuid = ctx->resuid;
+		maildir_forget_reservation( ctx );
+		maildir_write_uidval( ctx );
+	}
+}
+
+/* Normally, the reservations are given back when the stores are closed,
+ * but we want to avoid gaps also when exit() is called more abruptly. */
+static void
+maildir_release_all_uids( void )
+{
+	while (Reservers) {
+		maildir_store_t *ctx = Reservers;
+		if (maildir_uidval_lock( ctx ) == DRV_OK)
+			maildir_release_uids( ctx );
+		maildir_forget_reservation( ctx );
+	}
+}
+
 static void
 maildir_uidval_unlock( maildir_store_t *ctx )
 {
+	if (ctx->uidmap)
+		maildir_uidmap_flush( ctx );
+	maildir_release_uids( ctx );
 #ifdef USE_DB
 	if (ctx->db) {
 		ctx->db->close( ctx->db, 0 );
@@ -806,14 +1269,45 @@ lcktmr_timeout( void *aux )
 	maildir_uidval_unlock( (maildir_store_t *)aux );
 }
 
+/* Upper limit for the growth of UID reservations. */
+#define UID_RESERVE_MAX_GROW 10
+
+/* To avoid rewriting (and syncing) the UIDVALIDITY file for every single
+ * message, UIDs are reserved in blocks and handed out from memory. want is
+ * the number of UIDs the caller knows to need; beyond that, the blocks grow
+ * as long as they keep being used up. Unused UIDs simply remain gaps. */
 static int
-maildir_obtain_uid( maildir_store_t *ctx, uint *uid )
+maildir_obtain_uid( maildir_store_t *ctx, uint *uid, uint want )
 {
 	int ret;
+	uint cnt;
 
 	if ((ret = maildir_uidval_lock( ctx )) != DRV_OK)
 		return ret;
-	*uid = ++ctx->nuid;
+	if (ctx->resuid < ctx->resend && ctx->resuv == ctx->uidvalidity && ctx->nuid >= ctx->resend) {
+		*uid = ++ctx->resuid;
+		return DRV_OK;
+	}
+	cnt = 1U << ctx->resgrow;
+	if (cnt < want)
+		cnt = want;
+	if (cnt >= UINT_MAX - ctx->nuid)  // UINT_MAX means "no UID"
+		cnt = 1;
+	if (ctx->resgrow < UID_RESERVE_MAX_GROW)
+		ctx->resgrow++;
+	if (cnt > 1 && !ctx->reserving) {
+		static int registered;
+		if (!registered) {
+			atexit( maildir_release_all_uids );
+			registered = 1;
+		}
+		ctx->next_reserver = Reservers;
+		Reservers = ctx;
+		ctx->reserving = 1;
+	}
+	*uid = ctx->resuid = ctx->nuid + 1;
+	ctx->resend = ctx->nuid += cnt;
+	ctx->resuv = ctx->uidvalidity;
 	return maildir_store_uidval( ctx );
 }
 
@@ -838,91 +1332,806 @@ maildir_set_uid( maildir_store_t *ctx, const char *name, uint *uid )
 }
 #endif
 
-static int
-maildir_compare( const void *l, const void *r )
-{
-	msg_t *lm = (msg_t *)l, *rm = (msg_t *)r;
-	char *ldot, *rdot, *ldot2, *rdot2, *lseq, *rseq;
-	int ret, llen, rlen;
+/* The UID map of the alternative scheme is a text file which starts with a
+ * header line "1 <count>", followed by <count> "<uid> <key>" lines sorted by
+ * key, followed by a log of further such lines, where UID 0 means removal.
+ * The sorted part is searched directly in a mapping of the file; the log is
+ * merged into it when loading. The file is rewritten from time to time. */
 
-	if (lm->uid != rm->uid)  // Can't subtract, the result might not fit into signed int.
-		return lm->uid > rm->uid ? 1 : -1;
+static uint
+maildir_key_len( maildir_store_t *ctx, const char *name )
+{
+	const char *u = strpbrk( name, ((maildir_store_conf_t *)ctx->gen.conf)->info_stop );
+	return u ? (uint)(u - name) : strlen( name );
+}
 
-	/* No UID, so sort by arrival date. We should not do this, but we rely
-	   on the suggested unique file name scheme - we have no choice. */
-	/* The first field are always the seconds. Alphabetical sort should be
-	   faster than numeric. */
-	if (!(ldot = strchr( lm->base, '.' )) || !(rdot = strchr( rm->base, '.' )))
-		goto stronly; /* Should never happen ... */
-	llen = ldot - lm->base, rlen = rdot - rm->base;
-	/* The shorter number is smaller. Really. This won't trigger with any
-	   mail created after Sep 9 2001 anyway. */
-	if ((ret = llen - rlen))
-		return ret;
-	if ((ret = memcmp( lm->base, rm->base, llen )))
+static int
+maildir_uidmap_key_cmp( const char *k1, uint l1, const char *k2, uint l2 )
+{
+	int ret = memcmp( k1, k2, l1 < l2 ? l1 : l2 );
+	if (ret)
 		return ret;
+	return l1 < l2 ? -1 : l1 > l2;
+}
 
-	ldot++, rdot++;
+static int
+maildir_uidmap_ent_cmp( const void *a, const void *b )
+{
+	const uidmap_ent_t *ea = (const uidmap_ent_t *)a, *eb = (const uidmap_ent_t *)b;
+	int ret = maildir_uidmap_key_cmp( ea->key, ea->klen, eb->key, eb->klen );
+	if (ret)
+		return ret;
+	// Among log records for the same key, the latest one must come last.
+	return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
 
-	if ((llen = strtol( ldot, &ldot2, 10 ))) {
-		if (!(rlen = strtol( rdot, &rdot2, 10 )))
-			goto stronly; /* Comparing apples to oranges ... */
-		/* Classical PID specs */
-		if ((ret = llen - rlen)) {
-		  retpid:
-			/* Handle PID wraparound. This works only on systems
-			   where PIDs are not reused too fast */
-			if (ret > 20000 || ret < -20000)
-				ret = -ret;
-			return ret;
-		}
-		return (*ldot2 != '_' ? 0 : atoi( ldot2 + 1 )) -
-		       (*rdot2 != '_' ? 0 : atoi( rdot2 + 1 ));
+static void
+maildir_uidmap_unload( maildir_store_t *ctx )
+{
+	if (ctx->um_data) {
+#ifdef HAVE_MMAP
+		munmap( ctx->um_data, ctx->um_len );
+#else
+		free( ctx->um_data );
+#endif
+		ctx->um_data = 0;
 	}
+	ctx->um_ents.array.size = 0;
+	ctx->um_nlog = 0;
+	ctx->um_loaded = 0;
+}
 
-	if (!(ldot2 = strchr( ldot, '.' )) || !(rdot2 = strchr( rdot, '.' )))
-		goto stronly; /* Should never happen ... */
-	llen = ldot2 - ldot, rlen = rdot2 - rdot;
-
-	if (((lseq = memchr( ldot, '#', llen )) && (rseq = memchr( rdot, '#', rlen ))) ||
-	    ((lseq = memchr( ldot, 'M', llen )) && (rseq = memchr( rdot, 'M', rlen ))))
-		return atoi( lseq + 1 ) - atoi( rseq + 1 );
-
-	if ((lseq = memchr( ldot, 'P', llen )) && (rseq = memchr( rdot, 'P', rlen ))) {
-		if ((ret = atoi( lseq + 1 ) - atoi( rseq + 1 )))
-			goto retpid;
-		if ((lseq = memchr( ldot, 'Q', llen )) && (rseq = memchr( rdot, 'Q', rlen )))
-			return atoi( lseq + 1 ) - atoi( rseq + 1 );
-	}
+/* Parse a "<uid> <key>" line; return the position after it, or null. */
+static const char *
+maildir_uidmap_parse_line( const char *p, const char *end, uidmap_ent_t *ent )
+{
+	const char *nl;
+	uint uid = 0;
 
-  stronly:
-	/* Fall-back, so the sort order is defined at all */
-	return strcmp( lm->base, rm->base );
+	if (p == end || !isdigit( (uchar)*p ))
+		return 0;
+	for (; p < end && isdigit( (uchar)*p ); p++)
+		uid = uid * 10 + (*p - '0');
+	if (p == end || *p++ != ' ' || !(nl = memchr( p, '\n', end - p )) || nl == p)
+		return 0;
+	ent->key = p;
+	ent->klen = nl - p;
+	ent->uid = uid;
+	ent->seen = 0;
+	return nl + 1;
 }
 
 static int
-maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
+maildir_uidmap_load( maildir_store_t *ctx )
 {
-	maildir_store_conf_t *conf = (maildir_store_conf_t *)ctx->gen.conf;
-	DIR *d;
-	FILE *f;
-	struct dirent *e;
-	const char *u, *ru;
-#ifdef USE_DB
-	DB *tdb;
-	DBC *dbc;
-#endif /* USE_DB */
-	msg_t *entry;
-	int i, bl, fnl, ret;
+	const char *p, *end;
+	uidmap_ent_t *ent, *lent;
+	uint nsorted, i, j, nents;
+	struct stat st;
+
+	if (ctx->um_loaded)
+		return DRV_OK;
+	maildir_uidmap_unload( ctx );
+	if (fstat( ctx->um_fd, &st )) {
+		sys_error( "Maildir error: cannot fstat %s", ctx->uidmap );
+		return DRV_BOX_BAD;
+	}
+	ctx->um_ino = st.st_ino;
+	ctx->um_size = st.st_size;
+	if (st.st_size) {
+		ctx->um_len = st.st_size;
+#ifdef HAVE_MMAP
+		if ((ctx->um_data = mmap( 0, ctx->um_len, PROT_READ, MAP_SHARED, ctx->um_fd, 0 )) == MAP_FAILED) {
+			ctx->um_data = 0;
+#else
+		ctx->um_data = nfmalloc( ctx->um_len );
+		if (pread( ctx->um_fd, ctx->um_data, ctx->um_len, 0 ) != (ssize_t)ctx->um_len) {
+#endif
+			sys_error( "Maildir error: cannot read %s", ctx->uidmap );
+			return DRV_BOX_BAD;
+		}
+		p = ctx->um_data;
+		end = p + ctx->um_len;
+		if (end - p < 4 || p[0] != '1' || p[1] != ' ')
+			goto bad;
+		for (nsorted = 0, p += 2; p < end && isdigit( (uchar)*p ); p++)
+			nsorted = nsorted * 10 + (*p - '0');
+		if (p == end || *p++ != '\n')
+			goto bad;
+		for (i = 0; p < end; i++) {
+			ent = uidmap_ent_t_array_append( &ctx->um_ents );
+			if (!(p = maildir_uidmap_parse_line( p, end, ent )))
+				goto bad;
+			if (i >= nsorted) {
+				ctx->um_nlog++;
+			} else if (i && maildir_uidmap_key_cmp( ent[-1].key, ent[-1].klen, ent->key, ent->klen ) >= 0) {
+				goto bad;
+			}
+		}
+		if (i < nsorted)
+			goto bad;
+		if (ctx->um_nlog) {
+			// Re-sort everything, and let the latest record for each key win.
+			qsort( ctx->um_ents.array.data, ctx->um_ents.array.size, sizeof(uidmap_ent_t), maildir_uidmap_ent_cmp );
+			nents = ctx->um_ents.array.size;
+			for (i = j = 0; i < nents; i++) {
+				lent = &ctx->um_ents.array.data[i];
+				if (i + 1 < nents &&
+				    !maildir_uidmap_key_cmp( lent->key, lent->klen, lent[1].key, lent[1].klen ))
+					continue;
+				if (lent->uid)
+					ctx->um_ents.array.data[j++] = *lent;
+			}
+			ctx->um_ents.array.size = j;
+		}
+	}
+	ctx->um_loaded = 1;
+	return DRV_OK;
+
+  bad:
+	error( "Maildir error: malformed UID map %s\n", ctx->uidmap );
+	maildir_uidmap_unload( ctx );
+	return DRV_BOX_BAD;
+}
+
+static uidmap_ent_t *
+maildir_uidmap_find( maildir_store_t *ctx, const char *key, uint klen )
+{
+	uidmap_ent_t *ents = ctx->um_ents.array.data;
+	int l = 0, r = ctx->um_ents.array.size - 1, m, ret;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		ret = maildir_uidmap_key_cmp( key, klen, ents[m].key, ents[m].klen );
+		if (!ret)
+			return &ents[m];
+		if (ret < 0)
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return 0;
+}
+
+/* Queue a log record. UID 0 records the removal of the key. */
+static int
+maildir_uidmap_add( maildir_store_t *ctx, const char *name, uint uid )
+{
+	uint klen = maildir_key_len( ctx, name );
+	int need;
+
+	if (memchr( name, '\n', klen )) {
+		error( "Maildir error: cannot map file name with line break '%s'.\n", name );
+		return DRV_MSG_BAD;
+	}
+	need = ctx->um_pend_len + klen + 13;
+	if (need > ctx->um_pend_size) {
+		ctx->um_pend_size = need * 2;
+		ctx->um_pend = nfrealloc( ctx->um_pend, ctx->um_pend_size );
+	}
+	ctx->um_pend_len += sprintf( ctx->um_pend + ctx->um_pend_len, "%u %.*s\n", uid, (int)klen, name );
+	return DRV_OK;
+}
+
+/* Append the queued log records to the file. */
+static int
+maildir_uidmap_flush( maildir_store_t *ctx )
+{
+	int n = ctx->um_pend_len;
+	struct stat st;
+
+	if (!n)
+		return DRV_OK;
+	ctx->um_pend_len = 0;
+	if (fstat( ctx->um_fd, &st ) ||
+	    (!st.st_size && write( ctx->um_fd, "1 0\n", 4 ) != 4) ||
+	    write( ctx->um_fd, ctx->um_pend, n ) != n || (UseFSync && fdatasync( ctx->um_fd ))) {
+		sys_error( "Maildir error: cannot write %s", ctx->uidmap );
+		return DRV_BOX_BAD;
+	}
+	// The new records are not in the mapping, so re-load when needed.
+	ctx->um_loaded = 0;
+	return DRV_OK;
+}
+
+static int
+maildir_uidmap_open( maildir_store_t *ctx, int create )
+{
+	struct stat st;
+
+	if ((ctx->um_fd = open( ctx->uidmap, O_RDWR | O_APPEND | (create ? O_CREAT : 0), 0600 )) < 0) {
+		if (errno != ENOENT || create)
+			sys_error( "Maildir error: cannot open %s", ctx->uidmap );
+		return -1;
+	}
+	fstat( ctx->um_fd, &st );
+	ctx->um_ino = st.st_ino;
+	ctx->um_loaded = 0;
+	return 0;
+}
+
+static void
+maildir_uidmap_free( maildir_store_t *ctx )
+{
+	if (!ctx->uidmap)
+		return;
+	maildir_uidmap_unload( ctx );
+	close( ctx->um_fd );
+	free( ctx->uidmap );
+	ctx->uidmap = 0;
+	free( ctx->um_ents.array.data );
+	ARRAY_INIT( &ctx->um_ents );
+	free( ctx->um_pend );
+	ctx->um_pend = 0;
+	ctx->um_pend_len = ctx->um_pend_size = 0;
+}
+
+/* Rewrite the file, keeping only the entries which were seen
+ * by the current scan (or none at all if reset is set). */
+static int
+maildir_uidmap_compact( maildir_store_t *ctx, int reset )
+{
+	FILE *f;
+	uidmap_ent_t *ent;
+	int i, cnt;
+	char buf[_POSIX_PATH_MAX];
+
+	if (reset)
+		maildir_uidmap_unload( ctx );
+	for (cnt = i = 0; i < ctx->um_ents.array.size; i++)
+		cnt += ctx->um_ents.array.data[i].seen;
+	debug( "compacting UID map of %s: %d entries, %d log records\n", ctx->path, cnt, ctx->um_nlog );
+	nfsnprintf( buf, sizeof(buf), "%s.new", ctx->uidmap );
+	if (!(f = fopen( buf, "w" ))) {
+		sys_error( "Maildir error: cannot create %s", buf );
+		return DRV_BOX_BAD;
+	}
+	fprintf( f, "1 %u\n", cnt );
+	for (i = 0; i < ctx->um_ents.array.size; i++) {
+		ent = &ctx->um_ents.array.data[i];
+		if (ent->seen)
+			fprintf( f, "%u %.*s\n", ent->uid, (int)ent->klen, ent->key );
+	}
+	if (fflush( f ) || (UseFSync && fdatasync( fileno( f ) ))) {
+		sys_error( "Maildir error: cannot write %s", buf );
+		fclose( f );
+		unlink( buf );
+		return DRV_BOX_BAD;
+	}
+	fclose( f );
+	if (rename( buf, ctx->uidmap )) {
+		sys_error( "Maildir error: cannot rename %s to %s", buf, ctx->uidmap );
+		unlink( buf );
+		return DRV_BOX_BAD;
+	}
+	maildir_uidmap_unload( ctx );
+	close( ctx->um_fd );
+	return maildir_uidmap_open( ctx, 0 ) ? DRV_BOX_BAD : DRV_OK;
+}
+
+/* Called with a freshly acquired lock, as others may have modified the map. */
+static int
+maildir_uidmap_check( maildir_store_t *ctx )
+{
+	struct stat st;
+
+	if (stat( ctx->uidmap, &st )) {
+		sys_error( "Maildir error: cannot stat %s", ctx->uidmap );
+		return DRV_BOX_BAD;
+	}
+	if (st.st_ino != ctx->um_ino) {
+		// Somebody compacted it.
+		maildir_uidmap_unload( ctx );
+		close( ctx->um_fd );
+		if (maildir_uidmap_open( ctx, 0 ))
+			return DRV_BOX_BAD;
+	} else if (st.st_size != ctx->um_size) {
+		ctx->um_loaded = 0;
+	}
+	return DRV_OK;
+}
+
+static int
+maildir_uidmap_assign( maildir_store_t *ctx, const char *name, uint *uid, uint want )
+{
+	int ret;
+
+	if ((ret = maildir_obtain_uid( ctx, uid, want )) != DRV_OK)
+		return ret;
+	return maildir_uidmap_add( ctx, name, *uid );
+}
+
+static int
+maildir_uidmap_purge( maildir_store_t *ctx, const char *name )
+{
+	int ret;
+
+	if ((ret = maildir_uidval_lock( ctx )) != DRV_OK ||
+	    (ret = maildir_uidmap_add( ctx, name, 0 )) != DRV_OK)
+		return ret;
+	return maildir_uidmap_flush( ctx );
+}
+
+static int
+maildir_compare( const void *l, const void *r )
+{
+	msg_t *lm = (msg_t *)l, *rm = (msg_t *)r;
+	char *ldot, *rdot, *ldot2, *rdot2, *lseq, *rseq;
+	int ret, llen, rlen;
+
+	if (lm->uid != rm->uid)  // Can't subtract, the result might not fit into signed int.
+		return lm->uid > rm->uid ? 1 : -1;
+
+	/* No UID, so sort by arrival date. We should not do this, but we rely
+	   on the suggested unique file name scheme - we have no choice. */
+	/* The first field are always the seconds. Alphabetical sort should be
+	   faster than numeric. */
+	if (!(ldot = strchr( lm->base, '.' )) || !(rdot = strchr( rm->base, '.' )))
+		goto stronly; /* Should never happen ... */
+	llen = ldot - lm->base, rlen = rdot - rm->base;
+	/* The shorter number is smaller. Really. This won't trigger with any
+	   mail created after Sep 9 2001 anyway. */
+	if ((ret = llen - rlen))
+		return ret;
+	if ((ret = memcmp( lm->base, rm->base, llen )))
+		return ret;
+
+	ldot++, rdot++;
+
+	if ((llen = strtol( ldot, &ldot2, 10 ))) {
+		if (!(rlen = strtol( rdot, &rdot2, 10 )))
+			goto stronly; /* Comparing apples to oranges ... */
+		/* Classical PID specs */
+		if ((ret = llen - rlen)) {
+		  retpid:
+			/* Handle PID wraparound. This works only on systems
+			   where PIDs are not reused too fast */
+			if (ret > 20000 || ret < -20000)
+				ret = -ret;
+			return ret;
+		}
+		return (*ldot2 != '_' ? 0 : atoi( ldot2 + 1 )) -
+		       (*rdot2 != '_' ? 0 : atoi( rdot2 + 1 ));
+	}
+
+	if (!(ldot2 = strchr( ldot, '.' )) || !(rdot2 = strchr( rdot, '.' )))
+		goto stronly; /* Should never happen ... */
+	llen = ldot2 - ldot, rlen = rdot2 - rdot;
+
+	if (((lseq = memchr( ldot, '#', llen )) && (rseq = memchr( rdot, '#', rlen ))) ||
+	    ((lseq = memchr( ldot, 'M', llen )) && (rseq = memchr( rdot, 'M', rlen ))))
+		return atoi( lseq + 1 ) - atoi( rseq + 1 );
+
+	if ((lseq = memchr( ldot, 'P', llen )) && (rseq = memchr( rdot, 'P', rlen ))) {
+		if ((ret = atoi( lseq + 1 ) - atoi( rseq + 1 )))
+			goto retpid;
+		if ((lseq = memchr( ldot, 'Q', llen )) && (rseq = memchr( rdot, 'Q', rlen )))
+			return atoi( lseq + 1 ) - atoi( rseq + 1 );
+	}
+
+  stronly:
+	/* Fall-back, so the sort order is defined at all */
+	return strcmp( lm->base, rm->base );
+}
+
+/* Sort keys for maildir_sort_scan(). The file name fields maildir_compare()
+ * looks at are parsed once per message instead of once per comparison. */
+#define SK_OK      1  /* the name is well-formed; otherwise use maildir_compare() */
+#define SK_CLASSIC 2  /* second field is <pid>[_<seq>] */
+#define SK_HASH    4
+#define SK_M       8
+#define SK_P       16
+#define SK_Q       32
+
+typedef struct {
+	msg_t *msg;
 	uint uid;
-	time_t now, stamps[2];
+	uchar flags;
+	uchar seclen;
+	unsigned long long secs;
+	int seq, hash, m, p, q;  /* seq is the _<n> part in the classic scheme */
+} sort_key_t;
+
+static void
+maildir_make_sort_key( sort_key_t *sk, msg_t *msg )
+{
+	const char *base = msg->base, *dot, *dot2, *s;
+	int i, len;
+	char *end;
+
+	sk->msg = msg;
+	sk->uid = msg->uid;
+	sk->flags = 0;
+	if (msg->uid != UINT_MAX)
+		return;
+	if (!(dot = strchr( base, '.' )) || (len = dot - base) > 19)
+		return;
+	for (sk->secs = 0, i = 0; i < len; i++) {
+		if (!isdigit( (uchar)base[i] ))
+			return;
+		sk->secs = sk->secs * 10 + (base[i] - '0');
+	}
+	sk->seclen = len;
+	dot++;
+	if ((sk->p = strtol( dot, &end, 10 ))) {
+		sk->seq = *end != '_' ? 0 : atoi( end + 1 );
+		sk->flags = SK_OK | SK_CLASSIC;
+		return;
+	}
+	if (!(dot2 = strchr( dot, '.' )))
+		return;
+	len = dot2 - dot;
+	if ((s = memchr( dot, '#', len )))
+		sk->flags |= SK_HASH, sk->hash = atoi( s + 1 );
+	if ((s = memchr( dot, 'M', len )))
+		sk->flags |= SK_M, sk->m = atoi( s + 1 );
+	if ((s = memchr( dot, 'P', len )))
+		sk->flags |= SK_P, sk->p = atoi( s + 1 );
+	if ((s = memchr( dot, 'Q', len )))
+		sk->flags |= SK_Q, sk->q = atoi( s + 1 );
+	sk->flags |= SK_OK;
+}
+
+/* Equivalent to maildir_compare(), but working on pre-parsed keys. */
+static int
+maildir_compare_keys( const void *l, const void *r )
+{
+	const sort_key_t *lk = (const sort_key_t *)l, *rk = (const sort_key_t *)r;
+	int ret, both;
+
+	if (lk->uid != rk->uid)
+		return lk->uid > rk->uid ? 1 : -1;
+	if (!(lk->flags & rk->flags & SK_OK) || (lk->flags ^ rk->flags) & SK_CLASSIC)
+		return maildir_compare( lk->msg, rk->msg );
+	if ((ret = lk->seclen - rk->seclen))
+		return ret;
+	if (lk->secs != rk->secs)
+		return lk->secs > rk->secs ? 1 : -1;
+	both = lk->flags & rk->flags;
+	if (both & SK_CLASSIC) {
+		if ((ret = lk->p - rk->p))
+			goto retpid;
+		return lk->seq - rk->seq;
+	}
+	if (both & SK_HASH)
+		return lk->hash - rk->hash;
+	if (both & SK_M)
+		return lk->m - rk->m;
+	if (both & SK_P) {
+		if ((ret = lk->p - rk->p)) {
+		  retpid:
+			/* See maildir_compare(). */
+			if (ret > 20000 || ret < -20000)
+				ret = -ret;
+			return ret;
+		}
+		if (both & SK_Q)
+			return lk->q - rk->q;
+	}
+	return strcmp( lk->msg->base, rk->msg->base );
+}
+
+/* Sort the scanned messages into the order defined by maildir_compare().
+ * Messages which already have UIDs are radix-sorted, which is linear; only
+ * the ones still lacking UIDs (which sort last) need real comparisons. */
+static void
+maildir_sort_scan( msg_t_array_alloc_t *msglist )
+{
+	sort_key_t *kbuf, *keys, *tmp, *t;
+	msg_t *msgs;
+	int i, j, n = msglist->array.size, nuids, sh;
+	int cnt[256];
+
+	if (n < 2)
+		return;
+	keys = kbuf = nfmalloc( n * sizeof(sort_key_t) * 2 );
+	tmp = keys + n;
+	for (nuids = i = 0; i < n; i++)
+		if (msglist->array.data[i].uid != UINT_MAX)
+			maildir_make_sort_key( &keys[nuids++], &msglist->array.data[i] );
+	for (j = nuids, i = 0; i < n; i++)
+		if (msglist->array.data[i].uid == UINT_MAX)
+			maildir_make_sort_key( &keys[j++], &msglist->array.data[i] );
+	for (sh = 0; sh < 32; sh += 8) {
+		memset( cnt, 0, sizeof(cnt) );
+		for (i = 0; i < nuids; i++)
+			cnt[(keys[i].uid >> sh) & 255]++;
+		if (cnt[(keys[0].uid >> sh) & 255] == nuids)
+			continue;  /* All keys agree on this digit. */
+		for (j = i = 0; i < 256; i++) {
+			int c = cnt[i];
+			cnt[i] = j;
+			j += c;
+		}
+		for (i = 0; i < nuids; i++)
+			tmp[cnt[(keys[i].uid >> sh) & 255]++] = keys[i];
+		t = keys, keys = tmp, tmp = t;
+	}
+	/* The passes above move only the keyed part; bring the rest along. */
+	if (keys != kbuf)
+		memcpy( keys + nuids, kbuf + nuids, (n - nuids) * sizeof(sort_key_t) );
+	qsort( keys + nuids, n - nuids, sizeof(sort_key_t), maildir_compare_keys );
+	msgs = nfmalloc( msglist->alloc * sizeof(msg_t) );
+	for (i = 0; i < n; i++)
+		msgs[i] = *keys[i].msg;
+	free( msglist->array.data );
+	msglist->array.data = msgs;
+	free( kbuf );
+}
+
+/* Return the size recorded in a ",S=" file name field, or -1 if there is none. */
+static int
+maildir_name_size( const char *base, char info_delimiter )
+{
+	const char *s, *e = strchr( base, info_delimiter );
+
+	for (s = base; (s = strstr( s, ",S=" )) && (!e || s < e); s += 3)
+		if (isdigit( (uchar)s[3] ))
+			return atoi( s + 3 );
+	return -1;
+}
+
+/* TUIDs of messages stored from files or deduplicated are recorded in a
+ * ",T=" file name field. As '/' may not appear in file names, '_' is used
+ * instead. */
+static int
+maildir_name_tuid( const char *base, char info_delimiter, char *tuid )
+{
+	const char *s = strstr( base, ",T=" ), *e = strchr( base, info_delimiter );
+	int i;
+
+	if (!s || (e && s > e))
+		return 0;
+	for (s += 3, i = 0; i < TUIDL; i++) {
+		if (!isalnum( (uchar)s[i] ) && s[i] != '+' && s[i] != '_')
+			return 0;
+		tuid[i] = (s[i] == '_') ? '/' : s[i];
+	}
+	return 1;
+}
+
+/* Listing of a maildir subfolder for maildir_scan(). Where available, the
+ * entries are fetched in big batches straight into a buffer shared by all
+ * listings, which saves lots of system calls (and server round trips on
+ * network file systems) for large folders. */
+typedef struct {
+#ifdef HAVE_GETDENTS64
+	int fd, len, off;
+#else
+	DIR *dir;
+#endif
+} dir_list_t;
+
+#ifdef HAVE_GETDENTS64
+# define DENTS_BUF_SIZE (256 * 1024)
+static char *DentsBuf;
+#endif
+
+static int
+dir_list_open( dir_list_t *dl, int dfd, const char *path )
+{
+#ifdef HAVE_GETDENTS64
+	if ((dl->fd = (dfd >= 0) ? openat( dfd, ".", O_RDONLY | O_DIRECTORY ) : open( path, O_RDONLY | O_DIRECTORY )) < 0)
+		return -1;
+	if (!DentsBuf)
+		DentsBuf = nfmalloc( DENTS_BUF_SIZE );
+	dl->len = dl->off = 0;
+	return 0;
+#else
+	(void)dfd;
+	return (dl->dir = opendir( path )) ? 0 : -1;
+#endif
+}
+
+/* Return the next entry's name, or null at the end, in which case errno is
+ * non-zero if listing failed. The name is valid until the next call. */
+static const char *
+dir_list_next( dir_list_t *dl )
+{
+#ifdef HAVE_GETDENTS64
+	struct dirent64 *de;
+	ssize_t n;
+
+	if (dl->off >= dl->len) {
+		if ((n = getdents64( dl->fd, DentsBuf, DENTS_BUF_SIZE )) <= 0) {
+			if (!n)
+				errno = 0;
+			return 0;
+		}
+		dl->len = n;
+		dl->off = 0;
+	}
+	de = (struct dirent64 *)(DentsBuf + dl->off);
+	dl->off += de->d_reclen;
+	return de->d_name;
+#else
+	struct dirent *de;
+
+	errno = 0;
+	return (de = readdir( dl->dir )) ? de->d_name : 0;
+#endif
+}
+
+static void
+dir_list_close( dir_list_t *dl )
+{
+#ifdef HAVE_GETDENTS64
+	close( dl->fd );
+#else
+	closedir( dl->dir );
+#endif
+}
+
+/* File systems use a coarse clock for time stamps, so a modification
+ * within a few milliseconds of another may end up with the same one. */
+#define MTIME_SLACK_MS 50
+
+/* Return the number of milliseconds until a further modification would
+ * be guaranteed to change the time stamp in st, or 0 if it already is. */
+static int
+maildir_mtime_unsettled( const struct stat *st )
+{
+	struct timespec now;
+	long long due, ms;
+
+	clock_gettime( CLOCK_REALTIME, &now );
+	ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	if (st->st_mtim.tv_nsec)
+		due = (long long)st->st_mtim.tv_sec * 1000 + st->st_mtim.tv_nsec / 1000000 + MTIME_SLACK_MS;
+	else  // Probably a file system with whole-second time stamps.
+#endif
+		due = ((long long)st->st_mtime + 1) * 1000;
+	return due > ms ? (int)(due - ms) : 0;
+}
+
+/* The per-file part of a scan, which runs off the main thread, as it
+ * consists of blocking round trips to the file system. */
+typedef struct {
+	msg_t *entry;
+	int cei; // index of the cache entry, or -1
+	uchar want_size, want_tuid, want_msgid;
+	// Results:
+	uchar op; // what failed, if err is set
+	uchar bad_tuids; // number of malformed X-TUID headers
+	int err;
+	int size, fsize; // fsize is from reading the header; -1 if unknown
+	char *msgid; // own
+	char tuid[TUIDL];
+} scan_job_t;
+
+DEFINE_ARRAY_TYPE(scan_job_t)
+
+enum { SCAN_STAT, SCAN_OPEN };
+
+static void
+maildir_scan_job( void *aux, void *item )
+{
+	maildir_store_t *ctx = (maildir_store_t *)aux;
+	scan_job_t *job = (scan_job_t *)item;
+	msg_t *entry = job->entry;
+	FILE *f;
+	int bl, dfd, fd;
 	struct stat st;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	char buf[_POSIX_PATH_MAX];
+
+	// The main thread made sure that this fits.
+	bl = snprintf( buf, sizeof(buf), "%s/%s/", ctx->path, subdirs[entry->recent] );
+	snprintf( buf + bl, sizeof(buf) - bl, "%s", entry->base );
+	dfd = ctx->dfd[entry->recent];
+	if (job->want_size) {
+		if (maildir_stat_at( dfd, buf, bl, &st )) {
+			job->op = SCAN_STAT;
+			job->err = errno;
+			return;
+		}
+		job->size = st.st_size;
+	}
+	if (job->want_tuid || job->want_msgid) {
+		if ((fd = maildir_open_at( dfd, buf, bl, O_RDONLY )) < 0 || !(f = fdopen( fd, "r" ))) {
+			job->op = SCAN_OPEN;
+			job->err = errno;
+			if (fd >= 0)
+				close( fd );
+			return;
+		}
+		// When caching, always extract both, so the header needs to be read only once.
+		int need_tuid = job->want_tuid || job->cei >= 0, need_msgid = job->want_msgid || job->cei >= 0;
+		int off, in_msgid = 0;
+		char lnbuf[1000];  // Says RFC2822
+		job->fsize = (job->cei >= 0 && !fstat( fd, &st )) ? st.st_size : -1;
+		while ((need_tuid || need_msgid) && fgets( lnbuf, sizeof(lnbuf), f )) {
+			int bufl = strlen( lnbuf );
+			if (bufl && lnbuf[bufl - 1] == '\n')
+				--bufl;
+			if (bufl && lnbuf[bufl - 1] == '\r')
+				--bufl;
+			if (!bufl)
+				break;
+			if (need_tuid && starts_with( lnbuf, bufl, "X-TUID: ", 8 )) {
+				if (bufl < 8 + TUIDL) {
+					if (job->want_tuid && job->bad_tuids < 255)
+						job->bad_tuids++;
+					continue;
+				}
+				memcpy( job->tuid, lnbuf + 8, TUIDL );
+				need_tuid = 0;
+				in_msgid = 0;
+				continue;
+			}
+			if (need_msgid && starts_with_upper( lnbuf, bufl, "MESSAGE-ID:", 11 )) {
+				off = 11;
+			} else if (in_msgid) {
+				if (!isspace( lnbuf[0] )) {
+					in_msgid = 0;
+					continue;
+				}
+				off = 1;
+			} else {
+				continue;
+			}
+			while (off < bufl && isspace( lnbuf[off] ))
+				off++;
+			if (off == bufl) {
+				in_msgid = 1;
+				continue;
+			}
+			job->msgid = nfstrndup( lnbuf + off, bufl - off );
+			need_msgid = 0;
+			in_msgid = 0;
+		}
+		fclose( f );
+	}
+}
+
+static void
+maildir_free_scan_jobs( scan_job_t_array_alloc_t *jobs )
+{
+	int i;
+
+	for (i = 0; i < jobs->array.size; i++)
+		free( jobs->array.data[i].msgid );
+	free( jobs->array.data );
+	ARRAY_INIT( jobs );
+}
 
+/* If delay is non-null and a directory was modified too recently, nothing
+ * is scanned, and the number of milliseconds to wait is stored there. */
+static int
+maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist, int *delay )
+{
+	maildir_store_conf_t *conf = (maildir_store_conf_t *)ctx->gen.conf;
+	dir_list_t dl;
+	const char *name, *u, *ru;
+#ifdef USE_DB
+	DB *tdb;
+	DBC *dbc;
+#endif /* USE_DB */
+	msg_t *entry;
+	cache_ent_t *ce;
+	scan_job_t *job;
+	scan_job_t_array_alloc_t jobs;
+	const char *ck;
+	int i, bl, fnl, cei, ret, wait, dfd;
+	uint uid;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	struct timespec stamps[2];
+#else
+	time_t stamps[2];
+#endif
+	struct stat st;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], kbuf[_POSIX_PATH_MAX];
+
+	wait_async( &ctx->io );
+	int caching = (ctx->opts & (OPEN_OLD_SIZE | OPEN_NEW_SIZE | OPEN_FIND | OPEN_OLD_IDS | OPEN_NEW_IDS)) != 0;
+	if (caching && !ctx->cache_loaded)
+		maildir_cache_load( ctx );
   again:
 	ARRAY_INIT( msglist );
 	ctx->total_msgs = ctx->recent_msgs = 0;
 	if (ctx->uvok || ctx->maxuid == UINT_MAX) {
+		for (i = 0; i < ctx->cache.array.size; i++)
+			ctx->cache.array.data[i].seen = 0;
 #ifdef USE_DB
 		if (ctx->usedb) {
 			if (db_create( &tdb, 0, 0 )) {
@@ -938,28 +2147,43 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 		}
 #endif /* USE_DB */
 		bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->path );
-	  restat:
-		now = time( 0 );
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
-			if (stat( buf, &st )) {
+			dfd = maildir_dir_fd( ctx->dfd, ctx->path, i );
+			if (dfd >= 0 ? fstat( dfd, &st ) : stat( buf, &st )) {
 				sys_error( "Maildir error: cannot stat %s", buf );
 				goto dfail;
 			}
-			if (st.st_mtime == now && !(DFlags & ZERODELAY) && !ctx->fresh[i]) {
-				/* If the modification happened during this second, we wouldn't be able to
-				 * tell if there were further modifications during this second. So wait.
-				 * This has the nice side effect that we wait for "batches" of changes to
-				 * complete. On the downside, it can potentially block indefinitely. */
-				notice( "Maildir notice: sleeping due to recent directory modification.\n" );
-				sleep( 1 ); /* FIXME: should make this async */
-				goto restat;
+			if (delay && !(DFlags & ZERODELAY) && !ctx->fresh[i] && (wait = maildir_mtime_unsettled( &st ))) {
+				/* If the modification happened just now, we wouldn't be able to tell
+				 * if there were further modifications with the same time stamp. So the
+				 * caller should retry later. This has the nice side effect that we wait
+				 * for "batches" of changes to complete. Callers which cannot wait rely
+				 * on later scans to pick up what they miss. */
+#ifdef USE_DB
+				if (ctx->usedb)
+					tdb->close( tdb, 0 );
+#endif /* USE_DB */
+				*delay = wait;
+				return DRV_OK;
 			}
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+			stamps[i] = st.st_mtim;
+#else
 			stamps[i] = st.st_mtime;
+#endif
+		}
+		if (ctx->uidmap) {
+			if (maildir_uidval_lock( ctx ) != DRV_OK ||
+			    maildir_uidmap_flush( ctx ) != DRV_OK ||
+			    maildir_uidmap_load( ctx ) != DRV_OK)
+				goto dfail;
+			for (i = 0; i < ctx->um_ents.array.size; i++)
+				ctx->um_ents.array.data[i].seen = 0;
 		}
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
-			if (!(d = opendir( buf ))) {
+			if (dir_list_open( &dl, ctx->dfd[i], buf )) {
 				sys_error( "Maildir error: cannot list %s", buf );
 			  rfail:
 				maildir_free_scan( msglist );
@@ -970,22 +2194,25 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 #endif /* USE_DB */
 				return DRV_BOX_BAD;
 			}
-			while ((e = readdir( d ))) {
-				if (*e->d_name == '.')
+			while ((name = dir_list_next( &dl ))) {
+				if (*name == '.')
 					continue;
 				ctx->total_msgs++;
 				ctx->recent_msgs += i;
+				if (caching && (ck = maildir_cache_key( conf, name, kbuf, sizeof(kbuf) )) &&
+				    (ce = maildir_cache_find( ctx, ck )))
+					ce->seen = 1;
 #ifdef USE_DB
 				if (ctx->usedb) {
 					if (maildir_uidval_lock( ctx ) != DRV_OK)
 						goto mbork;
-					make_key( conf->info_stop, &key, e->d_name );
+					make_key( conf->info_stop, &key, name );
 					if ((ret = ctx->db->get( ctx->db, 0, &key, &value, 0 ))) {
 						if (ret != DB_NOTFOUND) {
 							ctx->db->err( ctx->db, ret, "Maildir error: db->get()" );
 						  mbork:
 							maildir_free_scan( msglist );
-							closedir( d );
+							dir_list_close( &dl );
 							goto bork;
 						}
 						uid = UINT_MAX;
@@ -999,8 +2226,16 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 					}
 				} else
 #endif /* USE_DB */
-				{
-					uid = (ctx->uvok && (u = strstr( e->d_name, ",U=" ))) ? strtoul( u + 3, NULL, 10 ) : 0;
+				if (ctx->uidmap) {
+					uidmap_ent_t *ment = maildir_uidmap_find( ctx, name, maildir_key_len( ctx, name ) );
+					if (ment) {
+						ment->seen = 1;
+						uid = ment->uid;
+					} else {
+						uid = UINT_MAX;
+					}
+				} else {
+					uid = (ctx->uvok && (u = strstr( name, ",U=" ))) ? strtoul( u + 3, NULL, 10 ) : 0;
 					if (!uid)
 						uid = UINT_MAX;
 				}
@@ -1008,7 +2243,7 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 					if (uid < ctx->minuid && !find_uint_array( ctx->excs, uid ))
 						continue;
 					entry = msg_t_array_append( msglist );
-					entry->base = nfstrdup( e->d_name );
+					entry->base = nfstrdup( name );
 					entry->msgid = 0;
 					entry->uid = uid;
 					entry->recent = i;
@@ -1016,15 +2251,27 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 					entry->tuid[0] = 0;
 				}
 			}
-			closedir( d );
+			if (errno) {
+				sys_error( "Maildir error: cannot list %s", buf );
+				dir_list_close( &dl );
+				goto rfail;
+			}
+			dir_list_close( &dl );
 		}
 		for (i = 0; i < 2; i++) {
 			memcpy( buf + bl, subdirs[i], 4 );
-			if (stat( buf, &st )) {
+			dfd = ctx->dfd[i];
+			if (dfd >= 0 ? fstat( dfd, &st ) : stat( buf, &st )) {
 				sys_error( "Maildir error: cannot re-stat %s", buf );
 				goto rfail;
 			}
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+			// The scan may start within the same second as the last change,
+			// so whole seconds would not tell a further change apart.
+			if (st.st_mtim.tv_sec != stamps[i].tv_sec || st.st_mtim.tv_nsec != stamps[i].tv_nsec) {
+#else
 			if (st.st_mtime != stamps[i]) {
+#endif
 				/* Somebody messed with the mailbox since we started listing it. */
 #ifdef USE_DB
 				if (ctx->usedb)
@@ -1034,6 +2281,15 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 				goto again;
 			}
 		}
+		if (ctx->uidmap) {
+			// Drop the keys of vanished messages, and merge the log if it grew too long.
+			int stale = 0;
+			for (i = 0; i < ctx->um_ents.array.size; i++)
+				stale |= !ctx->um_ents.array.data[i].seen;
+			if ((stale || ctx->um_nlog > 100 + ctx->um_ents.array.size / 8) &&
+			    maildir_uidmap_compact( ctx, 0 ) != DRV_OK)
+				goto rfail;
+		}
 #ifdef USE_DB
 		if (ctx->usedb) {
 			if (maildir_uidval_lock( ctx ) != DRV_OK)
@@ -1064,7 +2320,9 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 			tdb->close( tdb, 0 );
 		}
 #endif /* USE_DB */
-		qsort( msglist->array.data, msglist->array.size, sizeof(msg_t), maildir_compare );
+		maildir_sort_scan( msglist );
+		maildir_cache_sort( ctx );
+		ARRAY_INIT( &jobs );
 		for (uid = i = 0; i < msglist->array.size; i++) {
 			entry = &msglist->array.data[i];
 			if (entry->uid != UINT_MAX) {
@@ -1072,14 +2330,13 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 #if 1
 					/* See comment in maildir_uidval_lock() why this is fatal. */
 					error( "Maildir error: duplicate UID %u.\n", uid );
-					maildir_free_scan( msglist );
-					return DRV_BOX_BAD;
+					goto fail;
 #else
 					notice( "Maildir notice: duplicate UID; changing UIDVALIDITY.\n");
 					if ((ret = maildir_init_uid( ctx )) != DRV_OK) {
-						maildir_free_scan( msglist );
-						return ret;
+						goto bail;
 					}
+					maildir_free_scan_jobs( &jobs );
 					maildir_free_scan( msglist );
 					goto again;
 #endif
@@ -1089,24 +2346,21 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 					/* In principle, we could just warn and top up nuid. However, getting into this
 					 * situation might indicate some serious trouble, so let's not make it worse. */
 					error( "Maildir error: UID %u is beyond highest assigned UID %u.\n", uid, ctx->nuid );
-					maildir_free_scan( msglist );
-					return DRV_BOX_BAD;
+					goto fail;
 				}
-				fnl = 0;
 #ifdef USE_DB
 			} else if (ctx->usedb) {
-				if ((ret = maildir_set_uid( ctx, entry->base, &uid )) != DRV_OK) {
-					maildir_free_scan( msglist );
-					return ret;
-				}
+				if ((ret = maildir_set_uid( ctx, entry->base, &uid )) != DRV_OK)
+					goto bail;
 				entry->uid = uid;
-				fnl = 0;
 #endif /* USE_DB */
+			} else if (ctx->uidmap) {
+				if ((ret = maildir_uidmap_assign( ctx, entry->base, &uid, msglist->array.size - i )) != DRV_OK)
+					goto bail;
+				entry->uid = uid;
 			} else {
-				if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
-					maildir_free_scan( msglist );
-					return ret;
-				}
+				if ((ret = maildir_obtain_uid( ctx, &uid, msglist->array.size - i )) != DRV_OK)
+					goto bail;
 				entry->uid = uid;
 				if ((u = strstr( entry->base, ",U=" )))
 					for (ru = u + 3; isdigit( (uchar)*ru ); ru++);
@@ -1116,16 +2370,17 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%.*s,U=%u%s", subdirs[entry->recent], (int)(u - entry->base), entry->base, uid, ru ) :
 					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s,U=%u", subdirs[entry->recent], entry->base, uid ))
 					- 4;
+				// This is done right away, so a vanished file stops the numbering
+				// at it, and the rescan numbers the remaining ones in order.
 				memcpy( nbuf, buf, bl + 4 );
 				nfsnprintf( nbuf + bl + 4, sizeof(nbuf) - bl - 4, "%s", entry->base );
-				if (rename( nbuf, buf )) {
+				dfd = ctx->dfd[entry->recent];
+				if (maildir_rename_at( dfd, nbuf, bl + 4, dfd, buf, bl + 4 )) {
 					if (errno != ENOENT) {
 						sys_error( "Maildir error: cannot rename %s to %s", nbuf, buf );
-					  fail:
-						maildir_free_scan( msglist );
-						return DRV_BOX_BAD;
+						goto fail;
 					}
-				  retry:
+					maildir_free_scan_jobs( &jobs );
 					maildir_free_scan( msglist );
 					goto again;
 				}
@@ -1134,74 +2389,106 @@ maildir_scan( maildir_store_t *ctx, msg_t_array_alloc_t *msglist )
 			}
 			int want_size = (uid > ctx->seenuid) ? (ctx->opts & OPEN_NEW_SIZE) : (ctx->opts & OPEN_OLD_SIZE);
 			int want_tuid = ((ctx->opts & OPEN_FIND) && uid >= ctx->newuid);
-			int want_msgid = ((ctx->opts & OPEN_OLD_IDS) && uid <= ctx->seenuid);
-			if (!want_size && !want_tuid && !want_msgid)
-				continue;
-			if (!fnl)
-				nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
-			if (want_size) {
-				if (stat( buf, &st )) {
-					if (errno != ENOENT) {
-						sys_error( "Maildir error: cannot stat %s", buf );
-						goto fail;
+			int want_msgid = (uid > ctx->seenuid) ? (ctx->opts & OPEN_NEW_IDS) : (ctx->opts & OPEN_OLD_IDS);
+			if (want_size && (entry->size = maildir_name_size( entry->base, conf->info_delimiter )) >= 0)
+				want_size = 0;
+			if (want_tuid && maildir_name_tuid( entry->base, conf->info_delimiter, entry->tuid ))
+				want_tuid = 0;
+			cei = -1;
+			if ((want_size || want_tuid || want_msgid) &&
+			    caching && (ck = maildir_cache_key( conf, entry->base, kbuf, sizeof(kbuf) ))) {
+				if ((ce = maildir_cache_find( ctx, ck ))) {
+					if (want_size && ce->size >= 0) {
+						entry->size = ce->size;
+						want_size = 0;
+					}
+					if (ce->hdr) {
+						if (want_tuid)
+							memcpy( entry->tuid, ce->tuid, TUIDL );
+						if (want_msgid && ce->msgid)
+							entry->msgid = nfstrdup( ce->msgid );
+						want_tuid = want_msgid = 0;
 					}
-					goto retry;
+				} else {
+					ce = maildir_cache_add( ctx, ck );
 				}
-				entry->size = st.st_size;
+				if (want_size || want_tuid || want_msgid)
+					cei = ce - ctx->cache.array.data;
 			}
-			if (want_tuid || want_msgid) {
-				if (!(f = fopen( buf, "r" ))) {
-					if (errno != ENOENT) {
+			if (!want_size && !want_tuid && !want_msgid)
+				continue;
+			// Make sure that the job will not need to build longer paths.
+			nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
+			job = scan_job_t_array_append( &jobs );
+			memset( job, 0, sizeof(*job) );
+			job->entry = entry;
+			job->cei = cei;
+			job->want_size = want_size != 0;
+			job->want_tuid = want_tuid != 0;
+			job->want_msgid = want_msgid != 0;
+		}
+		// The directory descriptors must not be opened lazily by the jobs.
+		maildir_dir_fd( ctx->dfd, ctx->path, 0 );
+		maildir_dir_fd( ctx->dfd, ctx->path, 1 );
+		parallel_for( maildir_scan_job, ctx, jobs.array.data, sizeof(scan_job_t), jobs.array.size );
+		// Merge the results in order, so the outcome does not depend on the scheduling.
+		for (i = 0; i < jobs.array.size; i++) {
+			job = &jobs.array.data[i];
+			entry = job->entry;
+			if (job->err) {
+				if (job->err != ENOENT) {
+					errno = job->err;
+					nfsnprintf( buf + bl, sizeof(buf) - bl, "%s/%s", subdirs[entry->recent], entry->base );
+					if (job->op == SCAN_STAT) {
+						sys_error( "Maildir error: cannot stat %s", buf );
+					} else {
 						sys_error( "Maildir error: cannot open %s", buf );
-						goto fail;
 					}
-					goto retry;
+				  fail:
+					ret = DRV_BOX_BAD;
+				  bail:
+					maildir_free_scan_jobs( &jobs );
+					maildir_free_scan( msglist );
+					return ret;
 				}
-				int off, in_msgid = 0;
-				char lnbuf[1000];  // Says RFC2822
-				while ((want_tuid || want_msgid) && fgets( lnbuf, sizeof(lnbuf), f )) {
-					int bufl = strlen( lnbuf );
-					if (bufl && lnbuf[bufl - 1] == '\n')
-						--bufl;
-					if (bufl && lnbuf[bufl - 1] == '\r')
-						--bufl;
-					if (!bufl)
-						break;
-					if (want_tuid && starts_with( lnbuf, bufl, "X-TUID: ", 8 )) {
-						if (bufl < 8 + TUIDL) {
-							error( "Maildir error: malformed X-TUID header (UID %u)\n", uid );
-							continue;
-						}
-						memcpy( entry->tuid, lnbuf + 8, TUIDL );
-						want_tuid = 0;
-						in_msgid = 0;
-						continue;
-					}
-					if (want_msgid && starts_with_upper( lnbuf, bufl, "MESSAGE-ID:", 11 )) {
-						off = 11;
-					} else if (in_msgid) {
-						if (!isspace( lnbuf[0] )) {
-							in_msgid = 0;
-							continue;
-						}
-						off = 1;
-					} else {
-						continue;
-					}
-					while (off < bufl && isspace( lnbuf[off] ))
-						off++;
-					if (off == bufl) {
-						in_msgid = 1;
-						continue;
-					}
-					entry->msgid = nfstrndup( lnbuf + off, bufl - off );
-					want_msgid = 0;
-					in_msgid = 0;
+				maildir_free_scan_jobs( &jobs );
+				maildir_free_scan( msglist );
+				goto again;
+			}
+			ce = (job->cei >= 0) ? &ctx->cache.array.data[job->cei] : 0;
+			if (job->want_size) {
+				entry->size = job->size;
+				if (ce)
+					ce->size = entry->size;
+			}
+			if (job->want_tuid || job->want_msgid) {
+				char *msgid = job->msgid;
+				job->msgid = 0;
+				if (ce && ce->size < 0)
+					ce->size = job->fsize;
+				for (int n = 0; n < job->bad_tuids; n++)
+					error( "Maildir error: malformed X-TUID header (UID %u)\n", entry->uid );
+				if (job->want_tuid)
+					memcpy( entry->tuid, job->tuid, TUIDL );
+				if (ce && !memchr( job->tuid, ' ', TUIDL ) && !(msgid && strchr( msgid, '\n' ))) {
+					memcpy( ce->tuid, job->tuid, TUIDL );
+					ce->msgid = (msgid && job->want_msgid) ? nfstrdup( msgid ) : msgid;
+					ce->hdr = 1;
+				} else if (!job->want_msgid) {
+					free( msgid );
 				}
-				fclose( f );
+				if (job->want_msgid)
+					entry->msgid = msgid;
 			}
 		}
+		maildir_free_scan_jobs( &jobs );
+		if (ctx->uidmap && (ret = maildir_uidmap_flush( ctx )) != DRV_OK) {
+			maildir_free_scan( msglist );
+			return ret;
+		}
 		ctx->uvok = 1;
+		if (caching)
+			maildir_cache_save( ctx );
 	}
 	return DRV_OK;
 }
@@ -1234,6 +2521,7 @@ maildir_app_msg( maildir_store_t *ctx, message_t ***msgapp, msg_t *entry )
 	*msgapp = &msg->gen.next;
 	msg->gen.uid = entry->uid;
 	msg->gen.status = 0;
+	msg->gen.objid = 0;
 	maildir_init_msg( ctx, msg, entry );
 }
 
@@ -1247,6 +2535,7 @@ maildir_select_box( store_t *gctx, const char *name )
 	ctx->msgs = 0;
 	ctx->excs.data = 0;
 	ctx->uvfd = -1;
+	ctx->resgrow = 0;
 #ifdef USE_DB
 	ctx->db = 0;
 	ctx->usedb = 0;
@@ -1274,6 +2563,38 @@ maildir_get_box_path( store_t *gctx )
 	return ((maildir_store_t *)gctx)->path;
 }
 
+static const char *
+maildir_get_box_fingerprint( store_t *gctx )
+{
+	static const char *const fpdirs[] = { "cur", "new", ".uidvalidity" };
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	struct stat st;
+	uint i, l;
+	char buf[_POSIX_PATH_MAX];
+
+	for (i = 0, l = 0; i < as(fpdirs); i++) {
+		nfsnprintf( buf, sizeof(buf), "%s/%s", ctx->path, fpdirs[i] );
+		if (stat( buf, &st )) {
+			// The UID validity is absent in fresh boxes and with AltMap.
+			if (i < 2 || errno != ENOENT)
+				return 0;
+			l += nfsnprintf( ctx->fingerprint + l, sizeof(ctx->fingerprint) - l, " 0" );
+			continue;
+		}
+		// A further modification would go unnoticed.
+		if (maildir_mtime_unsettled( &st ))
+			return 0;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+		l += nfsnprintf( ctx->fingerprint + l, sizeof(ctx->fingerprint) - l, "%s%lld.%09ld",
+		                 l ? " " : "", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec );
+#else
+		l += nfsnprintf( ctx->fingerprint + l, sizeof(ctx->fingerprint) - l, "%s%lld",
+		                 l ? " " : "", (long long)st.st_mtime );
+#endif
+	}
+	return ctx->fingerprint;
+}
+
 static void
 maildir_open_box( store_t *gctx,
                   void (*cb)( int sts, int uidvalidity, void *aux ), void *aux )
@@ -1285,35 +2606,48 @@ maildir_open_box( store_t *gctx,
 	if ((ret = maildir_validate( ctx->path, ctx->is_inbox, ctx )) != DRV_OK)
 		goto bail;
 
-	nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", ctx->path );
-#ifndef USE_DB
-	if ((ctx->uvfd = open( uvpath, O_RDWR|O_CREAT, 0600 )) < 0) {
-		sys_error( "Maildir error: cannot write %s", uvpath );
-		cb( DRV_BOX_BAD, UIDVAL_BAD, aux );
-		return;
-	}
-#else
+	nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", ctx->path );
+	nfasprintf( &ctx->uidmap, "%s/" UIDMAP_FILE, ctx->path );
+#ifdef USE_DB
 	ctx->usedb = 0;
-	if ((ctx->uvfd = open( uvpath, O_RDWR, 0600 )) < 0) {
-		nfsnprintf( uvpath, sizeof(uvpath), "%s/.isyncuidmap.db", ctx->path );
-		if ((ctx->uvfd = open( uvpath, O_RDWR, 0600 )) < 0) {
-			if (((maildir_store_conf_t *)gctx->conf)->alt_map) {
-				if ((ctx->uvfd = open( uvpath, O_RDWR|O_CREAT, 0600 )) >= 0)
-					goto dbok;
-			} else {
-				nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", ctx->path );
-				if ((ctx->uvfd = open( uvpath, O_RDWR|O_CREAT, 0600 )) >= 0)
-					goto fnok;
+#endif /* USE_DB */
+	if ((ctx->uvfd = open( uvpath, O_RDWR, 0600 )) >= 0) {
+		/* The presence of the UID map determines the scheme of an existing mailbox. */
+		if (maildir_uidmap_open( ctx, 0 )) {
+			if (errno != ENOENT) {
+				cb( DRV_BOX_BAD, UIDVAL_BAD, aux );
+				return;
 			}
+			free( ctx->uidmap );
+			ctx->uidmap = 0;
+		}
+	} else {
+#ifdef USE_DB
+		nfsnprintf( uvpath, sizeof(uvpath), "%s/.isyncuidmap.db", ctx->path );
+		if ((ctx->uvfd = open( uvpath, O_RDWR, 0600 )) >= 0) {
+			ctx->usedb = nfstrdup( uvpath );
+			free( ctx->uidmap );
+			ctx->uidmap = 0;
+			goto dbok;
+		}
+		nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", ctx->path );
+#endif /* USE_DB */
+		if (!((maildir_store_conf_t *)gctx->conf)->alt_map) {
+			free( ctx->uidmap );
+			ctx->uidmap = 0;
+		} else if (maildir_uidmap_open( ctx, 1 )) {
+			/* Creating the UID map first ensures that the scheme is settled. */
+			cb( DRV_BOX_BAD, UIDVAL_BAD, aux );
+			return;
+		}
+		if ((ctx->uvfd = open( uvpath, O_RDWR|O_CREAT, 0600 )) < 0) {
 			sys_error( "Maildir error: cannot write %s", uvpath );
 			cb( DRV_BOX_BAD, UIDVAL_BAD, aux );
 			return;
-		} else {
-		  dbok:
-			ctx->usedb = nfstrdup( uvpath );
 		}
 	}
-  fnok:
+#ifdef USE_DB
+  dbok:
 #endif /* USE_DB */
 	ret = maildir_uidval_lock( ctx );
 
@@ -1344,7 +2678,7 @@ maildir_confirm_box_empty( store_t *gctx )
 
 	ctx->excs.size = ctx->minuid = ctx->maxuid = ctx->newuid = 0;
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK)
+	if (maildir_scan( ctx, &msglist, 0 ) != DRV_OK)
 		return DRV_BOX_BAD;
 	maildir_free_scan( &msglist );
 	return ctx->total_msgs ? DRV_BOX_BAD : DRV_OK;
@@ -1359,6 +2693,8 @@ maildir_delete_box( store_t *gctx,
 	struct stat st;
 	char buf[_POSIX_PATH_MAX];
 
+	wait_async( &ctx->io );
+	maildir_close_dir_fds( ctx->dfd );
 	bl = nfsnprintf( buf, sizeof(buf) - 4, "%s/", ctx->path );
 	if (stat( buf, &st )) {
 		if (errno != ENOENT) {
@@ -1372,6 +2708,12 @@ maildir_delete_box( store_t *gctx,
 		nfsnprintf( buf + bl, sizeof(buf) - bl, ".uidvalidity" );
 		if (unlink( buf ) && errno != ENOENT)
 			goto badrm;
+		nfsnprintf( buf + bl, sizeof(buf) - bl, CACHE_FILE );
+		if (unlink( buf ) && errno != ENOENT)
+			goto badrm;
+		nfsnprintf( buf + bl, sizeof(buf) - bl, UIDMAP_FILE );
+		if (unlink( buf ) && errno != ENOENT)
+			goto badrm;
 #ifdef USE_DB
 		nfsnprintf( buf + bl, sizeof(buf) - bl, ".isyncuidmap.db" );
 		if (unlink( buf ) && errno != ENOENT)
@@ -1419,14 +2761,41 @@ maildir_prepare_load_box( store_t *gctx, int opts )
 	return opts;
 }
 
+static void
+maildir_load_box_p2( maildir_store_t *ctx )
+{
+	message_t **msgapp;
+	msg_t_array_alloc_t msglist;
+	int i, delay = 0;
+
+	if (maildir_scan( ctx, &msglist, &delay ) != DRV_OK) {
+		ctx->load_cb( DRV_BOX_BAD, 0, 0, 0, ctx->load_aux );
+		return;
+	}
+	if (delay) {
+		debug( "deferring scan of %s by %dms due to recent directory modification\n", ctx->path, delay );
+		conf_wakeup( &ctx->scantmr, delay );
+		return;
+	}
+	msgapp = &ctx->msgs;
+	for (i = 0; i < msglist.array.size; i++)
+		maildir_app_msg( ctx, &msgapp, msglist.array.data + i );
+	maildir_free_scan( &msglist );
+
+	ctx->load_cb( DRV_OK, ctx->msgs, ctx->total_msgs, ctx->recent_msgs, ctx->load_aux );
+}
+
+static void
+scantmr_timeout( void *aux )
+{
+	maildir_load_box_p2( (maildir_store_t *)aux );
+}
+
 static void
 maildir_load_box( store_t *gctx, uint minuid, uint maxuid, uint newuid, uint seenuid, uint_array_t excs,
                   void (*cb)( int sts, message_t *msgs, int total_msgs, int recent_msgs, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	message_t **msgapp;
-	msg_t_array_alloc_t msglist;
-	int i;
 
 	ctx->minuid = minuid;
 	ctx->maxuid = maxuid;
@@ -1434,135 +2803,644 @@ maildir_load_box( store_t *gctx, uint minuid, uint maxuid, uint newuid, uint see
 	ctx->seenuid = seenuid;
 	ARRAY_SQUEEZE( &excs );
 	ctx->excs = excs;
+	ctx->load_cb = cb;
+	ctx->load_aux = aux;
+
+	maildir_load_box_p2( ctx );
+}
+
+/* Find the file of msg again after it vanished, presumably because another
+ * client renamed it to change its flags. Only the part of the name up to the
+ * info delimiter is stable, so the subfolder the file was in is searched for
+ * that first, then the other one. All other messages are left alone. */
+static int
+maildir_relocate( maildir_store_t *ctx, maildir_message_t *msg )
+{
+	maildir_store_conf_t *conf = (maildir_store_conf_t *)ctx->gen.conf;
+	dir_list_t dl;
+	const char *name, *u;
+	int i, sub, kl;
+	char buf[_POSIX_PATH_MAX];
+
+	kl = (u = strchr( msg->base, conf->info_delimiter )) ? u - msg->base : (int)strlen( msg->base );
+	for (i = 0; i < 2; i++) {
+		sub = (msg->gen.status & M_RECENT) ^ i;
+		nfsnprintf( buf, sizeof(buf), "%s/%s", ctx->path, subdirs[sub] );
+		if (dir_list_open( &dl, maildir_dir_fd( ctx->dfd, ctx->path, sub ), buf ) < 0) {
+			sys_error( "Maildir error: cannot list %s", buf );
+			return DRV_BOX_BAD;
+		}
+		while ((name = dir_list_next( &dl ))) {
+			if (!strncmp( name, msg->base, kl ) && (!name[kl] || name[kl] == conf->info_delimiter)) {
+				debug( "message %u moved to %s/%s\n", msg->gen.uid, subdirs[sub], name );
+				free( msg->base );
+				msg->base = nfstrdup( name );
+				dir_list_close( &dl );
+				msg->gen.status &= ~(M_FLAGS|M_RECENT);
+				msg->gen.status |= sub;  // new/ is the one with recent messages
+				if (ctx->opts & OPEN_FLAGS) {
+					msg->gen.status |= M_FLAGS;
+					msg->gen.flags = maildir_parse_flags( conf->info_prefix, msg->base );
+				}
+				return DRV_OK;
+			}
+		}
+		if (errno) {
+			sys_error( "Maildir error: cannot list %s", buf );
+			dir_list_close( &dl );
+			return DRV_BOX_BAD;
+		}
+		dir_list_close( &dl );
+	}
+	debug( "purging deleted message %u\n", msg->gen.uid );
+	msg->gen.status = M_DEAD;
+	return DRV_OK;
+}
+
+static int
+maildir_again( maildir_store_t *ctx, maildir_message_t *msg,
+               const char *err, const char *fn, const char *fn2 )
+{
+	int ret;
+
+	if (errno != ENOENT) {
+		sys_error( err, fn, fn2 );
+		return DRV_BOX_BAD;
+	}
+	if ((ret = maildir_relocate( ctx, msg )) != DRV_OK)
+		return ret;
+	return (msg->gen.status & M_DEAD) ? DRV_MSG_BAD : DRV_OK;
+}
+
+static void
+maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+	int fd = -1, ret, bl, sub, dfd;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX];
 
-	if (maildir_scan( ctx, &msglist ) != DRV_OK) {
-		cb( DRV_BOX_BAD, 0, 0, 0, aux );
+	// The file may be just being renamed.
+	wait_async( &ctx->io );
+	for (;;) {
+		sub = gmsg->status & M_RECENT;
+		bl = nfsnprintf( buf, sizeof(buf), "%s/%s/", ctx->path, subdirs[sub] );
+		nfsnprintf( buf + bl, sizeof(buf) - bl, "%s", msg->base );
+		dfd = maildir_dir_fd( ctx->dfd, ctx->path, sub );
+		if ((fd = maildir_open_at( dfd, buf, bl, O_RDONLY )) >= 0)
+			break;
+		if ((ret = maildir_again( ctx, msg, "Cannot open %s", buf, 0 )) != DRV_OK) {
+			cb( ret, aux );
+			return;
+		}
+	}
+	fstat( fd, &st );
+	data->len = st.st_size;
+	if (data->date == -1)
+		data->date = st.st_mtime;
+	if (data->want_file) {
+		/* The file can be passed on as-is, as messages are never modified in place.
+		 * It is kept open, as it may be renamed before store_msg() gets to it. */
+		data->file = nfstrdup( buf );
+		data->fd = fd;
+		data->data = 0;
+		goto gotit;
+	}
+	/* Messages are read rather than mapped, as another client truncating
+	 * the file would make accesses to the mapping raise SIGBUS. */
+	data->data = nfmalloc( data->len );
+	if (read( fd, data->data, data->len ) != data->len) {
+		sys_error( "Maildir error: cannot read %s", buf );
+		close( fd );
+		cb( DRV_MSG_BAD, aux );
 		return;
 	}
-	msgapp = &ctx->msgs;
-	for (i = 0; i < msglist.array.size; i++)
-		maildir_app_msg( ctx, &msgapp, msglist.array.data + i );
-	maildir_free_scan( &msglist );
+	close( fd );
+  gotit:
+	if (!(gmsg->status & M_FLAGS))
+		data->flags = maildir_parse_flags( ((maildir_store_conf_t *)gctx->conf)->info_prefix, msg->base );
+	cb( DRV_OK, aux );
+}
+
+static int
+maildir_make_flags( char info_delimiter, int flags, char *buf )
+{
+	uint i, d;
 
-	cb( DRV_OK, ctx->msgs, ctx->total_msgs, ctx->recent_msgs, aux );
+	buf[0] = info_delimiter;
+	buf[1] = '2';
+	buf[2] = ',';
+	for (d = 3, i = 0; i < as(Flags); i++)
+		if (flags & (1 << i))
+			buf[d++] = Flags[i];
+	buf[d] = 0;
+	return d;
 }
 
+/* The message size is recorded in the name, so scans need not stat() the file. */
 static int
-maildir_rescan( maildir_store_t *ctx )
+maildir_make_base( maildir_store_t *ctx, char *base, int size, int msize, uint *uid )
 {
-	message_t **msgapp;
-	maildir_message_t *msg;
-	msg_t_array_alloc_t msglist;
-	int i;
+	int ret, bl;
 
-	ctx->fresh[0] = ctx->fresh[1] = 0;
-	if (maildir_scan( ctx, &msglist ) != DRV_OK)
+	bl = nfsnprintf( base, size, "%lld.%d_%d.%s,S=%d", (long long)time( 0 ), Pid, ++MaildirCount, Hostname, msize );
+#ifdef USE_DB
+	if (ctx->usedb)
+		return maildir_set_uid( ctx, base, uid );
+#endif /* USE_DB */
+	if (ctx->uidmap) {
+		if ((ret = maildir_uidmap_assign( ctx, base, uid, 1 )) != DRV_OK)
+			return ret;
+		return maildir_uidmap_flush( ctx );
+	}
+	if ((ret = maildir_obtain_uid( ctx, uid, 1 )) != DRV_OK)
+		return ret;
+	nfsnprintf( base + bl, size - bl, ",U=%u", *uid );
+	return DRV_OK;
+}
+
+/* Encode a key into a file name. Returns -1 if the result would be too long. */
+static int
+maildir_key_name( const char *key, char *buf, int size )
+{
+	int l = 0;
+	uchar c;
+
+	for (; (c = (uchar)*key); key++) {
+		if (l + 4 > size)
+			return -1;
+		if (c <= ' ' || c >= 127 || c == '/' || c == '%' || (!l && c == '.'))
+			l += sprintf( buf + l, "%%%02X", c );
+		else
+			buf[l++] = c;
+	}
+	buf[l] = 0;
+	return l;
+}
+
+static int
+maildir_links_path( maildir_store_t *ctx, const char *key, char *buf, int size )
+{
+	int bl = nfsnprintf( buf, size, "%s/", ctx->links );
+	if (bl + 200 > size || maildir_key_name( key, buf + bl, 200 ) < 0)
+		return -1;
+	return 0;
+}
+
+static void
+maildir_add_link( maildir_store_t *ctx, const char *key, const char *path )
+{
+	char buf[_POSIX_PATH_MAX];
+
+	if (maildir_links_path( ctx, key, buf, sizeof(buf) ) < 0)
+		return;
+	if (!link( path, buf ))
+		return;
+	if (errno == ENOENT) {
+		if (mkdir( ctx->links, 0700 ) && errno != EEXIST)
+			return;
+		if (!link( path, buf ))
+			return;
+	}
+	if (errno == EEXIST) {
+		// The old message is gone (or duplicated); point the key at the new copy.
+		unlink( buf );
+		if (!link( path, buf ))
+			return;
+	}
+	debug( "cannot link %s to %s: %s\n", path, buf, strerror( errno ) );
+}
+
+#ifdef HAVE_LIBSSL
+/* Locate the X-TUID header line of a message. Returns its offset and
+ * sets *end to the offset after it, or returns -1 if there is none. */
+static int
+maildir_find_tuid( const char *data, int len, int *end )
+{
+	int start = 0, idx = 0;
+
+	while (idx < len) {
+		if (data[idx++] != '\n')
+			continue;
+		if (starts_with_upper( data + start, idx - start, "X-TUID: ", 8 )) {
+			*end = idx;
+			return start;
+		}
+		if (idx - start <= 2 && (idx - start == 1 || data[start] == '\r'))
+			break;  // end of header
+		start = idx;
+	}
+	return -1;
+}
+
+/* Make a content key for a message. The X-TUID header is excluded,
+ * as it differs between the copies of one message. */
+static int
+maildir_hash_msg( const char *data, int len, char *key, int size )
+{
+	EVP_MD_CTX *mdctx;
+	uchar md[EVP_MAX_MD_SIZE];
+	uint i, mdlen;
+	int start, end, ok;
+
+	if (!(mdctx = EVP_MD_CTX_new()))
+		return 0;
+	ok = EVP_DigestInit_ex( mdctx, EVP_sha256(), 0 );
+	if ((start = maildir_find_tuid( data, len, &end )) >= 0)
+		ok = ok && EVP_DigestUpdate( mdctx, data, start ) &&
+		     EVP_DigestUpdate( mdctx, data + end, len - end );
+	else
+		ok = ok && EVP_DigestUpdate( mdctx, data, len );
+	ok = ok && EVP_DigestFinal_ex( mdctx, md, &mdlen );
+	EVP_MD_CTX_free( mdctx );
+	if (!ok || (int)(mdlen * 2 + 2) > size)
+		return 0;
+	*key++ = 'H';
+	for (i = 0; i < mdlen; i++, key += 2)
+		sprintf( key, "%02x", md[i] );
+	return 1;
+}
+#endif /* HAVE_LIBSSL */
+
+/* Write the message to fd, copying it from sfd if it is a file. On failure,
+ * errno is set; a short write is reported as ENOSPC. */
+static int
+maildir_write_msg( int fd, msg_data_t *data, int sfd )
+{
+	int ret;
+	char buf[64 * 1024];
+
+	if (sfd < 0) {
+		if ((ret = write( fd, data->data, data->len )) == data->len)
+			return 0;
+		if (ret >= 0)
+			errno = ENOSPC;
+		return -1;
+	}
+	if (lseek( sfd, 0, SEEK_SET ))
+		return -1;
+#ifdef FICLONE
+	/* On file systems which support it, share the extents instead of copying. */
+	if (!ioctl( fd, FICLONE, sfd ))
+		return 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* This avoids moving the data through user space, and may be offloaded. */
+	ssize_t n;
+	int copied = 0;
+	while ((n = copy_file_range( sfd, 0, fd, 0, INT_MAX, 0 )) > 0)
+		copied = 1;
+	if (!n)
+		return 0;
+	if (copied || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+		return -1;
+#endif
+	while ((ret = read( sfd, buf, sizeof(buf) )) > 0) {
+		int wret = write( fd, buf, ret );
+		if (wret != ret) {
+			if (wret >= 0)
+				errno = ENOSPC;
+			return -1;
+		}
+	}
+	return ret;
+}
+
+/* The disk part of store_msg(), which is done by a chain of io_uring
+ * operations, or runs on a worker thread. */
+typedef struct {
+	async_job_t gen;
+	maildir_store_t *ctx;
+	msg_data_t *data;
+	void (*cb)( int sts, uint uid, void *aux );
+	void *aux;
+	uint uid;
+	char to_trash, validated, use_tmpfile, no_tmpfile, dedup;
+	char linked; // see LINKED_*
+	int sub, tdfd, ndfd, bl, nbl;
+	int step, err; // what failed, and why; see STORE_*
+	const char *epath; // the file the failure is about
+	int charge; // accounted in store_mem
+	int uring, slot, nops;
+	async_op_t ops[5];
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+#ifdef HAVE_LIBSSL
+	char hkey[2 * EVP_MAX_MD_SIZE + 2];
+#endif /* HAVE_LIBSSL */
+} store_job_t;
+
+enum { STORE_OK, STORE_CREATE, STORE_WRITE, STORE_TIMES, STORE_RENAME };
+enum { LINKED_NONE, LINKED_DUP, LINKED_FILE };
+
+static int
+maildir_store_fail( store_job_t *job, int step, const char *epath )
+{
+	job->step = step;
+	job->err = errno;
+	job->epath = epath;
+	return DRV_BOX_BAD;
+}
+
+#ifdef HAVE_OPENAT
+/* Give the file open as fd another name. Linking the descriptor itself
+ * requires privileges, so go through /proc if possible. */
+static int
+maildir_link_fd( int fd, int ndfd, const char *npath, int noff )
+{
+	char pbuf[40];
+
+	snprintf( pbuf, sizeof(pbuf), "/proc/self/fd/%d", fd );
+	if (!linkat( AT_FDCWD, pbuf, AT_FD(ndfd), AT_NAME(ndfd, npath, noff), AT_SYMLINK_FOLLOW ))
+		return 0;
+# ifdef AT_EMPTY_PATH
+	if (errno != EEXIST)
+		return linkat( fd, "", AT_FD(ndfd), AT_NAME(ndfd, npath, noff), AT_EMPTY_PATH );
+# endif
+	return -1;
+}
+#endif
+
+#if defined(HAVE_OPENAT) && defined(HAVE_FUTIMENS) && defined(O_TMPFILE)
+static int NoTmpFile;
+
+/* Deliver a message by writing it to an anonymous file, which is then linked
+ * into its final place. This saves creating and renaming a temporary entry.
+ * Returns -1 if the file system cannot do that, so tmp/ must be used. */
+static int
+maildir_store_tmpfile( store_job_t *job, int sfd )
+{
+	msg_data_t *data = job->data;
+	int fd;
+
+	if ((fd = openat( job->tdfd, ".", O_WRONLY | O_TMPFILE, 0600 )) < 0) {
+		if (errno != EISDIR && errno != EOPNOTSUPP && errno != EINVAL)
+			return maildir_store_fail( job, STORE_CREATE, job->nbuf );
+		job->no_tmpfile = 1;
+		return -1;
+	}
+	if (maildir_write_msg( fd, data, sfd ) || (UseFSync && fsync( fd ))) {
+		maildir_store_fail( job, STORE_WRITE, job->nbuf );
+		close( fd );
 		return DRV_BOX_BAD;
-	for (msgapp = &ctx->msgs, i = 0;
-	     (msg = (maildir_message_t *)*msgapp) || i < msglist.array.size; )
-	{
-		if (!msg) {
-#if 0
-			debug( "adding new message %u\n", msglist.array.data[i].uid );
-			maildir_app_msg( ctx, &msgapp, msglist.array.data + i );
-#else
-			debug( "ignoring new message %u\n", msglist.array.data[i].uid );
+	}
+	if (data->date) {
+		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
+		struct timespec times[2];
+		times[0].tv_sec = times[1].tv_sec = data->date;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		if (futimens( fd, times ) < 0) {
+			maildir_store_fail( job, STORE_TIMES, job->nbuf );
+			close( fd );
+			return DRV_BOX_BAD;
+		}
+	}
+	if (maildir_link_fd( fd, job->ndfd, job->nbuf, job->nbl )) {
+		if (errno == EEXIST) {
+			maildir_store_fail( job, STORE_CREATE, job->nbuf );
+			close( fd );
+			return DRV_BOX_BAD;
+		}
+		job->no_tmpfile = 1;
+		close( fd );
+		return -1;
+	}
+	if (close( fd ) < 0) {
+		/* Quota exceeded may cause this. */
+		maildir_store_fail( job, STORE_WRITE, job->nbuf );
+		unlinkat( job->ndfd, job->nbuf + job->nbl, 0 );
+		return DRV_BOX_BAD;
+	}
+	return DRV_OK;
+}
 #endif
-			i++;
-		} else if (i >= msglist.array.size) {
-			debug( "purging deleted message %u\n", msg->gen.uid );
-			msg->gen.status = M_DEAD;
-			msgapp = &msg->gen.next;
-		} else if (msglist.array.data[i].uid < msg->gen.uid) {
-			/* this should not happen, actually */
-#if 0
-			debug( "adding new message %u\n", msglist.array.data[i].uid );
-			maildir_app_msg( ctx, &msgapp, msglist.array.data + i );
-#else
-			debug( "ignoring new message %u\n", msglist.array.data[i].uid );
+
+static void
+maildir_store_work( async_job_t *gjob )
+{
+	store_job_t *job = (store_job_t *)gjob;
+	msg_data_t *data = job->data;
+	int fd, sfd = -1;
+
+	job->step = STORE_OK;
+	job->linked = LINKED_NONE;
+#ifdef HAVE_LIBSSL
+	char lbuf[_POSIX_PATH_MAX];
+	if (!job->dedup || !maildir_hash_msg( data->data, data->len, job->hkey, sizeof(job->hkey) )) {
+		job->hkey[0] = 0;
+	} else if (!maildir_links_path( job->ctx, job->hkey, lbuf, sizeof(lbuf) ) &&
+	           !maildir_link_at( -1, lbuf, 0, job->ndfd, job->nbuf, job->nbl )) {
+		job->linked = LINKED_DUP;
+		return;
+	}
+#endif /* HAVE_LIBSSL */
+	if (data->file) {
+		/* Sharing the file is fine, as messages are never modified in place.
+		 * The descriptor still finds it if it was renamed meanwhile, and if it
+		 * was deleted altogether, its contents can still be copied. */
+		if (
+#ifdef HAVE_OPENAT
+		    !maildir_link_fd( data->fd, job->ndfd, job->nbuf, job->nbl ) ||
 #endif
-			i++;
-		} else if (msglist.array.data[i].uid > msg->gen.uid) {
-			debug( "purging deleted message %u\n", msg->gen.uid );
-			msg->gen.status = M_DEAD;
-			msgapp = &msg->gen.next;
-		} else {
-			debug( "updating message %u\n", msg->gen.uid );
-			msg->gen.status &= ~(M_FLAGS|M_RECENT);
-			free( msg->base );
-			free( msg->gen.msgid );
-			maildir_init_msg( ctx, msg, msglist.array.data + i );
-			i++, msgapp = &msg->gen.next;
+		    !maildir_link_at( -1, data->file, 0, job->ndfd, job->nbuf, job->nbl )) {
+			job->linked = LINKED_FILE;
+			return;
 		}
+		sfd = data->fd;
+	}
+#if defined(HAVE_OPENAT) && defined(HAVE_FUTIMENS) && defined(O_TMPFILE)
+	if (job->use_tmpfile && job->tdfd >= 0 && job->ndfd >= 0 && maildir_store_tmpfile( job, sfd ) >= 0)
+		return;
+#endif
+	if ((fd = maildir_open_at( job->tdfd, job->buf, job->bl, O_WRONLY|O_CREAT|O_EXCL )) < 0) {
+		maildir_store_fail( job, STORE_CREATE, job->buf );
+		return;
+	}
+	if (maildir_write_msg( fd, data, sfd ) || (UseFSync && fsync( fd ))) {
+		maildir_store_fail( job, STORE_WRITE, job->buf );
+		close( fd );
+	} else if (close( fd ) < 0) {
+		/* Quota exceeded may cause this. */
+		maildir_store_fail( job, STORE_WRITE, job->buf );
+	} else if (data->date && maildir_utime_at( job->tdfd, job->buf, job->bl, data->date ) < 0) {
+		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
+		maildir_store_fail( job, STORE_TIMES, job->buf );
+	} else if (maildir_rename_at( job->tdfd, job->buf, job->bl, job->ndfd, job->nbuf, job->nbl )) {
+		maildir_store_fail( job, STORE_RENAME, job->buf );
 	}
-	maildir_free_scan( &msglist );
-	return DRV_OK;
 }
 
+/* Deliver a message which is in memory by linked io_uring operations:
+ * create in tmp/, write, possibly fsync, close, and rename into place.
+ * Returns -1 if the message needs the worker thread. */
 static int
-maildir_again( maildir_store_t *ctx, maildir_message_t *msg,
-               const char *err, const char *fn, const char *fn2 )
+maildir_store_uring( store_job_t *job )
 {
-	int ret;
+#ifdef HAVE_OPENAT
+	async_op_t *op;
+	int i;
 
-	if (errno != ENOENT) {
-		sys_error( err, fn, fn2 );
-		return DRV_BOX_BAD;
+	if (job->data->file || job->data->date || job->dedup || !uring_available())
+		return -1;
+	if ((job->slot = alloc_uring_file()) < 0)
+		return -1;
+	job->uring = 1;
+	memset( job->ops, 0, sizeof(job->ops) );
+	op = job->ops;
+	op->type = AOP_OPEN;
+	op->dfd = AT_FD(job->tdfd);
+	op->path = AT_NAME(job->tdfd, job->buf, job->bl);
+	op->flags = O_WRONLY | O_CREAT | O_EXCL;
+	op->file = job->slot;
+	op++;
+	op->type = AOP_WRITE;
+	op->file = job->slot;
+	op->buf = job->data->data;
+	op->len = (uint)job->data->len;
+	if (UseFSync) {
+		op++;
+		op->type = AOP_FSYNC;
+		op->file = job->slot;
 	}
-	if ((ret = maildir_rescan( ctx )) != DRV_OK)
-		return ret;
-	return (msg->gen.status & M_DEAD) ? DRV_MSG_BAD : DRV_OK;
+	op++;
+	op->type = AOP_CLOSE;
+	op->file = job->slot;
+	op++;
+	op->type = AOP_RENAME;
+	op->dfd = AT_FD(job->tdfd);
+	op->path = AT_NAME(job->tdfd, job->buf, job->bl);
+	op->ndfd = AT_FD(job->ndfd);
+	op->npath = AT_NAME(job->ndfd, job->nbuf, job->nbl);
+	job->nops = op + 1 - job->ops;
+	for (i = 0; i < job->nops; i++) {
+		job->ops[i].link = i < job->nops - 1;
+		queue_uring( &job->gen, &job->ops[i] );
+	}
+	submit_uring( &job->ctx->io, &job->gen );
+	return 0;
+#else
+	(void)job;
+	return -1;
+#endif
 }
 
+/* Turn the results of the io_uring operations into the shape maildir_store_work() leaves. */
 static void
-maildir_fetch_msg( store_t *gctx, message_t *gmsg, msg_data_t *data,
-                   void (*cb)( int sts, void *aux ), void *aux )
+maildir_store_uring_result( store_job_t *job )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	maildir_message_t *msg = (maildir_message_t *)gmsg;
-	int fd, ret;
-	struct stat st;
-	char buf[_POSIX_PATH_MAX];
+	async_op_t *op;
+	int i, res, closed = 0;
+
+	job->uring = 0;
+	job->step = STORE_OK;
+	job->linked = LINKED_NONE;
+	for (i = 0; i < job->nops; i++) {
+		op = &job->ops[i];
+		res = op->res;
+		if (op->type == AOP_CLOSE)
+			closed = (res != -ECANCELED);
+		if (job->step != STORE_OK)
+			continue;  // the rest of the chain was canceled
+		if (op->type == AOP_WRITE && res >= 0 && (uint)res != op->len)
+			res = -ENOSPC;
+		if (res < 0) {
+			errno = -res;
+			maildir_store_fail( job, op->type == AOP_OPEN ? STORE_CREATE :
+			                         op->type == AOP_RENAME ? STORE_RENAME : STORE_WRITE, job->buf );
+		}
+	}
+	free_uring_file( job->slot, job->ops[0].res >= 0 && !closed );
+}
 
-	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", ctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
-		if ((fd = open( buf, O_RDONLY )) >= 0)
-			break;
-		if ((ret = maildir_again( ctx, msg, "Cannot open %s", buf, 0 )) != DRV_OK) {
-			cb( ret, aux );
+static void
+maildir_store_done( async_job_t *gjob )
+{
+	store_job_t *job = (store_job_t *)gjob;
+	maildir_store_t *ctx = job->ctx;
+	msg_data_t *data = job->data;
+	int ret;
+
+	if (job->uring)
+		maildir_store_uring_result( job );
+	if (job->gen.canceled)
+		goto bail;
+	ctx->store_mem -= job->charge;
+	job->charge = 0;
+#if defined(HAVE_OPENAT) && defined(HAVE_FUTIMENS) && defined(O_TMPFILE)
+	if (job->no_tmpfile)
+		NoTmpFile = 1;
+#endif
+	switch (job->step) {
+	case STORE_OK:
+		break;
+	case STORE_CREATE:
+		if (job->err == ENOENT && job->to_trash && !job->validated) {
+			if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK) {
+				job->cb( ret, 0, job->aux );
+				goto bail;
+			}
+			// Later commands may be using the descriptors still.
+			wait_async( &ctx->io );
+			maildir_close_dir_fds( ctx->tfd );
+			job->tdfd = maildir_dir_fd( ctx->tfd, ctx->trash, 2 );
+			job->ndfd = maildir_dir_fd( ctx->tfd, ctx->trash, job->sub );
+			job->validated = 1;
+			if (maildir_store_uring( job ) < 0)
+				submit_async( &ctx->io, &job->gen );
 			return;
 		}
+		errno = job->err;
+		sys_error( "Maildir error: cannot create %s", job->epath );
+		goto fail;
+	case STORE_WRITE:
+		errno = job->err;
+		sys_error( "Maildir error: cannot write %s", job->epath );
+		goto fail;
+	case STORE_TIMES:
+		errno = job->err;
+		sys_error( "Maildir error: cannot set times for %s", job->epath );
+		goto fail;
+	default:
+		errno = job->err;
+		sys_error( "Maildir error: cannot rename %s to %s", job->buf, job->nbuf );
+	  fail:
+		job->cb( DRV_BOX_BAD, 0, job->aux );
+		goto bail;
 	}
-	fstat( fd, &st );
-	data->len = st.st_size;
-	if (data->date == -1)
-		data->date = st.st_mtime;
-	data->data = nfmalloc( data->len );
-	if (read( fd, data->data, data->len ) != data->len) {
-		sys_error( "Maildir error: cannot read %s", buf );
-		close( fd );
-		cb( DRV_MSG_BAD, aux );
-		return;
+	if (job->linked == LINKED_DUP)
+		debug( "deduplicated message into %s\n", job->nbuf );
+	else if (job->linked == LINKED_FILE)
+		debug( "linked %s into %s\n", data->file, job->nbuf );
+	if (!job->to_trash) {
+		if (data->key)
+			maildir_add_link( ctx, data->key, job->nbuf );
+#ifdef HAVE_LIBSSL
+		if (job->hkey[0] && job->linked != LINKED_DUP)
+			maildir_add_link( ctx, job->hkey, job->nbuf );
+#endif /* HAVE_LIBSSL */
 	}
-	close( fd );
-	if (!(gmsg->status & M_FLAGS))
-		data->flags = maildir_parse_flags( ((maildir_store_conf_t *)gctx->conf)->info_prefix, msg->base );
-	cb( DRV_OK, aux );
+	free_msg_data( data );
+	job->cb( DRV_OK, job->uid, job->aux );
+	free( job );
+	return;
+  bail:
+	free_msg_data( data );
+	free( job );
 }
 
+/* Pending stores hold their message, either in memory or as an open file.
+ * Descriptors are scarcer than memory, so each file counts as a share of
+ * the buffer limit big enough to keep their number well below the usual
+ * descriptor limit. */
+#define MAX_PENDING_FILES 64
+
 static int
-maildir_make_flags( char info_delimiter, int flags, char *buf )
+maildir_store_charge( msg_data_t *data )
 {
-	uint i, d;
-
-	buf[0] = info_delimiter;
-	buf[1] = '2';
-	buf[2] = ',';
-	for (d = 3, i = 0; i < as(Flags); i++)
-		if (flags & (1 << i))
-			buf[d++] = Flags[i];
-	buf[d] = 0;
-	return d;
+	if (data->file && data->len < BufferLimit / MAX_PENDING_FILES)
+		return BufferLimit / MAX_PENDING_FILES;
+	return data->len;
 }
 
 static void
@@ -1570,91 +3448,105 @@ maildir_store_msg( store_t *gctx, msg_data_t *data, int to_trash,
                    void (*cb)( int sts, uint uid, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	const char *box;
-	int ret, fd, bl;
+	store_job_t *job;
+	const char *box, *tuid = data->tuid;
+	int ret, bl, sub, *fds, dedup = 0;
 	uint uid;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+	char fbuf[NUM_FLAGS + 3], base[128];
 
-	bl = nfsnprintf( base, sizeof(base), "%lld.%d_%d.%s", (long long)time( 0 ), Pid, ++MaildirCount, Hostname );
+	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
+	sub = !(data->flags & F_SEEN);
+	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, data->flags, fbuf );
 	if (!to_trash) {
-#ifdef USE_DB
-		if (ctx->usedb) {
-			if ((ret = maildir_set_uid( ctx, base, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
-		} else
-#endif /* USE_DB */
-		{
-			if ((ret = maildir_obtain_uid( ctx, &uid )) != DRV_OK) {
-				free( data->data );
-				cb( ret, 0, aux );
-				return;
-			}
-			nfsnprintf( base + bl, sizeof(base) - bl, ",U=%u", uid );
+		if ((ret = maildir_make_base( ctx, base, sizeof(base), data->len, &uid )) != DRV_OK) {
+			free_msg_data( data );
+			cb( ret, 0, aux );
+			return;
 		}
 		box = ctx->path;
+		fds = ctx->dfd;
 	} else {
+		nfsnprintf( base, sizeof(base), "%lld.%d_%d.%s,S=%d", (long long)time( 0 ), Pid, ++MaildirCount, Hostname, data->len );
 		uid = 0;
 		box = ctx->trash;
+		fds = ctx->tfd;
 	}
-
-	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, data->flags, fbuf );
-	nfsnprintf( buf, sizeof(buf), "%s/tmp/%s%s", box, base, fbuf );
-	if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-		if (errno != ENOENT || !to_trash) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
-		}
-		if ((ret = maildir_validate( box, 1, ctx )) != DRV_OK) {
-			free( data->data );
-			cb( ret, 0, aux );
-			return;
-		}
-		if ((fd = open( buf, O_WRONLY|O_CREAT|O_EXCL, 0600 )) < 0) {
-			sys_error( "Maildir error: cannot create %s", buf );
-			free( data->data );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
+#ifdef HAVE_LIBSSL
+	dedup = !to_trash && ((maildir_store_conf_t *)gctx->conf)->dedup && !data->file;
+	if (dedup) {
+		/* A deduplicated copy shares the file of another message, so its
+		 * X-TUID header is not ours. Record the TUID in the name as well. */
+		int end;
+		ret = maildir_find_tuid( data->data, data->len, &end );
+		if (ret >= 0 && end - ret >= 8 + TUIDL + 1) {
+			tuid = data->data + ret + 8;
+			for (bl = 0; bl < TUIDL && (isalnum( (uchar)tuid[bl] ) || tuid[bl] == '+' || tuid[bl] == '/'); bl++);
+			if (bl < TUIDL)
+				tuid = 0;
 		}
 	}
-	ret = write( fd, data->data, data->len );
-	free( data->data );
-	if (ret != data->len || (UseFSync && (ret = fsync( fd )))) {
-		if (ret < 0)
-			sys_error( "Maildir error: cannot write %s", buf );
-		else
-			error( "Maildir error: cannot write %s. Disk full?\n", buf );
-		close( fd );
-		cb( DRV_BOX_BAD, 0, aux );
-		return;
+#endif /* HAVE_LIBSSL */
+	if (tuid) {
+		bl = strlen( base );
+		if (bl + 3 + TUIDL >= (int)sizeof(base))
+			oob();
+		memcpy( base + bl, ",T=", 3 );
+		for (bl += 3, ret = 0; ret < TUIDL; ret++)
+			base[bl + ret] = (tuid[ret] == '/') ? '_' : tuid[ret];
+		base[bl + TUIDL] = 0;
 	}
-	if (close( fd ) < 0) {
-		/* Quota exceeded may cause this. */
-		sys_error( "Maildir error: cannot write %s", buf );
-		cb( DRV_BOX_BAD, 0, aux );
+
+	// The file operations overlap with whatever the other store is doing.
+	job = nfcalloc( sizeof(*job) );
+	job->gen.work = maildir_store_work;
+	job->gen.done = maildir_store_done;
+	job->ctx = ctx;
+	job->data = data;
+	job->cb = cb;
+	job->aux = aux;
+	job->uid = uid;
+	job->to_trash = to_trash;
+	job->sub = sub;
+	job->charge = maildir_store_charge( data );
+	ctx->store_mem += job->charge;
+	job->dedup = dedup;
+#if defined(HAVE_OPENAT) && defined(HAVE_FUTIMENS) && defined(O_TMPFILE)
+	job->use_tmpfile = !NoTmpFile;
+#endif
+	job->bl = nfsnprintf( job->buf, sizeof(job->buf), "%s/tmp/", box );
+	nfsnprintf( job->buf + job->bl, sizeof(job->buf) - job->bl, "%s%s", base, fbuf );
+	job->nbl = nfsnprintf( job->nbuf, sizeof(job->nbuf), "%s/%s/", box, subdirs[sub] );
+	nfsnprintf( job->nbuf + job->nbl, sizeof(job->nbuf) - job->nbl, "%s%s", base, fbuf );
+	job->tdfd = maildir_dir_fd( fds, box, 2 );
+	job->ndfd = maildir_dir_fd( fds, box, sub );
+	if (maildir_store_uring( job ) < 0)
+		submit_async( &ctx->io, &job->gen );
+}
+
+static void
+maildir_link_msg( store_t *gctx, const char *key, int flags,
+                  void (*cb)( int sts, uint uid, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	int ret, nbl;
+	uint uid;
+	struct stat st;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX], fbuf[NUM_FLAGS + 3], base[128];
+
+	if (maildir_links_path( ctx, key, buf, sizeof(buf) ) < 0 || stat( buf, &st )) {
+		cb( DRV_MSG_BAD, 0, aux );
 		return;
 	}
-
-	if (data->date) {
-		/* Set atime and mtime according to INTERNALDATE or mtime of source message */
-		struct utimbuf utimebuf;
-		utimebuf.actime = utimebuf.modtime = data->date;
-		if (utime( buf, &utimebuf ) < 0) {
-			sys_error( "Maildir error: cannot set times for %s", buf );
-			cb( DRV_BOX_BAD, 0, aux );
-			return;
-		}
+	if ((ret = maildir_make_base( ctx, base, sizeof(base), (int)st.st_size, &uid )) != DRV_OK) {
+		cb( ret, 0, aux );
+		return;
 	}
-
-	/* Moving seen messages to cur/ is strictly speaking incorrect, but makes mutt happy. */
-	nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%s%s", box, subdirs[!(data->flags & F_SEEN)], base, fbuf );
-	if (rename( buf, nbuf )) {
-		sys_error( "Maildir error: cannot rename %s to %s", buf, nbuf );
-		cb( DRV_BOX_BAD, 0, aux );
+	maildir_make_flags( ((maildir_store_conf_t *)gctx->conf)->info_delimiter, flags, fbuf );
+	nbl = nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/", ctx->path, subdirs[!(flags & F_SEEN)] );
+	nfsnprintf( nbuf + nbl, sizeof(nbuf) - nbl, "%s%s", base, fbuf );
+	if (maildir_link_at( -1, buf, 0, maildir_dir_fd( ctx->dfd, ctx->path, !(flags & F_SEEN) ), nbuf, nbl )) {
+		debug( "cannot link %s to %s: %s\n", buf, nbuf, strerror( errno ) );
+		cb( DRV_MSG_BAD, 0, aux );
 		return;
 	}
 	cb( DRV_OK, uid, aux );
@@ -1667,6 +3559,110 @@ maildir_find_new_msgs( store_t *gctx ATTR_UNUSED, uint newuid ATTR_UNUSED,
 	assert( !"maildir_find_new_msgs is not supposed to be called" );
 }
 
+/* A rename of a message file, which is done by io_uring or runs on a worker
+ * thread. The message's state is updated up front, so later commands see
+ * the outcome. */
+typedef struct {
+	async_job_t gen;
+	maildir_store_t *ctx;
+	maildir_message_t *msg;
+	void (*cb)( int sts, void *aux );
+	void *aux;
+	int add, del; // for set_msg_flags()
+	int sub, validated, exists; // for trash_msg()
+	int odfd, ndfd, obl, nbl, err;
+	int uring;
+	async_op_t op;
+	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+} rename_job_t;
+
+static void
+maildir_rename_work( async_job_t *gjob )
+{
+	rename_job_t *job = (rename_job_t *)gjob;
+	struct stat st;
+
+	if (!maildir_rename_at( job->odfd, job->buf, job->obl, job->ndfd, job->nbuf, job->nbl )) {
+		job->err = 0;
+		return;
+	}
+	job->err = errno;
+	// If the source is still there, the target directory may be missing.
+	if (!(job->exists = !maildir_stat_at( job->odfd, job->buf, job->obl, &st )))
+		job->err = errno;
+}
+
+static void
+maildir_submit_rename( rename_job_t *job )
+{
+#ifdef HAVE_OPENAT
+	if (uring_available()) {
+		job->uring = 1;
+		job->op.type = AOP_RENAME;
+		job->op.dfd = AT_FD(job->odfd);
+		job->op.path = AT_NAME(job->odfd, job->buf, job->obl);
+		job->op.ndfd = AT_FD(job->ndfd);
+		job->op.npath = AT_NAME(job->ndfd, job->nbuf, job->nbl);
+		queue_uring( &job->gen, &job->op );
+		submit_uring( &job->ctx->io, &job->gen );
+		return;
+	}
+#endif
+	job->uring = 0;
+	submit_async( &job->ctx->io, &job->gen );
+}
+
+/* Bring the outcome of a rename done by io_uring into the shape maildir_rename_work() leaves. */
+static void
+maildir_rename_result( rename_job_t *job )
+{
+	struct stat st;
+
+	if (!job->uring || !(job->err = -job->op.res))
+		return;
+	if (!(job->exists = !maildir_stat_at( job->odfd, job->buf, job->obl, &st )))
+		job->err = errno;
+}
+
+static rename_job_t *
+maildir_new_rename_job( maildir_store_t *ctx, maildir_message_t *msg, void (*done)( async_job_t * ),
+                        void (*cb)( int sts, void *aux ), void *aux )
+{
+	rename_job_t *job = nfcalloc( sizeof(*job) );
+
+	job->gen.work = maildir_rename_work;
+	job->gen.done = done;
+	job->ctx = ctx;
+	job->msg = msg;
+	job->cb = cb;
+	job->aux = aux;
+	return job;
+}
+
+static void maildir_set_msg_flags( store_t *gctx, message_t *gmsg, uint uid, int add, int del,
+                                   void (*cb)( int sts, void *aux ), void *aux );
+
+static void
+maildir_flags_done( async_job_t *gjob )
+{
+	rename_job_t *job = (rename_job_t *)gjob;
+	int ret;
+
+	maildir_rename_result( job );
+	if (job->gen.canceled) {
+		;
+	} else if (!job->err) {
+		job->cb( DRV_OK, job->aux );
+	} else {
+		errno = job->err;
+		if ((ret = maildir_again( job->ctx, job->msg, "Maildir error: cannot rename %s to %s", job->buf, job->nbuf )) != DRV_OK)
+			job->cb( ret, job->aux );
+		else
+			maildir_set_msg_flags( &job->ctx->gen, &job->msg->gen, 0, job->add, job->del, job->cb, job->aux );
+	}
+	free( job );
+}
+
 static void
 maildir_set_msg_flags( store_t *gctx, message_t *gmsg, uint uid ATTR_UNUSED, int add, int del,
                        void (*cb)( int sts, void *aux ), void *aux )
@@ -1674,55 +3670,51 @@ maildir_set_msg_flags( store_t *gctx, message_t *gmsg, uint uid ATTR_UNUSED, int
 	maildir_store_conf_t *conf = (maildir_store_conf_t *)gctx->conf;
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
 	maildir_message_t *msg = (maildir_message_t *)gmsg;
-	char *s, *p;
+	rename_job_t *job = maildir_new_rename_job( ctx, msg, maildir_flags_done, cb, aux );
+	char *s, *p, *buf = job->buf, *nbuf = job->nbuf;
 	uint i;
-	int j, ret, ol, fl, bbl, bl, tl;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
+	int j, ol, fl, bbl, bl, tl;
 
-	bbl = nfsnprintf( buf, sizeof(buf), "%s/", ctx->path );
+	bbl = nfsnprintf( buf, sizeof(job->buf), "%s/", ctx->path );
 	memcpy( nbuf, ctx->path, bbl - 1 );
 	memcpy( nbuf + bbl - 1, "/cur/", 5 );
-	for (;;) {
-		bl = bbl + nfsnprintf( buf + bbl, sizeof(buf) - bbl, "%s/", subdirs[gmsg->status & M_RECENT] );
-		ol = strlen( msg->base );
-		if ((int)sizeof(buf) - bl < ol + 3 + NUM_FLAGS)
-			oob();
-		memcpy( buf + bl, msg->base, ol + 1 );
-		memcpy( nbuf + bl, msg->base, ol + 1 );
-		if ((s = strstr( nbuf + bl, conf->info_prefix ))) {
-			s += 3;
-			fl = ol - (s - (nbuf + bl));
-			for (i = 0; i < as(Flags); i++) {
-				if ((p = strchr( s, Flags[i] ))) {
-					if (del & (1 << i)) {
-						memmove( p, p + 1, fl - (p - s) );
-						fl--;
-					}
-				} else if (add & (1 << i)) {
-					for (j = 0; j < fl && Flags[i] > s[j]; j++);
-					fl++;
-					memmove( s + j + 1, s + j, fl - j );
-					s[j] = Flags[i];
+	bl = bbl + nfsnprintf( buf + bbl, sizeof(job->buf) - bbl, "%s/", subdirs[gmsg->status & M_RECENT] );
+	ol = strlen( msg->base );
+	if ((int)sizeof(job->buf) - bl < ol + 3 + NUM_FLAGS)
+		oob();
+	memcpy( buf + bl, msg->base, ol + 1 );
+	memcpy( nbuf + bl, msg->base, ol + 1 );
+	if ((s = strstr( nbuf + bl, conf->info_prefix ))) {
+		s += 3;
+		fl = ol - (s - (nbuf + bl));
+		for (i = 0; i < as(Flags); i++) {
+			if ((p = strchr( s, Flags[i] ))) {
+				if (del & (1 << i)) {
+					memmove( p, p + 1, fl - (p - s) );
+					fl--;
 				}
+			} else if (add & (1 << i)) {
+				for (j = 0; j < fl && Flags[i] > s[j]; j++);
+				fl++;
+				memmove( s + j + 1, s + j, fl - j );
+				s[j] = Flags[i];
 			}
-			tl = ol + 3 + fl;
-		} else {
-			tl = ol + maildir_make_flags( conf->info_delimiter, msg->gen.flags, nbuf + bl + ol );
-		}
-		if (!rename( buf, nbuf ))
-			break;
-		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot rename %s to %s", buf, nbuf )) != DRV_OK) {
-			cb( ret, aux );
-			return;
 		}
+		tl = ol + 3 + fl;
+	} else {
+		tl = ol + maildir_make_flags( conf->info_delimiter, msg->gen.flags, nbuf + bl + ol );
 	}
+	job->odfd = maildir_dir_fd( ctx->dfd, ctx->path, gmsg->status & M_RECENT );
+	job->ndfd = maildir_dir_fd( ctx->dfd, ctx->path, 0 );
+	job->obl = job->nbl = bl;
+	job->add = add;
+	job->del = del;
 	free( msg->base );
 	msg->base = nfstrndup( nbuf + bl, tl );
 	msg->gen.flags |= add;
 	msg->gen.flags &= ~del;
 	gmsg->status &= ~M_RECENT;
-
-	cb( DRV_OK, aux );
+	maildir_submit_rename( job );
 }
 
 #ifdef USE_DB
@@ -1742,100 +3734,257 @@ maildir_purge_msg( maildir_store_t *ctx, const char *name )
 }
 #endif /* USE_DB */
 
+static void maildir_trash_msg( store_t *gctx, message_t *gmsg,
+                               void (*cb)( int sts, void *aux ), void *aux );
+
 static void
-maildir_trash_msg( store_t *gctx, message_t *gmsg,
-                   void (*cb)( int sts, void *aux ), void *aux )
+maildir_trash_done( async_job_t *gjob )
 {
-	maildir_store_t *ctx = (maildir_store_t *)gctx;
-	maildir_message_t *msg = (maildir_message_t *)gmsg;
-	char *s;
+	rename_job_t *job = (rename_job_t *)gjob;
+	maildir_store_t *ctx = job->ctx;
+	maildir_message_t *msg = job->msg;
 	int ret;
-	struct stat st;
-	char buf[_POSIX_PATH_MAX], nbuf[_POSIX_PATH_MAX];
 
-	for (;;) {
-		nfsnprintf( buf, sizeof(buf), "%s/%s/%s", ctx->path, subdirs[gmsg->status & M_RECENT], msg->base );
-		s = strstr( msg->base, ((maildir_store_conf_t *)gctx->conf)->info_prefix );
-		nfsnprintf( nbuf, sizeof(nbuf), "%s/%s/%lld.%d_%d.%s%s", ctx->trash,
-		            subdirs[gmsg->status & M_RECENT], (long long)time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
-		if (!rename( buf, nbuf ))
-			break;
-		if (!stat( buf, &st )) {
-			if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK) {
-				cb( ret, aux );
+	maildir_rename_result( job );
+	if (job->gen.canceled)
+		goto out;
+	if (job->err) {
+		if (job->exists) {
+			if (!job->validated) {
+				if ((ret = maildir_validate( ctx->trash, 1, ctx )) != DRV_OK) {
+					job->cb( ret, job->aux );
+					goto out;
+				}
+				// Later commands may be using the descriptors still.
+				wait_async( &ctx->io );
+				maildir_close_dir_fds( ctx->tfd );
+				job->ndfd = maildir_dir_fd( ctx->tfd, ctx->trash, job->sub );
+				job->validated = 1;
+				maildir_submit_rename( job );
 				return;
 			}
-			if (!rename( buf, nbuf ))
-				break;
-			if (errno != ENOENT) {
-				sys_error( "Maildir error: cannot move %s to %s", buf, nbuf );
-				cb( DRV_BOX_BAD, aux );
-				return;
+			if (job->err != ENOENT) {
+				errno = job->err;
+				sys_error( "Maildir error: cannot move %s to %s", job->buf, job->nbuf );
+				job->cb( DRV_BOX_BAD, job->aux );
+				goto out;
 			}
 		}
-		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot move %s to %s", buf, nbuf )) != DRV_OK) {
-			cb( ret, aux );
-			return;
-		}
+		errno = job->err;
+		if ((ret = maildir_again( ctx, msg, "Maildir error: cannot move %s to %s", job->buf, job->nbuf )) != DRV_OK)
+			job->cb( ret, job->aux );
+		else
+			maildir_trash_msg( &ctx->gen, &msg->gen, job->cb, job->aux );
+		goto out;
 	}
-	gmsg->status |= M_DEAD;
+	msg->gen.status |= M_DEAD;
 	ctx->total_msgs--;
 
 #ifdef USE_DB
 	if (ctx->usedb) {
-		cb( maildir_purge_msg( ctx, msg->base ), aux );
-		return;
+		job->cb( maildir_purge_msg( ctx, msg->base ), job->aux );
+		goto out;
 	}
 #endif /* USE_DB */
-	cb( DRV_OK, aux );
+	if (ctx->uidmap) {
+		job->cb( maildir_uidmap_purge( ctx, msg->base ), job->aux );
+		goto out;
+	}
+	job->cb( DRV_OK, job->aux );
+  out:
+	free( job );
 }
 
 static void
-maildir_close_box( store_t *gctx,
+maildir_trash_msg( store_t *gctx, message_t *gmsg,
                    void (*cb)( int sts, void *aux ), void *aux )
 {
 	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	maildir_message_t *msg = (maildir_message_t *)gmsg;
+	rename_job_t *job = maildir_new_rename_job( ctx, msg, maildir_trash_done, cb, aux );
+	char *s;
+	int sub;
+
+	sub = gmsg->status & M_RECENT;
+	job->obl = nfsnprintf( job->buf, sizeof(job->buf), "%s/%s/", ctx->path, subdirs[sub] );
+	nfsnprintf( job->buf + job->obl, sizeof(job->buf) - job->obl, "%s", msg->base );
+	s = strstr( msg->base, ((maildir_store_conf_t *)gctx->conf)->info_prefix );
+	job->nbl = nfsnprintf( job->nbuf, sizeof(job->nbuf), "%s/%s/", ctx->trash, subdirs[sub] );
+	nfsnprintf( job->nbuf + job->nbl, sizeof(job->nbuf) - job->nbl, "%lld.%d_%d.%s%s",
+	            (long long)time( 0 ), Pid, ++MaildirCount, Hostname, s ? s : "" );
+	job->sub = sub;
+	job->odfd = maildir_dir_fd( ctx->dfd, ctx->path, sub );
+	job->ndfd = maildir_dir_fd( ctx->tfd, ctx->trash, sub );
+	maildir_submit_rename( job );
+}
+
+/* The unlinks of close_box(), which are done by io_uring in one batch,
+ * or run on a worker thread. */
+typedef struct {
 	message_t *msg;
-	int basel, retry, ret;
-	char buf[_POSIX_PATH_MAX];
+	char *path; // own
+	int dfd, off, err;
+	async_op_t op;
+} unlink_ent_t;
 
-	for (;;) {
-		retry = 0;
-		basel = nfsnprintf( buf, sizeof(buf), "%s/", ctx->path );
-		for (msg = ctx->msgs; msg; msg = msg->next)
-			if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
-				nfsnprintf( buf + basel, sizeof(buf) - basel, "%s/%s", subdirs[msg->status & M_RECENT], ((maildir_message_t *)msg)->base );
-				if (unlink( buf )) {
-					if (errno == ENOENT)
-						retry = 1;
-					else
-						sys_error( "Maildir error: cannot remove %s", buf );
-				} else {
-					msg->status |= M_DEAD;
-					ctx->total_msgs--;
+typedef struct {
+	async_job_t gen;
+	maildir_store_t *ctx;
+	void (*cb)( int sts, void *aux );
+	void *aux;
+	unlink_ent_t *ents;
+	int nents, uring;
+} expunge_job_t;
+
+static void
+maildir_expunge_work( async_job_t *gjob )
+{
+	expunge_job_t *job = (expunge_job_t *)gjob;
+	unlink_ent_t *ent;
+	int i;
+
+	for (i = 0; i < job->nents; i++) {
+		ent = &job->ents[i];
+		ent->err = maildir_unlink_at( ent->dfd, ent->path, ent->off ) ? errno : 0;
+	}
+}
+
+static void maildir_close_box( store_t *gctx,
+                               void (*cb)( int sts, void *aux ), void *aux );
+
+static void
+maildir_close_box_p2( maildir_store_t *ctx, void (*cb)( int sts, void *aux ), void *aux )
+{
+	int ret;
+
+	if (ctx->uidmap &&
+	    ((ret = maildir_uidval_lock( ctx )) != DRV_OK || (ret = maildir_uidmap_flush( ctx )) != DRV_OK)) {
+		cb( ret, aux );
+		return;
+	}
+	cb( DRV_OK, aux );
+}
+
+static void
+maildir_expunge_done( async_job_t *gjob )
+{
+	expunge_job_t *job = (expunge_job_t *)gjob;
+	maildir_store_t *ctx = job->ctx;
+	message_t *msg;
+	unlink_ent_t *ent;
+	int i, retry = 0, ret;
+
+	if (job->gen.canceled)
+		goto out;
+	for (i = 0; i < job->nents; i++) {
+		ent = &job->ents[i];
+		msg = ent->msg;
+		if (job->uring)
+			ent->err = -ent->op.res;
+		if (ent->err) {
+			if (ent->err == ENOENT) {
+				if ((ret = maildir_relocate( ctx, (maildir_message_t *)msg )) != DRV_OK) {
+					job->cb( ret, job->aux );
+					goto out;
+				}
+				retry = 1;
+			} else {
+				errno = ent->err;
+				sys_error( "Maildir error: cannot remove %s", ent->path );
+			}
+		} else {
+			msg->status |= M_DEAD;
+			ctx->total_msgs--;
+			ctx->pruned_links = 1;
 #ifdef USE_DB
-					if (ctx->db && (ret = maildir_purge_msg( ctx, ((maildir_message_t *)msg)->base )) != DRV_OK) {
-						cb( ret, aux );
-						return;
-					}
+			if (ctx->db && (ret = maildir_purge_msg( ctx, ((maildir_message_t *)msg)->base )) != DRV_OK) {
+				job->cb( ret, job->aux );
+				goto out;
+			}
 #endif /* USE_DB */
-				}
+			if (ctx->uidmap && (ret = maildir_uidmap_add( ctx, ((maildir_message_t *)msg)->base, 0 )) != DRV_OK) {
+				job->cb( ret, job->aux );
+				goto out;
 			}
-		if (!retry) {
-			cb( DRV_OK, aux );
-			return;
 		}
-		if ((ret = maildir_rescan( (maildir_store_t *)gctx )) != DRV_OK) {
-			cb( ret, aux );
-			return;
+	}
+	if (!retry)
+		maildir_close_box_p2( ctx, job->cb, job->aux );
+	else
+		maildir_close_box( &ctx->gen, job->cb, job->aux );
+  out:
+	for (i = 0; i < job->nents; i++)
+		free( job->ents[i].path );
+	free( job->ents );
+	free( job );
+}
+
+static void
+maildir_close_box( store_t *gctx,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+	expunge_job_t *job;
+	unlink_ent_t *ent;
+	message_t *msg;
+	int basel, n;
+	char buf[_POSIX_PATH_MAX];
+
+	for (n = 0, msg = ctx->msgs; msg; msg = msg->next)
+		if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED))
+			n++;
+	if (!n) {
+		maildir_close_box_p2( ctx, cb, aux );
+		return;
+	}
+	job = nfcalloc( sizeof(*job) );
+	job->gen.work = maildir_expunge_work;
+	job->gen.done = maildir_expunge_done;
+	job->ctx = ctx;
+	job->cb = cb;
+	job->aux = aux;
+	job->ents = nfmalloc( n * sizeof(*job->ents) );
+	basel = nfsnprintf( buf, sizeof(buf), "%s/", ctx->path );
+	for (msg = ctx->msgs; msg; msg = msg->next)
+		if (!(msg->status & M_DEAD) && (msg->flags & F_DELETED)) {
+			nfsnprintf( buf + basel, sizeof(buf) - basel, "%s/%s", subdirs[msg->status & M_RECENT], ((maildir_message_t *)msg)->base );
+			ent = &job->ents[job->nents++];
+			ent->msg = msg;
+			ent->path = nfstrdup( buf );
+			ent->dfd = maildir_dir_fd( ctx->dfd, ctx->path, msg->status & M_RECENT );
+			ent->off = basel + 4;
+		}
+#ifdef HAVE_OPENAT
+	if (uring_available()) {
+		job->uring = 1;
+		for (n = 0; n < job->nents; n++) {
+			ent = &job->ents[n];
+			ent->op.type = AOP_UNLINK;
+			ent->op.link = 0;
+			ent->op.dfd = AT_FD(ent->dfd);
+			ent->op.path = AT_NAME(ent->dfd, ent->path, ent->off);
+			queue_uring( &job->gen, &ent->op );
 		}
+		submit_uring( &ctx->io, &job->gen );
+		return;
 	}
+#endif
+	submit_async( &ctx->io, &job->gen );
 }
 
 static void
-maildir_cancel_cmds( store_t *gctx ATTR_UNUSED,
+maildir_cancel_cmds( store_t *gctx,
                      void (*cb)( void *aux ), void *aux )
 {
+	maildir_store_t *ctx = (maildir_store_t *)gctx;
+
+	// A deferred scan is queued rather than in flight, so it is canceled.
+	if (pending_wakeup( &ctx->scantmr )) {
+		conf_wakeup( &ctx->scantmr, -1 );
+		ctx->load_cb( DRV_CANCELED, 0, 0, 0, ctx->load_aux );
+	}
+	// All offloaded commands are in flight, so they just complete.
+	flush_async( &ctx->io );
 	cb( aux );
 }
 
@@ -1846,9 +3995,9 @@ maildir_commit_cmds( store_t *gctx )
 }
 
 static int
-maildir_get_memory_usage( store_t *gctx ATTR_UNUSED )
+maildir_get_memory_usage( store_t *gctx )
 {
-	return 0;
+	return ((maildir_store_t *)gctx)->store_mem;
 }
 
 static int
@@ -1874,10 +4023,12 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep )
 			store->inbox = expand_strdup( cfg->val );
 		else if (!strcasecmp( "Path", cfg->cmd ))
 			store->gen.path = expand_strdup( cfg->val );
-#ifdef USE_DB
 		else if (!strcasecmp( "AltMap", cfg->cmd ))
 			store->alt_map = parse_bool( cfg );
-#endif /* USE_DB */
+#ifdef HAVE_LIBSSL
+		else if (!strcasecmp( "Deduplicate", cfg->cmd ))
+			store->dedup = parse_bool( cfg );
+#endif /* HAVE_LIBSSL */
 		else if (!strcasecmp( "InfoDelimiter", cfg->cmd )) {
 			if (strlen( cfg->val ) != 1) {
 				error( "%s:%d: Info delimiter must be exactly one character long\n", cfg->file, cfg->line );
@@ -1918,7 +4069,7 @@ maildir_parse_store( conffile_t *cfg, store_conf_t **storep )
 static int
 maildir_get_caps( store_t *gctx ATTR_UNUSED )
 {
-	return 0; /* XXX DRV_CRLF? */
+	return DRV_LINK | DRV_FILE; /* XXX DRV_CRLF? */
 }
 
 struct driver maildir_driver = {
@@ -1933,6 +4084,7 @@ struct driver maildir_driver = {
 	maildir_list_store,
 	maildir_select_box,
 	maildir_get_box_path,
+	maildir_get_box_fingerprint,
 	maildir_create_box,
 	maildir_open_box,
 	maildir_get_uidnext,
@@ -1943,6 +4095,7 @@ struct driver maildir_driver = {
 	maildir_load_box,
 	maildir_fetch_msg,
 	maildir_store_msg,
+	maildir_link_msg,
 	maildir_find_new_msgs,
 	maildir_set_msg_flags,
 	maildir_trash_msg,
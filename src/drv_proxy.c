@@ -23,6 +23,27 @@
 
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Per-store call statistics, collected with --profile. Latencies are
+ * kept in a log-linear histogram with four sub-buckets per power of two. */
+#define PROF_BUCKETS 256
+
+typedef struct {
+	uint calls, done, in_flight, max_in_flight;
+	ullong total_us, min_us, max_us, bytes;
+	uint hist[PROF_BUCKETS];
+} prof_cmd_t;
+
+typedef struct prof_store {
+	struct prof_store *next;
+	const char *name;
+	prof_cmd_t cmds[1];
+} prof_store_t;
+
+static prof_store_t *prof_stores;
+
+static prof_store_t *prof_get_store( store_conf_t *conf );
 
 typedef struct {
 	store_t gen;
@@ -30,6 +51,7 @@ typedef struct {
 	int ref_count;
 	driver_t *real_driver;
 	store_t *real_store;
+	prof_store_t *prof;
 
 	void (*bad_callback)( void *aux );
 	void *bad_callback_aux;
@@ -69,6 +91,139 @@ proxy_make_flags( int flags, char *buf )
 	return buf;
 }
 
+static int
+prof_bucket( ullong us )
+{
+	int e;
+
+	if (us < 16)
+		return (int)us;
+	for (e = 4; us >> (e + 1); e++);
+	return 16 + (e - 4) * 4 + (int)((us >> (e - 2)) & 3);
+}
+
+static ullong
+prof_bucket_max( int b )
+{
+	int e;
+
+	if (b < 16)
+		return (ullong)b;
+	e = (b - 16) / 4 + 4;
+	return ((ullong)(4 + (b - 16) % 4 + 1) << (e - 2)) - 1;
+}
+
+static ullong
+proxy_prof_start( proxy_store_t *ctx, int idx, int bytes )
+{
+	prof_cmd_t *pc;
+
+	if (!ctx->prof)
+		return 0;
+	pc = &ctx->prof->cmds[idx];
+	pc->calls++;
+	pc->bytes += bytes;
+	if (++pc->in_flight > pc->max_in_flight)
+		pc->max_in_flight = pc->in_flight;
+	return get_usecs();
+}
+
+static void
+proxy_prof_end( proxy_store_t *ctx, int idx, ullong start, int bytes )
+{
+	prof_cmd_t *pc;
+	ullong us;
+
+	if (!ctx->prof)
+		return;
+	pc = &ctx->prof->cmds[idx];
+	us = get_usecs() - start;
+	pc->in_flight--;
+	pc->bytes += bytes;
+	pc->total_us += us;
+	if (!pc->done++ || us < pc->min_us)
+		pc->min_us = us;
+	if (us > pc->max_us)
+		pc->max_us = us;
+	pc->hist[prof_bucket( us )]++;
+}
+
+FILE *RecordFile;
+int RecordBodies;
+
+static void
+proxy_record_str( const char *str, int quote )
+{
+	if (!str) {
+		putc( '-', RecordFile );
+		return;
+	}
+	if (quote)
+		putc( '\'', RecordFile );
+	for (; *str; str++) {
+		uchar c = (uchar)*str;
+		if (c <= ' ' || c == '%' || c >= 127)
+			fprintf( RecordFile, "%%%02X", c );
+		else
+			putc( c, RecordFile );
+	}
+}
+
+/* Append a line to the --record trace: the store name, the method name
+ * ("+" for continuation lines) and the values. The letters in types
+ * describe the varargs: d - int, u - uint, x - xint, l - long long,
+ * s - const char * (may be null). Strings are %XX-escaped, so lines split on spaces. */
+static void
+proxy_record( proxy_store_t *ctx, const char *name, const char *types, ... )
+{
+	va_list va;
+
+	if (!RecordFile)
+		return;
+	proxy_record_str( ctx->gen.conf->name, 0 );
+	fprintf( RecordFile, " %s", name );
+	va_start( va, types );
+	for (; *types; types++) {
+		putc( ' ', RecordFile );
+		switch (*types) {
+		case 'd': fprintf( RecordFile, "%d", va_arg( va, int ) ); break;
+		case 'u': fprintf( RecordFile, "%u", va_arg( va, uint ) ); break;
+		case 'x': fprintf( RecordFile, "%#x", va_arg( va, uint ) ); break;
+		case 'l': fprintf( RecordFile, "%lld", va_arg( va, long long ) ); break;
+		default: proxy_record_str( va_arg( va, const char * ), 1 ); break;
+		}
+	}
+	va_end( va );
+	putc( '\n', RecordFile );
+}
+
+static void
+proxy_record_msgs( proxy_store_t *ctx, message_t *msgs )
+{
+	char tuid[TUIDL + 1];
+
+	for (message_t *msg = msgs; msg; msg = msg->next) {
+		memcpy( tuid, msg->tuid, TUIDL );
+		tuid[TUIDL] = 0;
+		proxy_record( ctx, "+", "uuudsss", msg->uid, msg->flags, msg->status, msg->size,
+		              *tuid ? tuid : NULL, msg->msgid, msg->objid );
+	}
+}
+
+static void
+proxy_record_body( proxy_store_t *ctx, const char *data, int len )
+{
+	char buf[1001];
+
+	for (int off = 0; off < len; off += sizeof(buf) - 1) {
+		int l = len - off < (int)sizeof(buf) - 1 ? len - off : (int)sizeof(buf) - 1;
+		memcpy( buf, data + off, l );
+		buf[l] = 0;
+		// Embedded NULs cannot be represented; they are invalid in mail anyway.
+		proxy_record( ctx, "+", "s", buf );
+	}
+}
+
 static void
 proxy_store_deref( proxy_store_t *ctx )
 {
@@ -82,6 +237,7 @@ typedef struct {
 	int ref_count;
 	int tag;
 	proxy_store_t *ctx;
+	ullong start;
 } gen_cmd_t;
 
 static gen_cmd_t *
@@ -110,7 +266,10 @@ static @type@proxy_@name@( store_t *gctx )
 {
 	proxy_store_t *ctx = (proxy_store_t *)gctx;
 
+	ullong start = proxy_prof_start( ctx, @index@, 0 );
 	@type@rv = ctx->real_driver->@name@( ctx->real_store );
+	proxy_prof_end( ctx, @index@, start, 0 );
+	@record_ret@
 	debug( "%sCalled @name@, ret=@fmt@\n", ctx->label, rv );
 	return rv;
 }
@@ -124,7 +283,10 @@ static @type@proxy_@name@( store_t *gctx@decl_args@ )
 	@pre_print_args@
 	debug( "%sEnter @name@@print_fmt_args@\n", ctx->label@print_pass_args@ );
 	@print_args@
+	ullong start = proxy_prof_start( ctx, @index@, 0 @prof_bytes@ );
 	@type@rv = ctx->real_driver->@name@( ctx->real_store@pass_args@ );
+	proxy_prof_end( ctx, @index@, start, 0 );
+	@record_ret@
 	debug( "%sLeave @name@, ret=@fmt@\n", ctx->label, rv );
 	return rv;
 }
@@ -138,7 +300,9 @@ static void proxy_@name@( store_t *gctx@decl_args@ )
 	@pre_print_args@
 	debug( "%sEnter @name@@print_fmt_args@\n", ctx->label@print_pass_args@ );
 	@print_args@
+	ullong start = proxy_prof_start( ctx, @index@, 0 @prof_bytes@ );
 	ctx->real_driver->@name@( ctx->real_store@pass_args@ );
+	proxy_prof_end( ctx, @index@, start, 0 );
 	debug( "%sLeave @name@\n", ctx->label );
 	@action@
 }
@@ -157,6 +321,8 @@ proxy_@name@_cb( @decl_cb_args@void *aux )
 {
 	@name@_cmd_t *cmd = (@name@_cmd_t *)aux;
 
+	proxy_prof_end( cmd->gen.ctx, @index@, cmd->gen.start, 0 @prof_cb_bytes@ );
+	@record_cb@
 	@pre_print_cb_args@
 	debug( "%s[% 2d] Callback enter @name@@print_fmt_cb_args@\n", cmd->gen.ctx->label, cmd->gen.tag@print_pass_cb_args@ );
 	@print_cb_args@
@@ -177,6 +343,7 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 	@pre_print_args@
 	debug( "%s[% 2d] Enter @name@@print_fmt_args@\n", ctx->label, cmd->gen.tag@print_pass_args@ );
 	@print_args@
+	cmd->gen.start = proxy_prof_start( ctx, @index@, 0 @prof_bytes@ );
 	ctx->real_driver->@name@( ctx->real_store@pass_args@, proxy_@name@_cb, cmd );
 	debug( "%s[% 2d] Leave @name@\n", ctx->label, cmd->gen.tag );
 	proxy_cmd_done( &cmd->gen );
@@ -185,6 +352,13 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 
 //# UNDEFINE list_store_print_fmt_cb_args
 //# UNDEFINE list_store_print_pass_cb_args
+//# DEFINE list_store_record_cb
+	proxy_record( cmd->gen.ctx, "list_store", "d", sts );
+	if (sts == DRV_OK) {
+		for (string_list_t *box = boxes; box; box = box->next)
+			proxy_record( cmd->gen.ctx, "+", "s", box->string );
+	}
+//# END
 //# DEFINE list_store_print_cb_args
 	if (sts == DRV_OK) {
 		for (string_list_t *box = boxes; box; box = box->next)
@@ -205,6 +379,11 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 		debug( "\n" );
 	}
 //# END
+//# DEFINE load_box_record_cb
+	proxy_record( cmd->gen.ctx, "load_box", "ddd", sts, total_msgs, recent_msgs );
+	if (sts == DRV_OK)
+		proxy_record_msgs( cmd->gen.ctx, msgs );
+//# END
 //# DEFINE load_box_pre_print_cb_args
 	static char fbuf[as(Flags) + 1];
 //# END
@@ -218,6 +397,11 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 	}
 //# END
 
+//# DEFINE find_new_msgs_record_cb
+	proxy_record( cmd->gen.ctx, "find_new_msgs", "d", sts );
+	if (sts == DRV_OK)
+		proxy_record_msgs( cmd->gen.ctx, msgs );
+//# END
 //# DEFINE find_new_msgs_print_fmt_cb_args , sts=%d
 //# DEFINE find_new_msgs_print_pass_cb_args , sts
 //# DEFINE find_new_msgs_print_cb_args
@@ -229,9 +413,21 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 
 //# DEFINE fetch_msg_decl_state
 	msg_data_t *data;
+	uint uid;
 //# END
 //# DEFINE fetch_msg_assign_state
 	cmd->data = data;
+	cmd->uid = msg->uid;
+//# END
+//# DEFINE fetch_msg_record_cb
+	if (sts != DRV_OK) {
+		proxy_record( cmd->gen.ctx, "fetch_msg", "ud", cmd->uid, sts );
+	} else {
+		proxy_record( cmd->gen.ctx, "fetch_msg", "uddld", cmd->uid, sts, cmd->data->flags,
+		              (long long)cmd->data->date, cmd->data->len );
+		if (RecordBodies && !cmd->data->file)
+			proxy_record_body( cmd->gen.ctx, cmd->data->data, cmd->data->len );
+	}
 //# END
 //# DEFINE fetch_msg_print_fmt_args , uid=%u, want_flags=%s, want_date=%s
 //# DEFINE fetch_msg_print_pass_args , msg->uid, !(msg->status & M_FLAGS) ? "yes" : "no", data->date ? "yes" : "no"
@@ -241,8 +437,11 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 //# END
 //# DEFINE fetch_msg_print_fmt_cb_args , flags=%s, date=%lld, size=%d
 //# DEFINE fetch_msg_print_pass_cb_args , fbuf, (long long)cmd->data->date, cmd->data->len
+//# DEFINE fetch_msg_prof_cb_bytes + (sts == DRV_OK ? cmd->data->len : 0)
 //# DEFINE fetch_msg_print_cb_args
-	if (sts == DRV_OK && (DFlags & DEBUG_DRV_ALL)) {
+	if (sts == DRV_OK && cmd->data->file) {
+		debug( "  file=%s\n", cmd->data->file );
+	} else if (sts == DRV_OK && (DFlags & DEBUG_DRV_ALL)) {
 		printf( "%s=========\n", cmd->gen.ctx->label );
 		fwrite( cmd->data->data, cmd->data->len, 1, stdout );
 		printf( "%s=========\n", cmd->gen.ctx->label );
@@ -250,6 +449,7 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 	}
 //# END
 
+//# DEFINE store_msg_prof_bytes + data->len
 //# DEFINE store_msg_pre_print_args
 	static char fbuf[as(Flags) + 1];
 	proxy_make_flags( data->flags, fbuf );
@@ -257,7 +457,9 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 //# DEFINE store_msg_print_fmt_args , flags=%s, date=%lld, size=%d, to_trash=%s
 //# DEFINE store_msg_print_pass_args , fbuf, (long long)data->date, data->len, to_trash ? "yes" : "no"
 //# DEFINE store_msg_print_args
-	if (DFlags & DEBUG_DRV_ALL) {
+	if (data->file) {
+		debug( "  file=%s\n", data->file );
+	} else if (DFlags & DEBUG_DRV_ALL) {
 		printf( "%s>>>>>>>>>\n", ctx->label );
 		fwrite( data->data, data->len, 1, stdout );
 		printf( "%s>>>>>>>>>\n", ctx->label );
@@ -270,12 +472,32 @@ proxy_@name@( store_t *gctx@decl_args@, void (*cb)( @decl_cb_args@void *aux ), v
 	proxy_make_flags( add, fbuf1 );
 	proxy_make_flags( del, fbuf2 );
 //# END
+//# DEFINE set_msg_flags_decl_state
+	uint uid;
+//# END
+//# DEFINE set_msg_flags_assign_state
+	cmd->uid = msg ? msg->uid : uid;
+//# END
+//# DEFINE set_msg_flags_record_cb
+	proxy_record( cmd->gen.ctx, "set_msg_flags", "ud", cmd->uid, sts );
+//# END
 //# DEFINE set_msg_flags_print_fmt_args , uid=%u, add=%s, del=%s
 //# DEFINE set_msg_flags_print_pass_args , uid, fbuf1, fbuf2
 
+//# DEFINE trash_msg_decl_state
+	uint uid;
+//# END
+//# DEFINE trash_msg_assign_state
+	cmd->uid = msg->uid;
+//# END
+//# DEFINE trash_msg_record_cb
+	proxy_record( cmd->gen.ctx, "trash_msg", "ud", cmd->uid, sts );
+//# END
 //# DEFINE trash_msg_print_fmt_args , uid=%u
 //# DEFINE trash_msg_print_pass_args , msg->uid
 
+//# UNDEFINE get_memory_usage_record_ret
+
 //# DEFINE free_store_action
 	proxy_store_deref( ctx );
 //# END
@@ -307,6 +529,7 @@ static void
 proxy_invoke_bad_callback( proxy_store_t *ctx )
 {
 	debug( "%sCallback enter bad store\n", ctx->label );
+	proxy_record( ctx, "bad", "" );
 	ctx->bad_callback( ctx->bad_callback_aux );
 	debug( "%sCallback leave bad store\n", ctx->label ); \
 }
@@ -324,6 +547,8 @@ proxy_alloc_store( store_t *real_ctx, const char *label )
 	ctx->label = label;
 	ctx->real_driver = real_ctx->driver;
 	ctx->real_store = real_ctx;
+	if (DFlags & PROFILE)
+		ctx->prof = prof_get_store( real_ctx->conf );
 	ctx->real_driver->set_bad_callback( ctx->real_store, (void (*)(void *))proxy_invoke_bad_callback, ctx );
 	return &ctx->gen;
 }
@@ -333,3 +558,56 @@ proxy_alloc_store( store_t *real_ctx, const char *label )
 //# EXCLUDE get_fail_state
 
 #include "drv_proxy.inc"
+
+static prof_store_t *
+prof_get_store( store_conf_t *conf )
+{
+	prof_store_t *ps;
+
+	for (ps = prof_stores; ps; ps = ps->next)
+		if (!strcmp( ps->name, conf->name ))
+			return ps;
+	ps = nfcalloc( sizeof(*ps) + (as(proxy_cmd_names) - 1) * sizeof(ps->cmds[0]) );
+	ps->name = conf->name;
+	ps->next = prof_stores;
+	prof_stores = ps;
+	return ps;
+}
+
+static ullong
+prof_percentile( prof_cmd_t *pc, uint pct )
+{
+	uint b, n = 0, want = (pc->done * pct + 99) / 100;
+	ullong us;
+
+	for (b = 0; b < PROF_BUCKETS - 1; b++)
+		if ((n += pc->hist[b]) >= want)
+			break;
+	us = prof_bucket_max( b );
+	return us < pc->max_us ? us : pc->max_us;
+}
+
+void
+proxy_dump_profile( void )
+{
+	prof_store_t *ps;
+	prof_cmd_t *pc;
+	uint i;
+
+	for (ps = prof_stores; ps; ps = ps->next) {
+		printf( "Driver calls on store %s (latencies in ms):\n", ps->name );
+		printf( "  %-22s %7s %9s %9s %9s %9s %9s %5s %11s\n",
+		        "call", "count", "min", "avg", "p50", "p99", "max", "par", "bytes" );
+		for (i = 0; i < as(proxy_cmd_names); i++) {
+			pc = &ps->cmds[i];
+			if (!pc->done)
+				continue;
+			printf( "  %-22s %7u %9.3f %9.3f %9.3f %9.3f %9.3f %5u %11llu\n",
+			        proxy_cmd_names[i], pc->calls, pc->min_us / 1000.,
+			        pc->total_us / 1000. / pc->done,
+			        prof_percentile( pc, 50 ) / 1000., prof_percentile( pc, 99 ) / 1000.,
+			        pc->max_us / 1000., pc->max_in_flight, pc->bytes );
+		}
+	}
+	fflush( stdout );
+}
@@ -23,7 +23,10 @@
 use strict;
 use warnings;
 
-die("Usage: $0 driver.h drv_proxy.c drv_proxy.inc\n")
+# With -r, only the table of recorded methods for drv_replay.c is written.
+my $replay = (@ARGV && $ARGV[0] eq "-r") ? shift : undef;
+
+die("Usage: $0 [-r] driver.h drv_proxy.c {drv_proxy.inc|drv_replay.inc}\n")
 	if ($#ARGV != 2);
 
 my ($in_header, $in_source, $out_source) = @ARGV;
@@ -97,6 +100,8 @@ my @ptypes = map { s,^ ,,r } split(/;/, $cont);
 pop @ptypes;  # last one is empty
 
 my @cmd_table;
+my @cmd_names;
+my @rec_names;
 
 sub make_args($)
 {
@@ -115,6 +120,30 @@ sub type_to_format($)
 	return $_;
 }
 
+# Letters for proxy_record(); undef for types which need custom code.
+sub type_to_letter($)
+{
+	$_ = shift;
+	return "x" if (/^xint ?$/);
+	return "u" if (/^uint ?$/);
+	return "d" if (/^int ?$/);
+	return "s" if (/^const char \*$/);
+	return undef;
+}
+
+sub make_record_letters($)
+{
+	my $letters = "";
+	for (split(/, /, shift)) {
+		next if (!length($_));
+		/^(.*?)(\w+)$/ or return undef;
+		my $l = type_to_letter($1);
+		return undef if (!defined($l));
+		$letters .= $l;
+	}
+	return $letters;
+}
+
 sub make_format($)
 {
 	$_ = type_to_format(shift);
@@ -127,6 +156,7 @@ open(my $outh, ">".$out_source) or die("Cannot create $out_source: $!\n");
 for (@ptypes) {
 	/^([\w* ]+)\(\*(\w+)\)\( (.*) \)$/ or die("Cannot parse prototype '$_'\n");
 	my ($cmd_type, $cmd_name, $cmd_args) = ($1, $2, $3);
+	push @cmd_names, $cmd_name;
 	if (defined($excluded{$cmd_name})) {
 		push @cmd_table, "0";
 		next;
@@ -135,6 +165,7 @@ for (@ptypes) {
 	next if (defined($special{$cmd_name}));
 	my %replace;
 	$replace{'name'} = $cmd_name;
+	$replace{'index'} = $#cmd_names;
 	$replace{'type'} = $cmd_type;
 	$cmd_args =~ s/^store_t \*ctx// or die("Arguments '$cmd_args' don't start with 'store_t *ctx'\n");
 	if ($cmd_type eq "void " && $cmd_args =~ s/, void \(\*cb\)\( (.*)void \*aux \), void \*aux$//) {
@@ -144,15 +175,27 @@ for (@ptypes) {
 		my $cmd_print_cb_args = $cmd_cb_args =~ s/(.*), $/, $1/r;
 		$replace{'print_pass_cb_args'} = make_args($cmd_print_cb_args);
 		$replace{'print_fmt_cb_args'} = make_format($cmd_print_cb_args);
+		if (defined($defines{"${cmd_name}_record_cb"})) {
+			push @rec_names, $cmd_name if (length($defines{"${cmd_name}_record_cb"}));
+		} else {
+			my $letters = make_record_letters($cmd_cb_args);
+			die("Cannot record callback arguments '$cmd_cb_args' of $cmd_name\n")
+				if (!defined($letters));
+			$replace{'record_cb'} = "\tproxy_record( cmd->gen.ctx, \"$cmd_name\", \"$letters\"".$replace{'print_pass_cb_args'}." );\n";
+			push @rec_names, $cmd_name;
+		}
 		$template = "CALLBACK";
-	} elsif ($cmd_name =~ /^get_/) {
-		$template = "GETTER";
-		$replace{'fmt'} = type_to_format($cmd_type);
 	} elsif ($cmd_type eq "void ") {
 		$template = "REGULAR_VOID";
 	} else {
-		$template = "REGULAR";
+		$template = ($cmd_name =~ /^get_/) ? "GETTER" : "REGULAR";
 		$replace{'fmt'} = type_to_format($cmd_type);
+		my $letter = type_to_letter($cmd_type);
+		die("Cannot record return type '$cmd_type' of $cmd_name\n")
+			if (!defined($letter));
+		$replace{'record_ret'} = "\tproxy_record( ctx, \"$cmd_name\", \"$letter\", rv );\n";
+		push @rec_names, $cmd_name
+			if (!defined($defines{"${cmd_name}_record_ret"}) || length($defines{"${cmd_name}_record_ret"}));
 	}
 	$replace{'decl_args'} = $cmd_args;
 	$replace{'print_pass_args'} = $replace{'pass_args'} = make_args($cmd_args);
@@ -160,11 +203,18 @@ for (@ptypes) {
 	for (keys %defines) {
 		$replace{$1} = $defines{$_} if (/^${cmd_name}_(.*)$/);
 	}
+	next if ($replay);
 	my $text = $templates{$template};
 	$text =~ s/^\h*\@(\w+)\@\n/$replace{$1} \/\/ ""/smeg;
 	$text =~ s/\@(\w+)\@/$replace{$1} \/\/ ""/eg;
 	print $outh $text."\n";
 }
 
-print $outh "struct driver proxy_driver = {\n".join("", map { "\t$_,\n" } @cmd_table)."};\n";
+if ($replay) {
+	print $outh "enum {\n".join("", map { "\tR_".uc($_).",\n" } @rec_names)."\tR_NUM_METHODS\n};\n";
+	print $outh "\nstatic const char *const method_names[] = {\n".join("", map { "\t\"$_\",\n" } @rec_names)."};\n";
+} else {
+	print $outh "struct driver proxy_driver = {\n".join("", map { "\t$_,\n" } @cmd_table)."};\n";
+	print $outh "\nstatic const char *const proxy_cmd_names[] = {\n".join("", map { "\t\"$_\",\n" } @cmd_names)."};\n";
+}
 close $outh;
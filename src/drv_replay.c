@@ -0,0 +1,772 @@
+/*
+ * mbsync - mailbox synchronizer
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, mbsync may be linked with the OpenSSL library,
+ * despite that library's more restrictive license.
+ */
+
+/* Plays back driver traces written with --record. Each store found in the
+ * trace is served from its recorded results instead of the real backend.
+ * Results are matched per method in call order; messages are additionally
+ * matched by UID, so fetches, flag updates and trashing may be reordered.
+ * All callbacks are invoked synchronously. */
+
+#include "driver.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The R_* indices and method_names[] of the recorded methods. */
+#include "drv_replay.inc"
+
+#define IS_GETTER(m) ((m) == R_GET_CAPS || (m) == R_GET_BOX_PATH || (m) == R_GET_BOX_FINGERPRINT || (m) == R_GET_UIDNEXT)
+#define IS_KEYED(m) ((m) == R_FETCH_MSG || (m) == R_SET_MSG_FLAGS || (m) == R_TRASH_MSG)
+
+typedef struct replay_rec {
+	struct replay_rec *next;
+	struct replay_rec *conts; /* continuation lines */
+	uint key;
+	int bad; /* the store went bad before this result was delivered */
+	int nargs;
+	char *args[1]; /* null for recorded null strings */
+} replay_rec_t;
+
+typedef struct replay_trace {
+	struct replay_trace *next;
+	char *name;
+	replay_rec_t *recs[R_NUM_METHODS], **recsapp[R_NUM_METHODS];
+	replay_rec_t *last, **contsapp;
+	int bad;
+} replay_trace_t;
+
+static replay_trace_t *traces;
+
+typedef struct {
+	store_t gen;
+	replay_trace_t *trace;
+	message_t *msgs;
+	string_list_t *boxes;
+
+	void (*bad_callback)( void *aux );
+	void *bad_callback_aux;
+} replay_store_t;
+
+static int
+hexval( char c )
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static char *
+unescape( char *s )
+{
+	char *d = s, *r = s;
+	int h, l;
+
+	while (*s) {
+		if (*s == '%' && (h = hexval( s[1] )) >= 0 && (l = hexval( s[2] )) >= 0) {
+			*d++ = (char)(h * 16 + l);
+			s += 3;
+		} else {
+			*d++ = *s++;
+		}
+	}
+	*d = 0;
+	return r;
+}
+
+static char *
+next_token( char **sp )
+{
+	char *s = *sp, *e;
+
+	if ((e = strchr( s, ' ' ))) {
+		*e = 0;
+		*sp = e + 1;
+	} else {
+		*sp = 0;
+	}
+	return s;
+}
+
+static replay_trace_t *
+find_trace( const char *name )
+{
+	replay_trace_t *trace;
+
+	for (trace = traces; trace; trace = trace->next)
+		if (!strcmp( trace->name, name ))
+			return trace;
+	return 0;
+}
+
+static int
+parse_line( char *line, const char *path, int lineno )
+{
+	replay_trace_t *trace;
+	replay_rec_t *rec;
+	char *p, *store, *method;
+	int m, n, na;
+
+	if ((p = strchr( line, '\n' )))
+		*p = 0;
+	if (!*line || *line == '#')
+		return 0;
+	for (na = 1, p = line; *p; p++)
+		if (*p == ' ')
+			na++;
+	if (na < 2) {
+		error( "%s:%d: malformed trace line\n", path, lineno );
+		return -1;
+	}
+	rec = nfcalloc( sizeof(*rec) + (na - 2) * sizeof(rec->args[0]) + strlen( line ) + 1 );
+	line = strcpy( (char *)&rec->args[na - 2], line );
+	store = unescape( next_token( &line ) );
+	method = next_token( &line );
+	for (n = 0; line; n++) {
+		p = next_token( &line );
+		if (!strcmp( p, "-" ))
+			p = 0;
+		else if (*p == '\'')
+			p = unescape( p + 1 );
+		rec->args[n] = p;
+	}
+	rec->nargs = n;
+
+	if (!(trace = find_trace( store ))) {
+		trace = nfcalloc( sizeof(*trace) );
+		trace->name = nfstrdup( store );
+		for (m = 0; m < R_NUM_METHODS; m++)
+			trace->recsapp[m] = &trace->recs[m];
+		trace->next = traces;
+		traces = trace;
+	}
+	if (!strcmp( method, "+" )) {
+		if (!trace->last) {
+			error( "%s:%d: continuation line without preceding result\n", path, lineno );
+			free( rec );
+			return -1;
+		}
+		*trace->contsapp = rec;
+		trace->contsapp = &rec->next;
+		return 0;
+	}
+	if (!strcmp( method, "bad" )) {
+		trace->bad = 1;
+		free( rec );
+		return 0;
+	}
+	for (m = 0; m < R_NUM_METHODS; m++)
+		if (!strcmp( method, method_names[m] ))
+			break;
+	if (m == R_NUM_METHODS) {
+		error( "%s:%d: unknown driver method '%s'\n", path, lineno, method );
+		free( rec );
+		return -1;
+	}
+	if (IS_KEYED(m)) {
+		if (!rec->nargs || !rec->args[0]) {
+			error( "%s:%d: missing UID\n", path, lineno );
+			free( rec );
+			return -1;
+		}
+		rec->key = (uint)strtoul( rec->args[0], 0, 10 );
+	}
+	rec->bad = trace->bad;
+	trace->bad = 0;
+	*trace->recsapp[m] = rec;
+	trace->recsapp[m] = &rec->next;
+	trace->last = rec;
+	trace->contsapp = &rec->conts;
+	return 0;
+}
+
+int
+replay_load( const char *path )
+{
+	FILE *f;
+	char *line = 0;
+	size_t size = 0;
+	int lineno = 0, ret = 0;
+
+	if (!(f = fopen( path, "r" ))) {
+		sys_error( "Error: cannot open trace file %s", path );
+		return -1;
+	}
+	while (getline( &line, &size, f ) > 0) {
+		if (parse_line( line, path, ++lineno ) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	free( line );
+	fclose( f );
+	return ret;
+}
+
+int
+replay_has_store( const char *name )
+{
+	return find_trace( name ) != 0;
+}
+
+static void
+free_recs( replay_rec_t *rec )
+{
+	replay_rec_t *nrec;
+
+	for (; rec; rec = nrec) {
+		nrec = rec->next;
+		free_recs( rec->conts );
+		free( rec );
+	}
+}
+
+static int
+rec_int( replay_rec_t *rec, int i )
+{
+	return (i < rec->nargs && rec->args[i]) ? (int)strtoul( rec->args[i], 0, 0 ) : 0;
+}
+
+static long long
+rec_llong( replay_rec_t *rec, int i )
+{
+	return (i < rec->nargs && rec->args[i]) ? strtoll( rec->args[i], 0, 10 ) : 0;
+}
+
+static const char *
+rec_str( replay_rec_t *rec, int i )
+{
+	return (i < rec->nargs) ? rec->args[i] : 0;
+}
+
+static void
+replay_invoke_bad_callback( replay_store_t *ctx )
+{
+	ctx->bad_callback( ctx->bad_callback_aux );
+}
+
+/* Dequeue the next recorded result of the given method. The last result
+ * of a getter stays in place, so repeated queries keep returning it.
+ * Getter results are never freed, as the returned strings are borrowed. */
+static replay_rec_t *
+replay_next( replay_store_t *ctx, int m, uint key )
+{
+	replay_trace_t *trace = ctx->trace;
+	replay_rec_t *rec, **recp;
+
+	for (recp = &trace->recs[m]; (rec = *recp); recp = &rec->next) {
+		if (IS_KEYED(m) && rec->key != key)
+			continue;
+		if (IS_GETTER(m) && !rec->next)
+			return rec;
+		if (!(*recp = rec->next))
+			trace->recsapp[m] = recp;
+		return rec;
+	}
+	if (IS_KEYED(m))
+		error( "Replay error: store %s: no recorded %s result for UID %u\n",
+		       ctx->gen.conf->name, method_names[m], key );
+	else
+		error( "Replay error: store %s: no recorded %s result left\n",
+		       ctx->gen.conf->name, method_names[m] );
+	return 0;
+}
+
+/* For asynchronous methods. Returns null if the caller should report
+ * DRV_CANCELED, as the store has been declared bad. */
+static replay_rec_t *
+replay_next_cb( replay_store_t *ctx, int m, uint key )
+{
+	replay_rec_t *rec;
+
+	if (!(rec = replay_next( ctx, m, key ))) {
+		replay_invoke_bad_callback( ctx );
+		return 0;
+	}
+	if (rec->bad) {
+		replay_invoke_bad_callback( ctx );
+		rec->bad = 0;
+	}
+	return rec;
+}
+
+static message_t *
+replay_make_msgs( replay_rec_t *conts )
+{
+	message_t *msgs, *msg, **msgsapp = &msgs;
+	const char *s;
+
+	for (; conts; conts = conts->next) {
+		msg = nfcalloc( sizeof(*msg) );
+		msg->uid = (uint)rec_int( conts, 0 );
+		msg->flags = (uchar)rec_int( conts, 1 );
+		msg->status = (uchar)rec_int( conts, 2 );
+		msg->size = rec_int( conts, 3 );
+		if ((s = rec_str( conts, 4 )))
+			memcpy( msg->tuid, s, strlen( s ) < TUIDL ? strlen( s ) : TUIDL );
+		if ((s = rec_str( conts, 5 )))
+			msg->msgid = nfstrdup( s );
+		if ((s = rec_str( conts, 6 )))
+			msg->objid = nfstrdup( s );
+		*msgsapp = msg;
+		msgsapp = &msg->next;
+	}
+	*msgsapp = 0;
+	return msgs;
+}
+
+static store_t *
+replay_alloc_store( store_conf_t *conf, const char *label ATTR_UNUSED )
+{
+	replay_store_t *ctx;
+
+	ctx = nfcalloc( sizeof(*ctx) );
+	ctx->gen.driver = &replay_driver;
+	ctx->gen.conf = conf;
+	ctx->trace = find_trace( conf->name );
+	return &ctx->gen;
+}
+
+static void
+replay_set_bad_callback( store_t *gctx, void (*cb)( void *aux ), void *aux )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+
+	ctx->bad_callback = cb;
+	ctx->bad_callback_aux = aux;
+}
+
+static int
+replay_get_caps( store_t *gctx )
+{
+	replay_rec_t *rec;
+
+	if (!gctx || !(rec = replay_next( (replay_store_t *)gctx, R_GET_CAPS, 0 )))
+		return 0;
+	return rec_int( rec, 0 );
+}
+
+static void
+replay_simple( store_t *gctx, int m, void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts;
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, m, 0 ))) {
+		cb( DRV_CANCELED, aux );
+		return;
+	}
+	sts = rec_int( rec, 0 );
+	free_recs( rec->conts );
+	free( rec );
+	cb( sts, aux );
+}
+
+static void
+replay_connect_store( store_t *gctx,
+                      void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_simple( gctx, R_CONNECT_STORE, cb, aux );
+}
+
+static void
+replay_free_store( store_t *gctx )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+
+	free_generic_messages( ctx->msgs );
+	free_string_list( ctx->boxes );
+	free( ctx );
+}
+
+static void
+replay_list_store( store_t *gctx, int flags ATTR_UNUSED,
+                   void (*cb)( int sts, string_list_t *boxes, void *aux ), void *aux )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+	replay_rec_t *rec, *cont;
+	int sts;
+
+	if (!(rec = replay_next_cb( ctx, R_LIST_STORE, 0 ))) {
+		cb( DRV_CANCELED, 0, aux );
+		return;
+	}
+	free_string_list( ctx->boxes );
+	ctx->boxes = 0;
+	for (cont = rec->conts; cont; cont = cont->next)
+		if (rec_str( cont, 0 ))
+			add_string_list( &ctx->boxes, rec_str( cont, 0 ) );
+	sts = rec_int( rec, 0 );
+	free_recs( rec->conts );
+	free( rec );
+	cb( sts, ctx->boxes, aux );
+}
+
+static int
+replay_get_int( store_t *gctx, int m )
+{
+	replay_rec_t *rec;
+	int ret;
+
+	if (!(rec = replay_next( (replay_store_t *)gctx, m, 0 )))
+		return DRV_BOX_BAD;
+	ret = rec_int( rec, 0 );
+	if (!IS_GETTER(m))
+		free( rec );
+	return ret;
+}
+
+static int
+replay_select_box( store_t *gctx, const char *name ATTR_UNUSED )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+
+	free_generic_messages( ctx->msgs );
+	ctx->msgs = 0;
+	return replay_get_int( gctx, R_SELECT_BOX );
+}
+
+static const char *
+replay_get_box_path( store_t *gctx )
+{
+	replay_rec_t *rec = replay_next( (replay_store_t *)gctx, R_GET_BOX_PATH, 0 );
+
+	return rec ? rec_str( rec, 0 ) : 0;
+}
+
+static const char *
+replay_get_box_fingerprint( store_t *gctx )
+{
+	replay_rec_t *rec = replay_next( (replay_store_t *)gctx, R_GET_BOX_FINGERPRINT, 0 );
+
+	return rec ? rec_str( rec, 0 ) : 0;
+}
+
+static void
+replay_create_box( store_t *gctx,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_simple( gctx, R_CREATE_BOX, cb, aux );
+}
+
+static void
+replay_open_box( store_t *gctx,
+                 void (*cb)( int sts, int uidvalidity, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts, uidvalidity;
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_OPEN_BOX, 0 ))) {
+		cb( DRV_CANCELED, 0, aux );
+		return;
+	}
+	sts = rec_int( rec, 0 );
+	uidvalidity = rec_int( rec, 1 );
+	free( rec );
+	cb( sts, uidvalidity, aux );
+}
+
+static int
+replay_get_uidnext( store_t *gctx )
+{
+	return replay_get_int( gctx, R_GET_UIDNEXT );
+}
+
+static int
+replay_confirm_box_empty( store_t *gctx )
+{
+	return replay_get_int( gctx, R_CONFIRM_BOX_EMPTY );
+}
+
+static void
+replay_delete_box( store_t *gctx,
+                   void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_simple( gctx, R_DELETE_BOX, cb, aux );
+}
+
+static int
+replay_finish_delete_box( store_t *gctx )
+{
+	return replay_get_int( gctx, R_FINISH_DELETE_BOX );
+}
+
+static int
+replay_prepare_load_box( store_t *gctx, int opts )
+{
+	replay_rec_t *rec;
+
+	if (!(rec = replay_next( (replay_store_t *)gctx, R_PREPARE_LOAD_BOX, 0 )))
+		return opts;
+	opts = rec_int( rec, 0 );
+	free( rec );
+	return opts;
+}
+
+static void
+replay_load_box( store_t *gctx, uint minuid ATTR_UNUSED, uint maxuid ATTR_UNUSED,
+                 uint newuid ATTR_UNUSED, uint seenuid ATTR_UNUSED, uint_array_t excs,
+                 void (*cb)( int sts, message_t *msgs, int total_msgs, int recent_msgs, void *aux ), void *aux )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+	replay_rec_t *rec;
+	int sts, total, recent;
+
+	free( excs.data );
+	if (!(rec = replay_next_cb( ctx, R_LOAD_BOX, 0 ))) {
+		cb( DRV_CANCELED, 0, 0, 0, aux );
+		return;
+	}
+	free_generic_messages( ctx->msgs );
+	ctx->msgs = replay_make_msgs( rec->conts );
+	sts = rec_int( rec, 0 );
+	total = rec_int( rec, 1 );
+	recent = rec_int( rec, 2 );
+	free_recs( rec->conts );
+	free( rec );
+	cb( sts, ctx->msgs, total, recent, aux );
+}
+
+static void
+replay_fetch_msg( store_t *gctx, message_t *msg, msg_data_t *data,
+                  void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_rec_t *rec, *cont;
+	int sts, len, off, l;
+	char *p, hdr[48];
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_FETCH_MSG, msg->uid ))) {
+		cb( DRV_CANCELED, aux );
+		return;
+	}
+	if ((sts = rec_int( rec, 1 )) == DRV_OK) {
+		data->flags = (uchar)rec_int( rec, 2 );
+		data->date = (time_t)rec_llong( rec, 3 );
+		len = rec_int( rec, 4 );
+		data->data = p = nfmalloc( len + 1 );
+		if (rec->conts) {
+			/* Recorded with --record-bodies. */
+			for (off = 0, cont = rec->conts; cont && off < len; cont = cont->next) {
+				if (!rec_str( cont, 0 ))
+					continue;
+				l = strlen( rec_str( cont, 0 ) );
+				if (l > len - off)
+					l = len - off;
+				memcpy( p + off, rec_str( cont, 0 ), l );
+				off += l;
+			}
+			len = off;
+		} else {
+			/* Only the size is known, so make up a message of that size. */
+			off = nfsnprintf( hdr, sizeof(hdr), "Subject: replayed message %u\n\n", msg->uid );
+			if (off > len)
+				off = len;
+			memcpy( p, hdr, off );
+			for (; off < len; off++)
+				p[off] = (off % 72 == 71 || off == len - 1) ? '\n' : 'x';
+		}
+		p[len] = 0;
+		data->len = len;
+	}
+	free_recs( rec->conts );
+	free( rec );
+	cb( sts, aux );
+}
+
+static void
+replay_store_msg( store_t *gctx, msg_data_t *data, int to_trash ATTR_UNUSED,
+                  void (*cb)( int sts, uint uid, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts;
+	uint uid;
+
+	free_msg_data( data );
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_STORE_MSG, 0 ))) {
+		cb( DRV_CANCELED, 0, aux );
+		return;
+	}
+	sts = rec_int( rec, 0 );
+	uid = (uint)rec_int( rec, 1 );
+	free( rec );
+	cb( sts, uid, aux );
+}
+
+static void
+replay_link_msg( store_t *gctx, const char *key ATTR_UNUSED, int flags ATTR_UNUSED,
+                 void (*cb)( int sts, uint uid, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts;
+	uint uid;
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_LINK_MSG, 0 ))) {
+		cb( DRV_CANCELED, 0, aux );
+		return;
+	}
+	sts = rec_int( rec, 0 );
+	uid = (uint)rec_int( rec, 1 );
+	free( rec );
+	cb( sts, uid, aux );
+}
+
+static void
+replay_find_new_msgs( store_t *gctx, uint newuid ATTR_UNUSED,
+                      void (*cb)( int sts, message_t *msgs, void *aux ), void *aux )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+	replay_rec_t *rec;
+	message_t **msgapp, *msgs;
+	int sts;
+
+	if (!(rec = replay_next_cb( ctx, R_FIND_NEW_MSGS, 0 ))) {
+		cb( DRV_CANCELED, 0, aux );
+		return;
+	}
+	for (msgapp = &ctx->msgs; *msgapp; msgapp = &(*msgapp)->next);
+	*msgapp = msgs = replay_make_msgs( rec->conts );
+	sts = rec_int( rec, 0 );
+	free_recs( rec->conts );
+	free( rec );
+	cb( sts, msgs, aux );
+}
+
+static void
+replay_set_msg_flags( store_t *gctx, message_t *msg, uint uid, int add, int del,
+                      void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts;
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_SET_MSG_FLAGS, msg ? msg->uid : uid ))) {
+		cb( DRV_CANCELED, aux );
+		return;
+	}
+	if ((sts = rec_int( rec, 1 )) == DRV_OK && msg)
+		msg->flags = (msg->flags | add) & ~del;
+	free( rec );
+	cb( sts, aux );
+}
+
+static void
+replay_trash_msg( store_t *gctx, message_t *msg,
+                  void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_rec_t *rec;
+	int sts;
+
+	if (!(rec = replay_next_cb( (replay_store_t *)gctx, R_TRASH_MSG, msg->uid ))) {
+		cb( DRV_CANCELED, aux );
+		return;
+	}
+	if ((sts = rec_int( rec, 1 )) == DRV_OK)
+		msg->status |= M_DEAD;
+	free( rec );
+	cb( sts, aux );
+}
+
+static void
+replay_close_box( store_t *gctx,
+                  void (*cb)( int sts, void *aux ), void *aux )
+{
+	replay_simple( gctx, R_CLOSE_BOX, cb, aux );
+}
+
+static void
+replay_cancel_cmds( store_t *gctx,
+                    void (*cb)( void *aux ), void *aux )
+{
+	replay_store_t *ctx = (replay_store_t *)gctx;
+	replay_rec_t *rec;
+
+	/* Not being able to match this is harmless. */
+	if ((rec = ctx->trace->recs[R_CANCEL_CMDS])) {
+		if (!(ctx->trace->recs[R_CANCEL_CMDS] = rec->next))
+			ctx->trace->recsapp[R_CANCEL_CMDS] = &ctx->trace->recs[R_CANCEL_CMDS];
+		free( rec );
+	}
+	cb( aux );
+}
+
+static void
+replay_commit_cmds( store_t *gctx ATTR_UNUSED )
+{
+}
+
+static int
+replay_get_memory_usage( store_t *gctx ATTR_UNUSED )
+{
+	return 0;
+}
+
+static int
+replay_get_fail_state( store_conf_t *gconf ATTR_UNUSED )
+{
+	return FAIL_TEMP;
+}
+
+static int
+replay_parse_store( conffile_t *cfg ATTR_UNUSED, store_conf_t **storep ATTR_UNUSED )
+{
+	return 0;
+}
+
+static void
+replay_cleanup( void )
+{
+}
+
+struct driver replay_driver = {
+	replay_get_caps,
+	replay_parse_store,
+	replay_cleanup,
+	replay_alloc_store,
+	replay_set_bad_callback,
+	replay_connect_store,
+	replay_free_store,
+	replay_free_store, /* _cancel_, but it's the same */
+	replay_list_store,
+	replay_select_box,
+	replay_get_box_path,
+	replay_get_box_fingerprint,
+	replay_create_box,
+	replay_open_box,
+	replay_get_uidnext,
+	replay_confirm_box_empty,
+	replay_delete_box,
+	replay_finish_delete_box,
+	replay_prepare_load_box,
+	replay_load_box,
+	replay_fetch_msg,
+	replay_store_msg,
+	replay_link_msg,
+	replay_find_new_msgs,
+	replay_set_msg_flags,
+	replay_trash_msg,
+	replay_close_box,
+	replay_cancel_cmds,
+	replay_commit_cmds,
+	replay_get_memory_usage,
+	replay_get_fail_state,
+};
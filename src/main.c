@@ -84,6 +84,11 @@ PACKAGE " " VERSION " - mailbox synchronizer\n"
 "  -R, --remove		propagate deletions of mailboxes\n"
 "  -X, --expunge		expunge	deleted messages\n"
 "  -c, --config CONFIG	read an alternate config file (default: ~/." EXE "rc)\n"
+"  --stats-file FILE	append timing and counters in JSON format to FILE\n"
+"  --profile		print statistics about driver calls at exit\n"
+"  --record FILE		write the results of all driver calls to FILE\n"
+"  --record-bodies	include message contents in the --record trace\n"
+"  --replay FILE		serve the stores found in the trace FILE from it\n"
 "  -D, --debug		debugging modes (see manual)\n"
 "  -V, --verbose		display what is happening\n"
 "  -q, --quiet		don't display progress counters\n"
@@ -429,7 +434,7 @@ main( int argc, char **argv )
 	group_conf_t *group;
 	channel_conf_t *chan;
 	string_list_t *channame;
-	char *config = 0, *opt, *ochar;
+	char *config = 0, *stats_file = 0, *record_file = 0, *replay_file = 0, *opt, *ochar;
 	int oind, cops = 0, op, ops[2] = { 0, 0 }, pseudo = 0;
 
 	tzset();
@@ -464,6 +469,32 @@ main( int argc, char **argv )
 					config = argv[oind++];
 				} else if (starts_with( opt, -1, "config=", 7 ))
 					config = opt + 7;
+				else if (!strcmp( opt, "stats-file" )) {
+					if (oind >= argc) {
+						error( "--stats-file requires an argument.\n" );
+						return 1;
+					}
+					stats_file = argv[oind++];
+				} else if (starts_with( opt, -1, "stats-file=", 11 ))
+					stats_file = opt + 11;
+				else if (!strcmp( opt, "record" )) {
+					if (oind >= argc) {
+						error( "--record requires an argument.\n" );
+						return 1;
+					}
+					record_file = argv[oind++];
+				} else if (starts_with( opt, -1, "record=", 7 ))
+					record_file = opt + 7;
+				else if (!strcmp( opt, "record-bodies" ))
+					RecordBodies = 1;
+				else if (!strcmp( opt, "replay" )) {
+					if (oind >= argc) {
+						error( "--replay requires an argument.\n" );
+						return 1;
+					}
+					replay_file = argv[oind++];
+				} else if (starts_with( opt, -1, "replay=", 7 ))
+					replay_file = opt + 7;
 				else if (!strcmp( opt, "all" ))
 					mvars->all = 1;
 				else if (!strcmp( opt, "list" ))
@@ -479,6 +510,8 @@ main( int argc, char **argv )
 						DFlags |= QUIET;
 				} else if (!strcmp( opt, "verbose" )) {
 					DFlags |= VERBOSE;
+				} else if (!strcmp( opt, "profile" )) {
+					DFlags |= PROFILE;
 				} else if (starts_with( opt, -1, "debug", 5 )) {
 					opt += 5;
 					if (!*opt)
@@ -712,6 +745,9 @@ main( int argc, char **argv )
 		case 'Z':
 			DFlags |= ZERODELAY;
 			break;
+		case 'T':
+			DFlags |= NOFILES;
+			break;
 		case 'v':
 			version();
 		case 'h':
@@ -739,6 +775,24 @@ main( int argc, char **argv )
 	if (load_config( config, pseudo ))
 		return 1;
 
+	if (stats_file) {
+		if (!(StatsFile = fopen( stats_file, "a" ))) {
+			sys_error( "Error: cannot open stats file %s", stats_file );
+			return 1;
+		}
+		setlinebuf( StatsFile );
+	}
+
+	if (replay_file && replay_load( replay_file ))
+		return 1;
+
+	if (record_file) {
+		if (!(RecordFile = fopen( record_file, "w" ))) {
+			sys_error( "Error: cannot create trace file %s", record_file );
+			return 1;
+		}
+	}
+
 	if (!channels) {
 		fputs( "No channels defined. Try 'man " EXE "'\n", stderr );
 		return 1;
@@ -778,6 +832,8 @@ main( int argc, char **argv )
 	main_loop();
 	if (!mvars->list)
 		flushn();
+	if (DFlags & PROFILE)
+		proxy_dump_profile();
 	return mvars->ret;
 }
 
@@ -833,6 +889,7 @@ sync_chans( main_vars_t *mvars, int ent )
 	do {
 		mvars->chan = mvars->chanptr->conf;
 		info( "Channel %s\n", mvars->chan->name );
+		start_chan_stats();
 		mvars->skip = mvars->cben = 0;
 		for (t = 0; t < 2; t++) {
 			int st = mvars->chan->stores[t]->driver->get_fail_state( mvars->chan->stores[t] );
@@ -850,9 +907,10 @@ sync_chans( main_vars_t *mvars, int ent )
 		else
 			labels[M] = labels[S] = "";
 		for (t = 0; t < 2; t++) {
-			driver_t *drv = mvars->chan->stores[t]->driver;
+			driver_t *drv = replay_has_store( mvars->chan->stores[t]->name ) ?
+			                &replay_driver : mvars->chan->stores[t]->driver;
 			store_t *ctx = drv->alloc_store( mvars->chan->stores[t], labels[t] );
-			if (DFlags & DEBUG_DRV) {
+			if ((DFlags & (DEBUG_DRV | PROFILE)) || RecordFile) {
 				drv = &proxy_driver;
 				ctx = proxy_alloc_store( ctx, labels[t] );
 			}
@@ -970,6 +1028,8 @@ sync_chans( main_vars_t *mvars, int ent )
 		}
 	  next2:
 		if (!mvars->list) {
+			// cben is still clear if the channel was skipped right away.
+			report_chan_stats( mvars->chan, mvars->skip && !mvars->cben );
 			chans_done++;
 			stats();
 		}
@@ -1024,6 +1084,9 @@ store_connected( int sts, void *aux )
 					cflags |= flags;
 				}
 			}
+			// The boxes' status allows skipping unchanged boxes in sync_boxes().
+			if (!mvars->list)
+				cflags |= LIST_BOX_STATUS;
 			mvars->state[t] = ST_CONNECTED;
 			mvars->drv[t]->list_store( mvars->ctx[t], cflags, store_listed, AUX );
 			return;
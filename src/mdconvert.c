@@ -30,7 +30,9 @@
 #include <string.h>
 #include <ctype.h>
 
+#ifdef USE_DB
 #include <db.h>
+#endif /* USE_DB */
 
 #define EXE "mdconvert"
 
@@ -49,6 +51,13 @@ oob( void )
 	abort();
 }
 
+static void ATTR_NORETURN
+oom( void )
+{
+	fputs( "Fatal: Out of memory\n", stderr );
+	abort();
+}
+
 static void ATTR_PRINTFLIKE(1, 2)
 sys_error( const char *msg, ... )
 {
@@ -75,96 +84,273 @@ nfsnprintf( char *buf, int blen, const char *fmt, ... )
 	return ret;
 }
 
+/* The UID storage schemes. */
+#define SCHEME_NATIVE  0  /* UIDs in the file names, validity in .uidvalidity */
+#define SCHEME_ALT     1  /* UIDs in .mbsyncuidmap, validity in .uidvalidity */
+#define SCHEME_DB      2  /* everything in .isyncuidmap.db (legacy) */
+
 static const char *subdirs[] = { "cur", "new" };
 static struct flock lck;
+#ifdef USE_DB
 static DBT key, value;
+#endif /* USE_DB */
+
+typedef struct {
+	char *key;
+	int seq;
+	int uid;
+} map_ent_t;
+
+typedef struct {
+	map_ent_t *ents;
+	int n, alloc;
+} map_t;
+
+static void
+map_add( map_t *map, const char *key, int klen, int uid )
+{
+	map_ent_t *ent;
+
+	if (map->n == map->alloc) {
+		map->alloc = map->alloc * 2 + 256;
+		if (!(map->ents = realloc( map->ents, map->alloc * sizeof(map_ent_t) )))
+			oom();
+	}
+	ent = &map->ents[map->n];
+	if (!(ent->key = malloc( klen + 1 )))
+		oom();
+	memcpy( ent->key, key, klen );
+	ent->key[klen] = 0;
+	ent->seq = map->n++;
+	ent->uid = uid;
+}
+
+static void
+map_free( map_t *map )
+{
+	int i;
+
+	for (i = 0; i < map->n; i++)
+		free( map->ents[i].key );
+	free( map->ents );
+	map->ents = 0;
+	map->n = map->alloc = 0;
+}
+
+static int
+map_cmp( const void *a, const void *b )
+{
+	const map_ent_t *ea = (const map_ent_t *)a, *eb = (const map_ent_t *)b;
+	int ret = strcmp( ea->key, eb->key );
+	return ret ? ret : ea->seq - eb->seq;
+}
+
+/* Sort the map, keeping only the last entry for each key, and dropping removals. */
+static void
+map_finish( map_t *map )
+{
+	int i, j;
+
+	qsort( map->ents, map->n, sizeof(map_ent_t), map_cmp );
+	for (i = j = 0; i < map->n; i++) {
+		if ((i + 1 < map->n && !strcmp( map->ents[i].key, map->ents[i + 1].key )) || !map->ents[i].uid)
+			free( map->ents[i].key );
+		else
+			map->ents[j++] = map->ents[i];
+	}
+	map->n = j;
+}
+
+static int
+map_find( map_t *map, const char *key, int klen )
+{
+	int l = 0, r = map->n - 1, m, ret;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (!(ret = strncmp( key, map->ents[m].key, klen )))
+			ret = map->ents[m].key[klen] ? -1 : 0;
+		if (!ret)
+			return map->ents[m].uid;
+		if (ret < 0)
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return 0;
+}
+
+static int
+read_uidmap( const char *path, map_t *map )
+{
+	FILE *f;
+	char *p;
+	int l, uid, line;
+	char buf[_POSIX_PATH_MAX + 16];
+
+	if (!(f = fopen( path, "r" ))) {
+		sys_error( "Cannot open %s", path );
+		return -1;
+	}
+	for (line = 0; fgets( buf, sizeof(buf), f ); line++) {
+		if (!(l = strlen( buf )) || buf[l - 1] != '\n')
+			goto bad;
+		buf[--l] = 0;
+		if (!line) {
+			if (buf[0] != '1' || buf[1] != ' ')
+				goto bad;
+			continue;
+		}
+		uid = strtol( buf, &p, 10 );
+		if (p == buf || *p != ' ' || !p[1])
+			goto bad;
+		p++;
+		map_add( map, p, buf + l - p, uid );
+	}
+	fclose( f );
+	map_finish( map );
+	return 0;
+
+  bad:
+	fprintf( stderr, "Error: malformed UID map %s.\n", path );
+	fclose( f );
+	return -1;
+}
+
+static int
+write_file( const char *path, const char *data, int len )
+{
+	int fd;
+
+	if ((fd = open( path, O_WRONLY|O_CREAT|O_TRUNC, 0600 )) < 0) {
+		sys_error( "Cannot create %s", path );
+		return -1;
+	}
+	if (write( fd, data, len ) != len) {
+		sys_error( "Cannot write %s", path );
+		close( fd );
+		return -1;
+	}
+	close( fd );
+	return 0;
+}
+
+static int
+write_uidmap( const char *path, map_t *map )
+{
+	FILE *f;
+	int i;
+
+	map_finish( map );
+	if (!(f = fopen( path, "w" ))) {
+		sys_error( "Cannot create %s", path );
+		return -1;
+	}
+	fprintf( f, "1 %d\n", map->n );
+	for (i = 0; i < map->n; i++)
+		fprintf( f, "%d %s\n", map->ents[i].uid, map->ents[i].key );
+	if (fclose( f )) {
+		sys_error( "Cannot write %s", path );
+		return -1;
+	}
+	return 0;
+}
 
 static int
-convert( const char *box, int altmap )
+convert( const char *box, int target )
 {
-	DB *db;
+#ifdef USE_DB
+	DB *db = 0;
+	int ret;
+#endif /* USE_DB */
 	DIR *d;
 	struct dirent *e;
 	const char *u, *ru;
-	char *p, *s, *dpath, *spath, *dbpath;
-	int i, n, ret, sfd, dfd, bl, ml, uv[2], uid;
+	char *p, *s;
+	int i, n, sfd, bl, ml, kl, uv[2], uid, source, rv = 1;
+	map_t smap = { 0, 0, 0 }, dmap = { 0, 0, 0 };
 	struct stat st;
 	char buf[_POSIX_PATH_MAX], buf2[_POSIX_PATH_MAX];
-	char umpath[_POSIX_PATH_MAX], uvpath[_POSIX_PATH_MAX], tdpath[_POSIX_PATH_MAX];
+	char uvpath[_POSIX_PATH_MAX], umpath[_POSIX_PATH_MAX], dbpath[_POSIX_PATH_MAX];
+	char tuvpath[_POSIX_PATH_MAX], tumpath[_POSIX_PATH_MAX], tdbpath[_POSIX_PATH_MAX];
 
 	if (stat( box, &st ) || !S_ISDIR(st.st_mode)) {
 		fprintf( stderr, "'%s' is no Maildir mailbox.\n", box );
 		return 1;
 	}
 
-	nfsnprintf( umpath, sizeof(umpath), "%s/.isyncuidmap.db", box );
 	nfsnprintf( uvpath, sizeof(uvpath), "%s/.uidvalidity", box );
-	if (altmap)
-		dpath = umpath, spath = uvpath, dbpath = tdpath;
+	nfsnprintf( umpath, sizeof(umpath), "%s/.mbsyncuidmap", box );
+	nfsnprintf( dbpath, sizeof(dbpath), "%s/.isyncuidmap.db", box );
+	nfsnprintf( tuvpath, sizeof(tuvpath), "%s.tmp", uvpath );
+	nfsnprintf( tumpath, sizeof(tumpath), "%s.tmp", umpath );
+	nfsnprintf( tdbpath, sizeof(tdbpath), "%s.tmp", dbpath );
+	if (!access( umpath, F_OK ))
+		source = SCHEME_ALT;
+	else if (!access( uvpath, F_OK ))
+		source = SCHEME_NATIVE;
+	else if (!access( dbpath, F_OK ))
+		source = SCHEME_DB;
 	else
-		spath = umpath, dpath = uvpath, dbpath = umpath;
-	nfsnprintf( tdpath, sizeof(tdpath), "%s.tmp", dpath );
-	if ((sfd = open( spath, O_RDWR )) < 0) {
-		if (errno != ENOENT)
-			sys_error( "Cannot open %s", spath );
+		return 1;
+	if (source == target)
+		return 1;
+#ifndef USE_DB
+	if (source == SCHEME_DB) {
+		fprintf( stderr, "Error: cannot convert '%s': no Berkeley DB support.\n", box );
 		return 1;
 	}
-	if (fcntl( sfd, F_SETLKW, &lck )) {
-		sys_error( "Cannot lock %s", spath );
-		goto sbork;
-	}
-	if ((dfd = open( tdpath, O_RDWR|O_CREAT, 0600 )) < 0) {
-		sys_error( "Cannot create %s", tdpath );
-		goto sbork;
+#endif
+
+	if ((sfd = open( source == SCHEME_DB ? dbpath : uvpath, O_RDWR )) < 0) {
+		sys_error( "Cannot open %s", source == SCHEME_DB ? dbpath : uvpath );
+		return 1;
 	}
-	if (db_create( &db, 0, 0 )) {
-		fputs( "Error: db_create() failed\n", stderr );
-		goto tbork;
+	if (fcntl( sfd, F_SETLKW, &lck )) {
+		sys_error( "Cannot lock %s", source == SCHEME_DB ? dbpath : uvpath );
+		goto bork;
 	}
-	if ((ret = (db->open)( db, 0, dbpath, 0, DB_HASH, altmap ? DB_CREATE|DB_TRUNCATE : 0, 0 ))) {
-		db->err( db, ret, "Error: db->open(%s)", dbpath );
-	  dbork:
-		db->close( db, 0 );
-	  tbork:
-		unlink( tdpath );
-		close( dfd );
-	  sbork:
-		close( sfd );
-		return 1;
+#ifdef USE_DB
+	if (source == SCHEME_DB || target == SCHEME_DB) {
+		if (db_create( &db, 0, 0 )) {
+			fputs( "Error: db_create() failed\n", stderr );
+			db = 0;
+			goto bork;
+		}
+		if ((ret = (db->open)( db, 0, source == SCHEME_DB ? dbpath : tdbpath, 0, DB_HASH,
+		                       source == SCHEME_DB ? 0 : DB_CREATE|DB_TRUNCATE, 0 ))) {
+			db->err( db, ret, "Error: db->open(%s)", source == SCHEME_DB ? dbpath : tdbpath );
+			goto bork;
+		}
 	}
 	key.data = (void *)"UIDVALIDITY";
 	key.size = 11;
-	if (altmap) {
+	if (source == SCHEME_DB) {
+		if ((ret = db->get( db, 0, &key, &value, 0 ))) {
+			db->err( db, ret, "Error: cannot read UIDVALIDITY of '%s'", box );
+			goto bork;
+		}
+		uv[0] = ((int *)value.data)[0];
+		uv[1] = ((int *)value.data)[1];
+	} else
+#endif /* USE_DB */
+	{
 		if ((n = read( sfd, buf, sizeof(buf) - 1 )) <= 0 ||
 		    (buf[n] = 0, sscanf( buf, "%d\n%d", &uv[0], &uv[1] ) != 2))
 		{
 			fprintf( stderr, "Error: cannot read UIDVALIDITY of '%s'.\n", box );
-			goto dbork;
-		}
-		value.data = uv;
-		value.size = sizeof(uv);
-		if ((ret = db->put( db, 0, &key, &value, 0 ))) {
-			db->err( db, ret, "Error: cannot write UIDVALIDITY for '%s'", box );
-			goto dbork;
-		}
-	} else {
-		if ((ret = db->get( db, 0, &key, &value, 0 ))) {
-			db->err( db, ret, "Error: cannot read UIDVALIDITY of '%s'", box );
-			goto dbork;
-		}
-		n = sprintf( buf, "%d\n%d\n", ((int *)value.data)[0], ((int *)value.data)[1] );
-		if (write( dfd, buf, n ) != n) {
-			fprintf( stderr, "Error: cannot write UIDVALIDITY for '%s'.\n", box );
-			goto dbork;
+			goto bork;
 		}
 	}
+	if (source == SCHEME_ALT && read_uidmap( umpath, &smap ))
+		goto bork;
 
   again:
 	for (i = 0; i < 2; i++) {
 		bl = nfsnprintf( buf, sizeof(buf), "%s/%s/", box, subdirs[i] );
 		if (!(d = opendir( buf ))) {
 			sys_error( "Cannot list %s", buf );
-			goto dbork;
+			goto bork;
 		}
 		while ((e = readdir( d ))) {
 			if (*e->d_name == '.')
@@ -180,32 +366,51 @@ convert( const char *box, int altmap )
 				ml = u - e->d_name;
 			else
 				ru = "", ml = sizeof(buf);
-			if (altmap) {
+			s = strpbrk( e->d_name, ",:" );
+			kl = s ? (int)(s - e->d_name) : (int)strlen( e->d_name );
+			if (source == SCHEME_NATIVE) {
 				if (!p)
 					continue;
-				key.data = e->d_name;
-				key.size = (size_t)(strchr( e->d_name, ',' ) - e->d_name);
 				uid = atoi( p + 3 );
-				value.data = &uid;
-				value.size = sizeof(uid);
-				if ((ret = db->put( db, 0, &key, &value, 0 ))) {
-					db->err( db, ret, "Error: cannot write UID for '%s'", box );
-					goto ebork;
-				}
-				nfsnprintf( buf2 + bl, sizeof(buf2) - bl, "%.*s%s", ml, e->d_name, ru );
+			} else if (source == SCHEME_ALT) {
+				if (!(uid = map_find( &smap, e->d_name, kl )))
+					continue;
 			} else {
-				s = strpbrk( e->d_name, ",:" );
+#ifdef USE_DB
 				key.data = e->d_name;
-				key.size = s ? (size_t)(s - e->d_name) : strlen( e->d_name );
+				key.size = kl;
 				if ((ret = db->get( db, 0, &key, &value, 0 ))) {
 					if (ret != DB_NOTFOUND) {
 						db->err( db, ret, "Error: cannot read UID for '%s'", box );
-						goto ebork;
+						closedir( d );
+						goto bork;
 					}
 					continue;
 				}
 				uid = *(int *)value.data;
+#endif /* USE_DB */
+			}
+			if (target == SCHEME_NATIVE) {
 				nfsnprintf( buf2 + bl, sizeof(buf2) - bl, "%.*s,U=%d%s", ml, e->d_name, uid, ru );
+			} else {
+				if (target == SCHEME_ALT) {
+					map_add( &dmap, e->d_name, kl, uid );
+				} else {
+#ifdef USE_DB
+					key.data = e->d_name;
+					key.size = kl;
+					value.data = &uid;
+					value.size = sizeof(uid);
+					if ((ret = db->put( db, 0, &key, &value, 0 ))) {
+						db->err( db, ret, "Error: cannot write UID for '%s'", box );
+						closedir( d );
+						goto bork;
+					}
+#endif /* USE_DB */
+				}
+				if (!p)
+					continue;
+				nfsnprintf( buf2 + bl, sizeof(buf2) - bl, "%.*s%s", ml, e->d_name, ru );
 			}
 			if (rename( buf, buf2 )) {
 				if (errno == ENOENT) {
@@ -213,38 +418,90 @@ convert( const char *box, int altmap )
 					goto again;
 				}
 				sys_error( "Cannot rename %s to %s", buf, buf2 );
-			  ebork:
 				closedir( d );
-				goto dbork;
+				goto bork;
 			}
-
 		}
 		closedir( d );
 	}
 
-	db->close( db, 0 );
-	close( dfd );
-	if (rename( tdpath, dpath )) {
-		sys_error( "Cannot rename %s to %s", tdpath, dpath );
-		close( sfd );
-		return 1;
+	if (target == SCHEME_DB) {
+#ifdef USE_DB
+		key.data = (void *)"UIDVALIDITY";
+		key.size = 11;
+		value.data = uv;
+		value.size = sizeof(uv);
+		if ((ret = db->put( db, 0, &key, &value, 0 ))) {
+			db->err( db, ret, "Error: cannot write UIDVALIDITY for '%s'", box );
+			goto bork;
+		}
+		db->close( db, 0 );
+		db = 0;
+		if (rename( tdbpath, dbpath )) {
+			sys_error( "Cannot rename %s to %s", tdbpath, dbpath );
+			goto bork;
+		}
+#endif /* USE_DB */
+	} else {
+		if (target == SCHEME_ALT) {
+			if (write_uidmap( tumpath, &dmap ))
+				goto bork;
+			if (rename( tumpath, umpath )) {
+				sys_error( "Cannot rename %s to %s", tumpath, umpath );
+				goto bork;
+			}
+		}
+		if (source == SCHEME_DB) {
+			n = sprintf( buf, "%d\n%d\n", uv[0], uv[1] );
+			if (write_file( tuvpath, buf, n ))
+				goto bork;
+			if (rename( tuvpath, uvpath )) {
+				sys_error( "Cannot rename %s to %s", tuvpath, uvpath );
+				goto bork;
+			}
+		}
+	}
+	if (source == SCHEME_ALT) {
+		if (unlink( umpath ))
+			sys_error( "Cannot remove %s", umpath );
+	} else if (source == SCHEME_DB || target == SCHEME_DB) {
+		if (unlink( source == SCHEME_DB ? dbpath : uvpath ))
+			sys_error( "Cannot remove %s", source == SCHEME_DB ? dbpath : uvpath );
 	}
-	if (unlink( spath ))
-		sys_error( "Cannot remove %s", spath );
+	if (target == SCHEME_DB || source == SCHEME_ALT) {
+		/* The cache refers to names which may not exist any more. The links need
+		 * no attention, as they are hard links found by message key. */
+		nfsnprintf( buf, sizeof(buf), "%s/.mbsynccache", box );
+		unlink( buf );
+	}
+	rv = 0;
+
+  bork:
+#ifdef USE_DB
+	if (db)
+		db->close( db, 0 );
+	if (rv && target == SCHEME_DB)
+		unlink( tdbpath );
+#endif /* USE_DB */
+	map_free( &smap );
+	map_free( &dmap );
 	close( sfd );
-	return 0;
+	return rv;
 }
 
 int
 main( int argc, char **argv )
 {
-	int oint, ret, altmap = 0;
+	int oint, ret, target = SCHEME_NATIVE;
 
 	for (oint = 1; oint < argc; oint++) {
 		if (!strcmp( argv[oint], "-h" ) || !strcmp( argv[oint], "--help" )) {
 			puts(
 "Usage: " EXE " [-a] mailbox...\n"
-"  -a, --alt      convert to alternative (DB based) UID scheme\n"
+"  -a, --alt      convert to alternative (UID map based) UID scheme\n"
+#ifdef USE_DB
+"  -d, --db       convert to legacy alternative (DB based) UID scheme\n"
+#endif
 "  -n, --native   convert to native (file name based) UID scheme (default)\n"
 "  -h, --help     show this help message\n"
 "  -v, --version  display version"
@@ -254,9 +511,13 @@ main( int argc, char **argv )
 			puts( EXE " " VERSION " - Maildir UID scheme converter" );
 			return 0;
 		} else if (!strcmp( argv[oint], "-a" ) || !strcmp( argv[oint], "--alt" )) {
-			altmap = 1;
+			target = SCHEME_ALT;
+#ifdef USE_DB
+		} else if (!strcmp( argv[oint], "-d" ) || !strcmp( argv[oint], "--db" )) {
+			target = SCHEME_DB;
+#endif
 		} else if (!strcmp( argv[oint], "-n" ) || !strcmp( argv[oint], "--native" )) {
-			altmap = 0;
+			target = SCHEME_NATIVE;
 		} else if (!strcmp( argv[oint], "--" )) {
 			oint++;
 			break;
@@ -278,7 +539,6 @@ main( int argc, char **argv )
 #endif
 	ret = 0;
 	for (; oint < argc; oint++)
-		ret |= convert( argv[oint], altmap );
+		ret |= convert( argv[oint], target );
 	return ret;
 }
-
@@ -23,12 +23,18 @@ use File::Path;
 
 my $use_vg = $ENV{USE_VALGRIND};
 my $mbsync = getcwd()."/mbsync";
+my $mdconvert = getcwd()."/mdconvert";
+# Whether the mailboxes use the alternative (UID map based) UID storage scheme.
+my $altmap = 0;
 
 -d "tmp" or mkdir "tmp";
 chdir "tmp" or die "Cannot enter temp direcory.\n";
 
 sub show($$$);
 sub test($$$@);
+sub runtest($$@);
+sub test_mdconvert($$);
+sub test_dedup($);
 
 ################################################################################
 
@@ -233,6 +239,37 @@ my @X51 = (
 );
 test("max messages + expunge", \@x50, \@X51, @O51);
 
+# scan tests
+
+my @x60 = (
+ [ 2,
+   1, 1, "", 2, 2, "", 3, 0, "", 4, 0, "" ],
+ [ 2,
+   1, 1, "", 2, 2, "" ],
+ [ 2, 0, 2,
+   1, 1, "", 2, 2, "" ],
+);
+
+my @O61 = ("", "", "");
+#show("60", "61", "61");
+my @X61 = (
+ [ 4,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "" ],
+ [ 4,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "" ],
+ [ 4, 0, 2,
+   1, 1, "", 2, 2, "", 3, 3, "", 4, 4, "" ],
+);
+test("new messages without UIDs", \@x60, \@X61, @O61);
+
+# mdconvert tests
+my @m01 = ( 5,
+   1, 1, "F", 2, 0, "", 3, 3, "S", 4, 4, "", 5, 5, "FT*" );
+test_mdconvert("mdconvert round trip", \@m01);
+
+# deduplication tests
+test_dedup("deduplicate + interrupt");
+
 
 ################################################################################
 
@@ -263,11 +300,11 @@ sub writecfg($$$)
 MaildirStore master
 Path ./
 Inbox ./master
-".shift()."
+".($altmap ? "AltMap yes\n" : "").shift()."
 MaildirStore slave
 Path ./
 Inbox ./slave
-".shift()."
+".($altmap ? "AltMap yes\n" : "").shift()."
 Channel test
 Master :master:
 Slave :slave:
@@ -306,6 +343,28 @@ sub runsync($$)
 }
 
 
+# $path
+# Output: %uids: key => uid
+sub readuidmap($)
+{
+	my $bn = shift;
+
+	open(FILE, "<", $bn."/.mbsyncuidmap") or die "Cannot read UID map of mailbox '$bn'.\n";
+	my $hdr = <FILE>;
+	($hdr =~ /^1 \d+$/) or die "Invalid UID map header in mailbox '$bn'.\n";
+	my %uids = ();
+	while (<FILE>) {
+		/^(\d+) (.+)$/ or die "Invalid UID map record in mailbox '$bn'.\n";
+		if ($1) {
+			$uids{$2} = $1;
+		} else {
+			delete $uids{$2};
+		}
+	}
+	close FILE;
+	return %uids;
+}
+
 # $path
 sub readbox($)
 {
@@ -319,14 +378,26 @@ sub readbox($)
 	my $dummy = <FILE>;
 	chomp(my $mu = <FILE>);
 	close FILE;
+	my %uids = ();
+	if ($altmap) {
+		%uids = readuidmap($bn);
+	} elsif (-e $bn."/.mbsyncuidmap") {
+		die "Mailbox '$bn' unexpectedly uses the alternative UID scheme.\n";
+	}
 	my %ms = ();
 	for my $d ("cur", "new") {
 		opendir(DIR, $bn."/".$d) or next;
 		for my $f (grep(!/^\.\.?$/, readdir(DIR))) {
 			my ($uid, $flg, $num);
-			if ($f =~ /^\d+\.\d+_\d+\.[-[:alnum:]]+,U=(\d+):2,(.*)$/) {
+			if ($altmap) {
+				if ($f !~ /^(\d+\.\d+_\d+\.[-[:alnum:]]+)(?:,S=\d+)?(?:,T=[+_[:alnum:]]+)?:2,(.*)$/) {
+					print STDERR "unrecognided file name '$f' in '$bn'.\n";
+					exit 1;
+				}
+				($uid, $flg) = ($uids{$1} // 0, $2);
+			} elsif ($f =~ /^\d+\.\d+_\d+\.[-[:alnum:]]+(?:,S=\d+)?(?:,T=[+_[:alnum:]]+)?,U=(\d+)(?:,T=[+_[:alnum:]]+)?:2,(.*)$/) {
 				($uid, $flg) = ($1, $2);
-			} elsif ($f =~ /^\d+\.\d+_(\d+)\.[-[:alnum:]]+:2,(.*)$/) {
+			} elsif ($f =~ /^\d+\.\d+_(\d+)\.[-[:alnum:]]+(?:,S=\d+)?(?:,T=[+_[:alnum:]]+)?:2,(.*)$/) {
 				($uid, $flg) = (0, $2);
 			} else {
 				print STDERR "unrecognided file name '$f' in '$bn'.\n";
@@ -384,6 +455,7 @@ sub showstate($)
 		while (@ls) {
 			$_ = shift(@ls);
 			last OUTER if (!length($_));
+			next if (/^(Master|Slave)Status /);
 			if (!/^([^ ]+) (\d+)$/) {
 				print STDERR "Malformed sync state header entry: $_\n";
 				close FILE;
@@ -448,19 +520,30 @@ sub mkbox($$@)
 	open(FILE, ">", $bn."/.uidvalidity") or die "Cannot create UID validity for mailbox $bn.\n";
 	print FILE "1\n$mu\n";
 	close FILE;
+	my %uids = ();
 	while (@ms) {
 		my ($num, $uid, $flg) = (shift @ms, shift @ms, shift @ms);
-		if ($uid) {
-			$uid = ",U=".$uid;
-		} else {
+		my $key = "0.1_".$num.".local";
+		if (!$uid) {
+			$uid = "";
+		} elsif ($altmap) {
+			$uids{$key} = $uid;
 			$uid = "";
+		} else {
+			$uid = ",U=".$uid;
 		}
 		my $big = $flg =~ s/\*//;
-		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/0.1_".$num.".local".$uid.":2,".$flg) or
+		open(FILE, ">", $bn."/".($flg =~ /S/ ? "cur" : "new")."/".$key.$uid.":2,".$flg) or
 			die "Cannot create message $num in mailbox $bn.\n";
 		print FILE "From: foo\nTo: bar\nDate: Thu, 1 Jan 1970 00:00:00 +0000\nSubject: $num\n\n".(("A"x50)."\n")x($big*30);
 		close FILE;
 	}
+	if ($altmap) {
+		open(FILE, ">", $bn."/.mbsyncuidmap") or die "Cannot create UID map for mailbox $bn.\n";
+		print FILE "1 ".scalar(keys %uids)."\n";
+		print FILE "$uids{$_} $_\n" for (sort keys %uids);
+		close FILE;
+	}
 }
 
 # \@master, \@slave, @syncstate
@@ -529,6 +612,8 @@ sub ckstate($@)
 		while (@ls) {
 			my $l = shift(@ls);
 			last OUTER if (!length($l));
+			# Box fingerprints depend on timing, so they are not checked.
+			next if ($l =~ /^(Master|Slave)Status /);
 			if ($l !~ /^([^ ]+) (\d+)$/) {
 				print STDERR "Malformed sync state header entry: $l\n";
 				return 1;
@@ -637,10 +722,23 @@ sub readfile($)
 # $title, \@source_state, \@target_state, @channel_configs
 sub test($$$@)
 {
-	my ($ttl, $sx, $tx, @sfx) = @_;
+	my ($ttl, @args) = @_;
 
 	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
-	print "Testing: ".$ttl." ...\n";
+	# Run everything again with the alternative UID scheme.
+	for my $alt (0, 1) {
+		$altmap = $alt;
+		print "Testing: ".$ttl.($alt ? " (AltMap)" : "")." ...\n";
+		&runtest(@args);
+	}
+	$altmap = 0;
+}
+
+# \@source_state, \@target_state, @channel_configs
+sub runtest($$@)
+{
+	my ($sx, $tx, @sfx) = @_;
+
 	&writecfg(@sfx);
 
 	mkchan($$sx[0], $$sx[1], @{ $$sx[2] });
@@ -740,3 +838,140 @@ sub test($$$@)
 
 	killcfg();
 }
+
+# $boxname
+sub lsbox($)
+{
+	my $bn = shift;
+
+	my @fs = ();
+	for my $d ("cur", "new") {
+		opendir(DIR, $bn."/".$d) or die "Cannot list mailbox '$bn'.\n";
+		push @fs, map { "$d/$_" } grep(!/^\.\.?$/, readdir(DIR));
+		closedir DIR;
+	}
+	return sort @fs;
+}
+
+# $title, \@box
+sub test_mdconvert($$)
+{
+	my ($ttl, $bx) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	print "Testing: ".$ttl." ...\n";
+
+	$altmap = 0;
+	&mkbox("box", @{ $bx });
+	my @ofs = lsbox("box");
+
+	my @out = `$mdconvert -a box 2>&1`;
+	$altmap = 1;
+	if ($? || grep(/,U=/, lsbox("box")) || &ckbox("box", @{ $bx })) {
+		print "Conversion to the alternative scheme failed.\n";
+		print "Input:\n";
+		printbox("box", @{ $bx });
+		print "Actual result:\n";
+		showbox("box");
+		print "Output:\n";
+		print @out;
+		exit 1;
+	}
+
+	@out = `$mdconvert -n box 2>&1`;
+	$altmap = 0;
+	my @nfs = lsbox("box");
+	if ($? || join("\n", @nfs) ne join("\n", @ofs) || &ckbox("box", @{ $bx })) {
+		print "Conversion back to the native scheme failed.\n";
+		print "Original files:\n";
+		print " $_\n" for (@ofs);
+		print "Actual files:\n";
+		print " $_\n" for (@nfs);
+		print "Output:\n";
+		print @out;
+		exit 1;
+	}
+
+	rmtree "box";
+}
+
+# $title
+sub test_dedup($)
+{
+	my ($ttl) = @_;
+
+	return 0 if (scalar(@ARGV) && !grep { $_ eq $ttl } @ARGV);
+	if (!grep(/\+HAVE_LIBSSL/, `$mbsync -h`)) {
+		print "Skipping: ".$ttl." (needs OpenSSL)\n";
+		return 0;
+	}
+	print "Testing: ".$ttl." ...\n";
+
+	# The first message is synced beforehand, so the identical second one
+	# is reliably linked to it instead of racing with its store. -T makes
+	# the messages go through memory, as files would be linked anyway.
+	$altmap = 0;
+	writecfg("", "Deduplicate yes\n", "");
+	my $mkdup = sub {
+		rmtree ".mbsynclinks";
+		mkchan([ 1, 1, 1, "" ], [ 0 ], 0, 0, 0);
+		my ($sxc, @sret) = runsync("-T", "0-setup.log");
+		if ($sxc) {
+			print "Setup run failed.\n";
+			print "Debug output:\n";
+			print @sret;
+			exit 1;
+		}
+		my @fs = lsbox("master");
+		system("cp", "master/".$fs[0], "master/new/0.1_2.local,U=2:2,") and die "Cannot copy message in mailbox master.\n";
+		open(FILE, ">", "master/.uidvalidity") or die "Cannot update UID validity of mailbox master.\n";
+		print FILE "1\n2\n";
+		close FILE;
+	};
+
+	$mkdup->();
+	my ($xc, @ret) = runsync("-T -J", "1-initial.log");
+	my @fs = lsbox("slave");
+	if ($xc || @fs != 2) {
+		print "Initial run failed.\n";
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+	if (!grep(/deduplicated message/, @ret)) {
+		print "Message was not deduplicated.\n";
+		print "Debug output:\n";
+		print @ret;
+		exit 1;
+	}
+
+	my @nj = readfile("slave/.mbsyncstate.journal");
+	my $njl = (@nj - 1) * 2;
+	for (my $l = 2; $l < $njl; $l++) {
+		$mkdup->();
+
+		my ($nxc, @nret) = runsync("-T -J$l", "4-interrupt.log");
+		if ($nxc != (100 + ($l & 1)) << 8) {
+			print "Interrupting at step $l/$njl failed.\n";
+			print "Debug output:\n";
+			print @nret;
+			exit 1;
+		}
+
+		($nxc, @nret) = runsync("-T -J", "5-resume.log");
+		@fs = lsbox("slave");
+		if ($nxc || @fs != 2) {
+			print "Resuming from step $l/$njl failed.\n";
+			print "Slave files:\n";
+			print " $_\n" for (@fs);
+			print "Debug output:\n";
+			print @nret;
+			exit 1;
+		}
+	}
+
+	rmtree "slave";
+	rmtree "master";
+	rmtree ".mbsynclinks";
+	killcfg();
+}
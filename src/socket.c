@@ -31,6 +31,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -260,6 +261,11 @@ init_ssl_ctx( const server_conf_t *conf )
 	if (!(conf->ssl_versions & TLSv1_2))
 		options |= SSL_OP_NO_TLSv1_2;
 #endif
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Let the kernel do the record processing where it can. OpenSSL falls
+	 * back to userspace by itself if the kernel or the cipher don't allow it. */
+	options |= SSL_OP_ENABLE_KTLS;
+#endif
 
 	SSL_CTX_set_options( mconf->SSLContext, options );
 
@@ -340,7 +346,14 @@ start_tls_p2( conn_t *conn )
 		if (verify_cert_host( conn->conf, conn )) {
 			start_tls_p3( conn, 0 );
 		} else {
+#ifdef SSL_OP_ENABLE_KTLS
+			int ktls_tx = BIO_get_ktls_send( SSL_get_wbio( conn->ssl ) );
+			int ktls_rx = BIO_get_ktls_recv( SSL_get_rbio( conn->ssl ) );
+			info( "Connection is now encrypted (kernel TLS: %s)\n",
+			      ktls_tx ? ktls_rx ? "send+receive" : "send only" : ktls_rx ? "receive only" : "off" );
+#else
 			info( "Connection is now encrypted\n" );
+#endif
 			start_tls_p3( conn, 1 );
 		}
 	}
@@ -410,11 +423,25 @@ static void socket_connect_failed( conn_t * );
 static void socket_connected( conn_t * );
 static void socket_connect_bail( conn_t * );
 
+/* Small writes are coalesced into buffers sized after the socket's send
+ * buffer, so one flush is usually one syscall. The upper bound is one
+ * TLS record, which keeps SSL latency low with a slow uplink. */
+#define WRITE_CHUNK_MIN 1024
+#define WRITE_CHUNK_MAX 16384
+
 static void
 socket_open_internal( conn_t *sock, int fd )
 {
+	int sndbuf;
+	socklen_t sblen = sizeof(sndbuf);
+
 	sock->fd = fd;
 	fcntl( fd, F_SETFL, O_NONBLOCK );
+	if (getsockopt( fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sblen ))
+		sndbuf = 0;
+	sndbuf /= 4;
+	sock->write_chunk = sndbuf < WRITE_CHUNK_MIN ? WRITE_CHUNK_MIN :
+	                    sndbuf > WRITE_CHUNK_MAX ? WRITE_CHUNK_MAX : sndbuf;
 	init_notifier( &sock->notify, fd, socket_fd_cb, sock );
 	init_wakeup( &sock->fd_fake, socket_fake_cb, sock );
 	init_wakeup( &sock->fd_timeout, socket_timeout_cb, sock );
@@ -629,6 +656,42 @@ socket_connect_bail( conn_t *conn )
 	conn->callbacks.connect( 0, conn->callback_aux );
 }
 
+/* Receive buffers are attached to connections only while they hold data,
+ * so idle connections cost no buffer memory. Buffers of the standard size
+ * are recycled through a small pool shared by all connections; bigger ones
+ * are made for overlong lines and freed once they are drained. */
+#define READ_BUF_SIZE (64 * 1024)
+#define READ_BUF_MAX (64 * 1024 * 1024)
+#define READ_POOL_MAX 8
+
+static char *read_pool[READ_POOL_MAX];
+static int read_pooled;
+
+static char *
+get_read_buf( void )
+{
+	return read_pooled ? read_pool[--read_pooled] : nfmalloc( READ_BUF_SIZE );
+}
+
+static void
+put_read_buf( char *buf, int size )
+{
+	if (size == READ_BUF_SIZE && read_pooled < READ_POOL_MAX)
+		read_pool[read_pooled++] = buf;
+	else
+		free( buf );
+}
+
+static void
+release_read_buf( conn_t *sock )
+{
+	assert( !sock->bytes );
+	if (sock->buf) {
+		put_read_buf( sock->buf, sock->bufsz );
+		sock->buf = 0;
+	}
+}
+
 static void dispose_chunk( conn_t *conn );
 
 void
@@ -659,17 +722,49 @@ socket_close( conn_t *sock )
 		dispose_chunk( sock );
 	free( sock->append_buf );
 	sock->append_buf = 0;
+	sock->bytes = sock->scanoff = 0;
+	release_read_buf( sock );
+#ifdef HAVE_LIBZ
+	if (sock->z_buf) {
+		put_read_buf( sock->z_buf, READ_BUF_SIZE );
+		sock->z_buf = 0;
+	}
+#endif
 }
 
+/* Make room for reading at the end of the buffer. Data is moved to the front
+ * when that frees enough space; otherwise the buffer grows, so overlong lines
+ * only hit a limit meant to catch runaway peers. */
 static int
 prepare_read( conn_t *sock, char **buf, int *len )
 {
-	int n = sock->offset + sock->bytes;
-	if (!(*len = sizeof(sock->buf) - n)) {
-		error( "Socket error: receive buffer full. Probably protocol error.\n" );
-		socket_fail( sock );
-		return -1;
+	int n;
+	char *nbuf;
+
+	if (!sock->buf) {
+		sock->buf = get_read_buf();
+		sock->bufsz = READ_BUF_SIZE;
+		sock->offset = 0;
 	}
+	n = sock->offset + sock->bytes;
+	if (sock->bufsz - n < sock->bufsz / 4) {
+		if (sock->bytes <= sock->bufsz / 2) {
+			memmove( sock->buf, sock->buf + sock->offset, sock->bytes );
+		} else if (sock->bufsz >= READ_BUF_MAX) {
+			error( "Socket error: receive buffer full. Probably protocol error.\n" );
+			socket_fail( sock );
+			return -1;
+		} else {
+			nbuf = nfmalloc( sock->bufsz * 2 );
+			memcpy( nbuf, sock->buf + sock->offset, sock->bytes );
+			put_read_buf( sock->buf, sock->bufsz );
+			sock->buf = nbuf;
+			sock->bufsz *= 2;
+		}
+		sock->offset = 0;
+		n = sock->bytes;
+	}
+	*len = sock->bufsz - n;
 	*buf = sock->buf + n;
 	return 0;
 }
@@ -724,6 +819,10 @@ socket_fill_z( conn_t *sock )
 		socket_fail( sock );
 		return;
 	}
+	if (!sock->in_z->avail_in && sock->z_buf) {
+		put_read_buf( sock->z_buf, READ_BUF_SIZE );
+		sock->z_buf = 0;
+	}
 
 	if (!sock->in_z->avail_out)
 		conf_wakeup( &sock->z_fake, 0 );
@@ -743,8 +842,10 @@ socket_fill( conn_t *sock )
 		int ret;
 		/* The timer will preempt reads until the buffer is empty. */
 		assert( !sock->in_z->avail_in );
+		if (!sock->z_buf)
+			sock->z_buf = get_read_buf();
 		sock->in_z->next_in = (uchar *)sock->z_buf;
-		if ((ret = do_read( sock, sock->z_buf, sizeof(sock->z_buf) )) <= 0)
+		if ((ret = do_read( sock, sock->z_buf, READ_BUF_SIZE )) <= 0)
 			return;
 		sock->in_z->avail_in = ret;
 		socket_fill_z( sock );
@@ -769,15 +870,15 @@ void
 socket_expect_read( conn_t *conn, int expect )
 {
 	if (conn->conf->timeout > 0 && expect != pending_wakeup( &conn->fd_timeout ))
-		conf_wakeup( &conn->fd_timeout, expect ? conn->conf->timeout : -1 );
+		conf_wakeup( &conn->fd_timeout, expect ? conn->conf->timeout * 1000 : -1 );
 }
 
 int
 socket_read( conn_t *conn, char *buf, int len )
 {
 	int n = conn->bytes;
-	if (!n && conn->state == SCK_EOF)
-		return -1;
+	if (!n)
+		return (conn->state == SCK_EOF) ? -1 : 0;
 	if (n > len)
 		n = len;
 	memcpy( buf, conn->buf + conn->offset, n );
@@ -794,14 +895,15 @@ socket_read_line( conn_t *b )
 	char *p, *s;
 	int n;
 
+	if (!b->bytes) {
+		/* The caller is done with the previous line, so the buffer can go. */
+		release_read_buf( b );
+		return (b->state == SCK_EOF) ? (void *)~0 : 0;
+	}
 	s = b->buf + b->offset;
 	p = memchr( s + b->scanoff, '\n', b->bytes - b->scanoff );
 	if (!p) {
 		b->scanoff = b->bytes;
-		if (b->offset + b->bytes == sizeof(b->buf)) {
-			memmove( b->buf, b->buf + b->offset, b->bytes );
-			b->offset = 0;
-		}
 		if (b->state == SCK_EOF)
 			return (void *)~0;
 		return 0;
@@ -816,17 +918,21 @@ socket_read_line( conn_t *b )
 	return s;
 }
 
+/* Unencrypted writes gather this many queued buffers into one writev().
+ * This is _XOPEN_IOV_MAX, the minimum POSIX guarantees. */
+#define WRITE_IOV_MAX 16
+
 static int
-do_write( conn_t *sock, char *buf, int len )
+do_write( conn_t *sock, struct iovec *iov, int iovcnt, int len )
 {
 	int n;
 
 	assert( sock->fd >= 0 );
 #ifdef HAVE_LIBSSL
 	if (sock->ssl)
-		return ssl_return( "write to", sock, SSL_write( sock->ssl, buf, len ) );
+		return ssl_return( "write to", sock, SSL_write( sock->ssl, iov[0].iov_base, iov[0].iov_len ) );
 #endif
-	n = write( sock->fd, buf, len );
+	n = writev( sock->fd, iov, iovcnt );
 	if (n < 0) {
 		if (errno != EAGAIN && errno != EWOULDBLOCK) {
 			sys_error( "Socket error: write to %s", sock->name );
@@ -848,6 +954,8 @@ dispose_chunk( conn_t *conn )
 	if (!(conn->write_buf = bc->next))
 		conn->write_buf_append = &conn->write_buf;
 	conn->buffer_mem -= bc->len;
+	if (bc->data != bc->buf)
+		free( bc->data );
 	free( bc );
 }
 
@@ -855,21 +963,41 @@ static int
 do_queued_write( conn_t *conn )
 {
 	buff_chunk_t *bc;
+	struct iovec iov[WRITE_IOV_MAX];
 
 	if (!conn->write_buf)
 		return 0;
 
 	while ((bc = conn->write_buf)) {
-		int n, len = bc->len - conn->write_offset;
-		if ((n = do_write( conn, bc->data + conn->write_offset, len )) < 0)
+		int n, left, len = 0, iovcnt = 0, offset = conn->write_offset;
+		/* SSL_write() cannot gather, but TLS needs no help there anyway,
+		 * as queued buffers are either coalesced or big. */
+		int maxcnt =
+#ifdef HAVE_LIBSSL
+			conn->ssl ? 1 :
+#endif
+			WRITE_IOV_MAX;
+		do {
+			iov[iovcnt].iov_base = bc->data + offset;
+			iov[iovcnt].iov_len = bc->len - offset;
+			len += bc->len - offset;
+			offset = 0;
+		} while (++iovcnt < maxcnt && (bc = bc->next));
+		if ((n = do_write( conn, iov, iovcnt, len )) < 0)
 			return -1;
 		if (n != len) {
+			while (n >= (left = conn->write_buf->len - conn->write_offset)) {
+				n -= left;
+				conn->write_offset = 0;
+				dispose_chunk( conn );
+			}
 			conn->write_offset += n;
 			conn->writing = 1;
 			return 0;
 		}
 		conn->write_offset = 0;
-		dispose_chunk( conn );
+		while (iovcnt--)
+			dispose_chunk( conn );
 	}
 #ifdef HAVE_LIBSSL
 	if (conn->ssl && SSL_pending( conn->ssl ))
@@ -889,9 +1017,14 @@ do_append( conn_t *conn, buff_chunk_t *bc )
 	conn->write_buf_append = &bc->next;
 }
 
-/* This is big enough to avoid excessive chunking, but is
- * sufficiently small to keep SSL latency low with a slow uplink. */
-#define WRITE_CHUNK_SIZE 1024
+static buff_chunk_t *
+new_chunk( int size )
+{
+	buff_chunk_t *bc = nfmalloc( offsetof(buff_chunk_t, buf) + size );
+	bc->data = bc->buf;
+	bc->len = 0;
+	return bc;
+}
 
 static void
 do_flush( conn_t *conn )
@@ -905,9 +1038,8 @@ do_flush( conn_t *conn )
 		do {
 			int ret;
 			if (!bc) {
-				buf_avail = WRITE_CHUNK_SIZE;
-				bc = nfmalloc( offsetof(buff_chunk_t, data) + buf_avail );
-				bc->len = 0;
+				buf_avail = conn->write_chunk;
+				bc = new_chunk( buf_avail );
 			}
 			conn->out_z->next_in = Z_NULL;
 			conn->out_z->avail_in = 0;
@@ -937,91 +1069,108 @@ do_flush( conn_t *conn )
 	if (bc) {
 		do_append( conn, bc );
 		conn->append_buf = 0;
-#ifdef HAVE_LIBZ
 		conn->append_avail = 0;
-#endif
 	}
 }
 
+/* Big buffers we own are queued by reference instead of being copied.
+ * Compression needs to consume the data anyway. */
+static int
+may_adopt( conn_t *conn, conn_iovec_t *iov )
+{
+#ifdef HAVE_LIBZ
+	if (conn->out_z)
+		return 0;
+#endif
+	return iov->takeOwn == GiveOwn && iov->len >= conn->write_chunk;
+}
+
 void
 socket_write( conn_t *conn, conn_iovec_t *iov, int iovcnt )
 {
-	int i, buf_avail, len, offset = 0, total = 0;
+	int i, buf_avail, len, offset = 0, total = 0, copy = 0;
 	buff_chunk_t *bc;
 
-	for (i = 0; i < iovcnt; i++)
+	for (i = 0; i < iovcnt; i++) {
 		total += iov[i].len;
-	if (total >= WRITE_CHUNK_SIZE) {
+		if (!may_adopt( conn, &iov[i] ))
+			copy += iov[i].len;
+	}
+	if (total >= conn->write_chunk) {
 		/* If the new data is too big, queue the pending buffer to avoid latency. */
 		do_flush( conn );
 	}
 	bc = conn->append_buf;
-#ifdef HAVE_LIBZ
 	buf_avail = conn->append_avail;
-#endif
 	while (total) {
+		if (!offset && may_adopt( conn, iov )) {
+			if (bc) {
+				if (bc->len)
+					do_append( conn, bc );
+				else
+					free( bc );
+			}
+			bc = nfmalloc( offsetof(buff_chunk_t, buf) );
+			bc->data = iov->buf;
+			bc->len = iov->len;
+			do_append( conn, bc );
+			bc = 0;
+			buf_avail = 0;
+			total -= iov->len;
+			iov++;
+			continue;
+		}
 		if (!bc) {
 			/* We don't do anything special when compressing, as there is no way to
 			 * predict a reasonable output buffer size anyway - deflatePending() does
 			 * not account for consumed but not yet compressed input, and adding up
 			 * the deflateBound()s would be a tad *too* pessimistic. */
-			buf_avail = total > WRITE_CHUNK_SIZE ? total : WRITE_CHUNK_SIZE;
-			bc = nfmalloc( offsetof(buff_chunk_t, data) + buf_avail );
-			bc->len = 0;
-#ifndef HAVE_LIBZ
-		} else {
-			/* A pending buffer will always be of standard size - over-sized
-			 * buffers are immediately filled and queued. */
-			buf_avail = WRITE_CHUNK_SIZE - bc->len;
-#endif
+			buf_avail = copy > conn->write_chunk ? copy : conn->write_chunk;
+			bc = new_chunk( buf_avail );
 		}
-		while (total) {
-			len = iov->len - offset;
+		len = iov->len - offset;
 #ifdef HAVE_LIBZ
-			if (conn->out_z) {
-				int ret;
-				conn->out_z->next_in = (uchar *)iov->buf + offset;
-				conn->out_z->avail_in = len;
-				conn->out_z->next_out = (uchar *)bc->data + bc->len;
-				conn->out_z->avail_out = buf_avail;
-				/* Z_BUF_ERROR is impossible here, as the input buffer always has data,
-				 * and the output buffer always has space. */
-				if ((ret = deflate( conn->out_z, Z_NO_FLUSH )) != Z_OK) {
-					error( "Fatal: Compression error: %s\n", z_err_msg( ret, conn->out_z ) );
-					abort();
-				}
-				bc->len = (char *)conn->out_z->next_out - bc->data;
-				buf_avail = conn->out_z->avail_out;
-				len -= conn->out_z->avail_in;
-				conn->z_written = 1;
-			} else
-#endif
-			{
-				if (len > buf_avail)
-					len = buf_avail;
-				memcpy( bc->data + bc->len, iov->buf + offset, len );
-				bc->len += len;
-				buf_avail -= len;
-			}
-			offset += len;
-			total -= len;
-			if (offset == iov->len) {
-				if (iov->takeOwn == GiveOwn)
-					free( iov->buf );
-				iov++;
-				offset = 0;
-			}
-			if (!buf_avail) {
-				do_append( conn, bc );
-				bc = 0;
-				break;
+		if (conn->out_z) {
+			int ret;
+			conn->out_z->next_in = (uchar *)iov->buf + offset;
+			conn->out_z->avail_in = len;
+			conn->out_z->next_out = (uchar *)bc->data + bc->len;
+			conn->out_z->avail_out = buf_avail;
+			/* Z_BUF_ERROR is impossible here, as the input buffer always has data,
+			 * and the output buffer always has space. */
+			if ((ret = deflate( conn->out_z, Z_NO_FLUSH )) != Z_OK) {
+				error( "Fatal: Compression error: %s\n", z_err_msg( ret, conn->out_z ) );
+				abort();
 			}
+			bc->len = (char *)conn->out_z->next_out - bc->data;
+			buf_avail = conn->out_z->avail_out;
+			len -= conn->out_z->avail_in;
+			conn->z_written = 1;
+		} else
+#endif
+		{
+			if (len > buf_avail)
+				len = buf_avail;
+			memcpy( bc->data + bc->len, iov->buf + offset, len );
+			bc->len += len;
+			buf_avail -= len;
+		}
+		offset += len;
+		total -= len;
+		copy -= len;
+		if (offset == iov->len) {
+			if (iov->takeOwn == GiveOwn)
+				free( iov->buf );
+			iov++;
+			offset = 0;
+		}
+		if (!buf_avail) {
+			do_append( conn, bc );
+			bc = 0;
 		}
 	}
 	conn->append_buf = bc;
-#ifdef HAVE_LIBZ
 	conn->append_avail = buf_avail;
-#endif
 	conf_wakeup( &conn->fd_fake, 0 );
 }
 
@@ -1054,7 +1203,7 @@ socket_fd_cb( int events, void *aux )
 		conf_notifier( &conn->notify, POLLIN, 0 );
 
 	if (pending_wakeup( &conn->fd_timeout ))
-		conf_wakeup( &conn->fd_timeout, conn->conf->timeout );
+		conf_wakeup( &conn->fd_timeout, conn->conf->timeout * 1000 );
 
 #ifdef HAVE_LIBSSL
 	if (conn->state == SCK_STARTTLS) {
@@ -61,8 +61,9 @@ typedef struct {
 
 typedef struct buff_chunk {
 	struct buff_chunk *next;
+	char *data; /* points at buf, or at an adopted caller buffer */
 	int len;
-	char data[1];
+	char buf[1];
 } buff_chunk_t;
 
 typedef struct {
@@ -103,19 +104,19 @@ typedef struct {
 	buff_chunk_t *append_buf; /* accumulating buffer */
 	buff_chunk_t *write_buf, **write_buf_append; /* buffer head & tail */
 	int writing;
-#ifdef HAVE_LIBZ
 	int append_avail; /* space left in accumulating buffer */
-#endif
+	int write_chunk; /* size of accumulating buffers; see socket_open_internal() */
 	int write_offset; /* offset into buffer head */
 	int buffer_mem; /* memory currently occupied by buffers in the queue */
 
 	/* reading */
+	char *buf; /* attached only while it holds data; see prepare_read() */
+	int bufsz; /* size of buffer */
 	int offset; /* start of filled bytes in buffer */
 	int bytes; /* number of filled bytes in buffer */
 	int scanoff; /* offset to continue scanning for newline at, relative to 'offset' */
-	char buf[100000];
 #ifdef HAVE_LIBZ
-	char z_buf[100000];
+	char *z_buf; /* compressed input; attached only while it holds data */
 #endif
 } conn_t;
 
@@ -142,7 +143,7 @@ void socket_start_deflate( conn_t *conn );
 void socket_close( conn_t *sock );
 void socket_expect_read( conn_t *sock, int expect );
 int socket_read( conn_t *sock, char *buf, int len ); /* never waits */
-char *socket_read_line( conn_t *sock ); /* don't free return value; never waits */
+char *socket_read_line( conn_t *sock ); /* don't free return value; valid until next call; never waits */
 typedef enum { KeepOwn = 0, GiveOwn } ownership_t;
 typedef struct {
 	char *buf;
@@ -45,6 +45,8 @@ group_conf_t *groups;
 
 const char *str_ms[] = { "master", "slave" }, *str_hl[] = { "push", "pull" };
 
+FILE *StatsFile;
+
 static void ATTR_PRINTFLIKE(1, 2)
 debug( const char *msg, ... )
 {
@@ -147,10 +149,33 @@ typedef struct sync_rec {
 	char tuid[TUIDL];
 } sync_rec_t;
 
+/* Timing and counters for the --stats-file report. */
+enum { PH_OPEN, PH_LOAD, PH_FLAGS, PH_NEW, PH_CLOSE, NUM_PHASES };
+static const char *const str_phase[] = { "open", "load", "flags", "new", "close" };
+
+typedef struct {
+	int new_msgs[2], linked_msgs[2], flag_ops[2], trash_ops[2];
+	ullong new_bytes[2];  // not counting linked messages, which are not transferred
+} sync_counts_t;
+
+typedef struct {
+	ullong start;
+	ullong done[NUM_PHASES][2];  // completion times; zero if the phase was not reached
+	sync_counts_t counts;
+} sync_tally_t;
+
+static struct {
+	ullong start;
+	int boxes, failed, unchanged;
+	sync_counts_t counts;
+} chan_tally;
+
 typedef struct {
 	int t[2];
 	void (*cb)( int sts, void *aux ), *aux;
 	char *dname, *jname, *nname, *lname, *box_name[2];
+	char *status[2];    // box fingerprint obtained from driver before opening the box
+	char *ostatus[2];   // box fingerprint recorded in the sync state
 	FILE *jfp, *nfp;
 	sync_rec_t *srecs, **srecadd;
 	channel_conf_t *chan;
@@ -159,7 +184,7 @@ typedef struct {
 	const char *orig_name[2];
 	message_t *msgs[2], *new_msgs[2];
 	uint_array_alloc_t trashed_msgs[2];
-	int state[2], opts[2], ref_count, nsrecs, ret, lfd, existing, replayed;
+	int state[2], opts[2], ref_count, nsrecs, ret, lfd, existing, replayed, unchanged;
 	int new_pending[2], flags_pending[2], trash_pending[2];
 	uint maxuid[2];     // highest UID that was already propagated
 	uint newmaxuid[2];  // highest UID that is currently being propagated
@@ -167,6 +192,7 @@ typedef struct {
 	uint newuidval[2];  // UID validity obtained from driver
 	uint newuid[2];     // TUID lookup makes sense only for UIDs >= this
 	uint mmaxxuid;      // highest expired UID on master
+	sync_tally_t tally;
 } sync_vars_t;
 
 static void sync_ref( sync_vars_t *svars ) { ++svars->ref_count; }
@@ -213,18 +239,28 @@ static int check_cancel( sync_vars_t *svars );
 #define ST_SENDING_NEW     (1<<15)
 
 
+/* Emulate an interruption at a journaling step. File operations which were
+ * offloaded before are allowed to land, so the outcome does not depend on
+ * the thread scheduling. */
+static void ATTR_NORETURN
+jexit( int code )
+{
+	wait_all_async();
+	exit( code );
+}
+
 void
 jFprintf( sync_vars_t *svars, const char *msg, ... )
 {
 	va_list va;
 
 	if (JLimit && !--JLimit)
-		exit( 101 );
+		jexit( 101 );
 	va_start( va, msg );
 	vFprintf( svars->jfp, msg, va );
 	va_end( va );
 	if (JLimit && !--JLimit)
-		exit( 100 );
+		jexit( 100 );
 }
 
 static void
@@ -279,21 +315,157 @@ match_tuids( sync_vars_t *svars, int t, message_t *msgs )
 }
 
 
+static void
+tally_phase( sync_vars_t *svars, int ph, int t )
+{
+	if (StatsFile && !svars->tally.done[ph][t])
+		svars->tally.done[ph][t] = get_usecs();
+}
+
+static void
+print_json_str( const char *str )
+{
+	if (!str) {
+		fputs( "null", StatsFile );
+		return;
+	}
+	putc( '"', StatsFile );
+	for (; *str; str++) {
+		uchar c = (uchar)*str;
+		if (c == '"' || c == '\\')
+			fprintf( StatsFile, "\\%c", c );
+		else if (c < 0x20)
+			fprintf( StatsFile, "\\u%04x", c );
+		else
+			putc( c, StatsFile );
+	}
+	putc( '"', StatsFile );
+}
+
+static void
+print_json_counts( const sync_counts_t *cnts )
+{
+	fprintf( StatsFile, "\"new\":[%d,%d],\"linked\":[%d,%d],\"new_bytes\":[%llu,%llu],\"flags\":[%d,%d],\"trash\":[%d,%d]",
+	         cnts->new_msgs[M], cnts->new_msgs[S], cnts->linked_msgs[M], cnts->linked_msgs[S],
+	         cnts->new_bytes[M], cnts->new_bytes[S],
+	         cnts->flag_ops[M], cnts->flag_ops[S], cnts->trash_ops[M], cnts->trash_ops[S] );
+}
+
+static void
+report_box_stats( sync_vars_t *svars )
+{
+	sync_tally_t *tl = &svars->tally;
+	ullong now = get_usecs();
+	int ph, t;
+
+	fputs( "{\"type\":\"box\",\"channel\":", StatsFile );
+	print_json_str( svars->chan->name );
+	fputs( ",\"boxes\":[", StatsFile );
+	print_json_str( svars->orig_name[M] );
+	putc( ',', StatsFile );
+	print_json_str( svars->orig_name[S] );
+	fprintf( StatsFile, "],\"result\":\"%s\",\"ms\":{",
+	         svars->ret ? "failed" : svars->unchanged ? "unchanged" : "ok" );
+	for (ph = 0; ph < NUM_PHASES; ph++) {
+		fprintf( StatsFile, "\"%s\":[", str_phase[ph] );
+		for (t = 0; t < 2; t++) {
+			if (tl->done[ph][t])
+				fprintf( StatsFile, "%s%.3f", t ? "," : "", (tl->done[ph][t] - tl->start) / 1000. );
+			else
+				fprintf( StatsFile, "%snull", t ? "," : "" );
+		}
+		fputs( "],", StatsFile );
+	}
+	fprintf( StatsFile, "\"total\":%.3f},", (now - tl->start) / 1000. );
+	print_json_counts( &tl->counts );
+	fputs( "}\n", StatsFile );
+
+	chan_tally.boxes++;
+	if (svars->ret)
+		chan_tally.failed++;
+	else if (svars->unchanged)
+		chan_tally.unchanged++;
+	for (t = 0; t < 2; t++) {
+		chan_tally.counts.new_msgs[t] += tl->counts.new_msgs[t];
+		chan_tally.counts.linked_msgs[t] += tl->counts.linked_msgs[t];
+		chan_tally.counts.new_bytes[t] += tl->counts.new_bytes[t];
+		chan_tally.counts.flag_ops[t] += tl->counts.flag_ops[t];
+		chan_tally.counts.trash_ops[t] += tl->counts.trash_ops[t];
+	}
+}
+
+void
+start_chan_stats( void )
+{
+	if (!StatsFile)
+		return;
+	memset( &chan_tally, 0, sizeof(chan_tally) );
+	chan_tally.start = get_usecs();
+}
+
+void
+report_chan_stats( channel_conf_t *chan, int skipped )
+{
+	if (!StatsFile)
+		return;
+	fputs( "{\"type\":\"channel\",\"channel\":", StatsFile );
+	print_json_str( chan->name );
+	fprintf( StatsFile, ",\"result\":\"%s\",\"boxes\":%d,\"failed\":%d,\"unchanged\":%d,\"ms\":%.3f,",
+	         skipped ? "skipped" : chan_tally.failed ? "failed" : "ok",
+	         chan_tally.boxes, chan_tally.failed, chan_tally.unchanged,
+	         (get_usecs() - chan_tally.start) / 1000. );
+	print_json_counts( &chan_tally.counts );
+	fputs( "}\n", StatsFile );
+}
+
 typedef struct copy_vars {
 	void (*cb)( int sts, uint uid, struct copy_vars *vars );
 	void *aux;
 	sync_rec_t *srec; /* also ->tuid */
 	message_t *msg;
 	msg_data_t data;
+	char key[200];
+	uchar linked; /* the message was linked to a moved copy instead of being fetched */
 } copy_vars_t;
 
 static void msg_fetched( int sts, void *aux );
+static void msg_linked( int sts, uint uid, void *aux );
+
+/* Build a store-independent identity for a message, used to find it again
+ * after it was moved to another mailbox. */
+static int
+make_msg_key( message_t *msg, char *buf, int size )
+{
+	int l;
+
+	if (msg->objid)
+		l = snprintf( buf, size, "E%s", msg->objid );
+	else if (msg->msgid && msg->size)
+		l = snprintf( buf, size, "M%d %s", msg->size, msg->msgid );
+	else
+		return 0;
+	return l > 0 && l < size;
+}
 
 static void
 copy_msg( copy_vars_t *vars )
 {
 	DECL_INIT_SVARS(vars->aux);
 
+	vars->data.key = 0;
+	vars->data.file = 0;
+	vars->data.tuid = 0;
+	vars->linked = 0;
+	/* Files can be passed on as-is, as no CRLF conversion is possible between such drivers. */
+	vars->data.want_file = !(DFlags & NOFILES) &&
+	                       (svars->drv[M]->get_caps( svars->ctx[M] ) & svars->drv[S]->get_caps( svars->ctx[S] ) & DRV_FILE) != 0;
+	if (vars->srec && svars->chan->detect_moves && make_msg_key( vars->msg, vars->key, sizeof(vars->key) )) {
+		vars->data.key = vars->key;
+		if ((vars->msg->status & M_FLAGS) && (svars->drv[t]->get_caps( svars->ctx[t] ) & DRV_LINK)) {
+			svars->drv[t]->link_msg( svars->ctx[t], vars->key, vars->msg->flags, msg_linked, vars );
+			return;
+		}
+	}
 	t ^= 1;
 	vars->data.flags = vars->msg->flags;
 	vars->data.date = svars->chan->use_internal_date ? -1 : 0;
@@ -302,6 +474,27 @@ copy_msg( copy_vars_t *vars )
 
 static void msg_stored( int sts, uint uid, void *aux );
 
+static void
+msg_linked( int sts, uint uid, void *aux )
+{
+	copy_vars_t *vars = (copy_vars_t *)aux;
+	DECL_SVARS;
+
+	if (sts != DRV_MSG_BAD) {
+		if (sts == DRV_OK) {
+			debug( "  -> linked message %u as %u\n", vars->msg->uid, uid );
+			vars->linked = 1;
+		}
+		msg_stored( sts, uid, aux );
+		return;
+	}
+	/* Not seen before; copy it the regular way. */
+	INIT_SVARS(vars->aux);
+	vars->data.flags = vars->msg->flags;
+	vars->data.date = svars->chan->use_internal_date ? -1 : 0;
+	svars->drv[1-t]->fetch_msg( svars->ctx[1-t], vars->msg, &vars->data, msg_fetched, vars );
+}
+
 static void
 copy_msg_bytes( char **out_ptr, const char *in_buf, int *in_idx, int in_len, int in_cr, int out_cr )
 {
@@ -335,8 +528,9 @@ copy_msg_bytes( char **out_ptr, const char *in_buf, int *in_idx, int in_len, int
 static int
 copy_msg_convert( int in_cr, int out_cr, copy_vars_t *vars )
 {
-	char *in_buf = vars->data.data;
-	int in_len = vars->data.len;
+	msg_data_t in_data = vars->data;
+	char *in_buf = in_data.data;
+	int in_len = in_data.len;
 	int idx = 0, sbreak = 0, ebreak = 0;
 	int lines = 0, hdr_crs = 0, bdy_crs = 0, app_cr = 0, extra = 0;
 	if (vars->srec) {
@@ -362,7 +556,7 @@ copy_msg_convert( int in_cr, int out_cr, copy_vars_t *vars )
 			}
 		}
 		/* invalid message */
-		free( in_buf );
+		free_msg_data( &in_data );
 		return 0;
 	  oke:
 		app_cr = out_cr && (!in_cr || hdr_crs);
@@ -398,7 +592,7 @@ copy_msg_convert( int in_cr, int out_cr, copy_vars_t *vars )
 	}
 	copy_msg_bytes( &out_buf, in_buf, &idx, in_len, in_cr, out_cr );
 
-	free( in_buf );
+	free_msg_data( &in_data );
 	return 1;
 }
 
@@ -413,7 +607,7 @@ msg_fetched( int sts, void *aux )
 	case DRV_OK:
 		INIT_SVARS(vars->aux);
 		if (check_cancel( svars )) {
-			free( vars->data.data );
+			free_msg_data( &vars->data );
 			vars->cb( SYNC_CANCELED, 0, vars );
 			return;
 		}
@@ -422,7 +616,11 @@ msg_fetched( int sts, void *aux )
 
 		scr = (svars->drv[1-t]->get_caps( svars->ctx[1-t] ) / DRV_CRLF) & 1;
 		tcr = (svars->drv[t]->get_caps( svars->ctx[t] ) / DRV_CRLF) & 1;
-		if (vars->srec || scr != tcr) {
+		if (vars->data.file) {
+			/* The TUID goes into the new copy's metadata instead of its header. */
+			if (vars->srec)
+				vars->data.tuid = vars->srec->tuid;
+		} else if (vars->srec || scr != tcr) {
 			if (!copy_msg_convert( scr, tcr, vars )) {
 				warn( "Warning: message %u from %s has incomplete header.\n",
 				      vars->msg->uid, str_ms[1-t] );
@@ -653,10 +851,28 @@ lock_state( sync_vars_t *svars )
 	return 1;
 }
 
+static void
+update_status( sync_vars_t *svars, int t )
+{
+	const char *status;
+
+	free( svars->status[t] );
+	svars->status[t] = 0;
+	if ((status = svars->drv[t]->get_box_fingerprint( svars->ctx[t] )))
+		nfasprintf( &svars->status[t], "%u %s", svars->chan->ops[t], status );
+}
+
+static int
+status_unchanged( sync_vars_t *svars, int t )
+{
+	return svars->status[t] && svars->ostatus[t] && !strcmp( svars->status[t], svars->ostatus[t] );
+}
+
 static void
 save_state( sync_vars_t *svars )
 {
 	sync_rec_t *srec;
+	int t, clean;
 	char fbuf[16]; /* enlarge when support for keywords is added */
 
 	Fprintf( svars->nfp,
@@ -664,6 +880,15 @@ save_state( sync_vars_t *svars )
 	         svars->uidval[M], svars->uidval[S], svars->maxuid[M], svars->maxuid[S] );
 	if (svars->mmaxxuid)
 		Fprintf( svars->nfp, "MaxExpiredMasterUid %u\n", svars->mmaxxuid );
+	// The box fingerprints may be recorded only if nothing is left to do,
+	// as otherwise the next run would not retry.
+	clean = !svars->ret;
+	for (srec = svars->srecs; clean && srec; srec = srec->next)
+		if ((srec->status & (S_DEAD | S_PENDING)) == S_PENDING)
+			clean = 0;
+	for (t = 0; clean && t < 2; t++)
+		if (svars->status[t])
+			Fprintf( svars->nfp, "%sStatus %s\n", t ? "Slave" : "Master", svars->status[t] );
 	Fprintf( svars->nfp, "\n" );
 	for (srec = svars->srecs; srec; srec = srec->next) {
 		if (srec->status & S_DEAD)
@@ -721,6 +946,18 @@ load_state( sync_vars_t *svars )
 				}
 				goto gothdr;
 			}
+			if (starts_with( buf, ll, "MasterStatus ", 13 )) {
+				buf[ll - 1] = 0;
+				free( svars->ostatus[M] );
+				svars->ostatus[M] = nfstrdup( buf + 13 );
+				continue;
+			}
+			if (starts_with( buf, ll, "SlaveStatus ", 12 )) {
+				buf[ll - 1] = 0;
+				free( svars->ostatus[S] );
+				svars->ostatus[S] = nfstrdup( buf + 12 );
+				continue;
+			}
 			uint uid;
 			if (sscanf( buf, "%63s %u", buf1, &uid ) != 2) {
 				error( "Error: malformed sync state header entry at %s:%d\n", svars->dname, line );
@@ -746,6 +983,16 @@ load_state( sync_vars_t *svars )
 		error( "Error: unterminated sync state header in %s\n", svars->dname );
 		goto jbail;
 	  gothdr:
+		if (status_unchanged( svars, M ) && status_unchanged( svars, S ) &&
+		    stat( svars->jname, &st ) && errno == ENOENT) {
+			// Neither box changed since the last complete run, so there is nothing
+			// to do, and we don't need to look at the entries at all.
+			debug( "boxes unchanged since last sync\n" );
+			fclose( jfp );
+			svars->existing = 1;
+			svars->unchanged = 1;
+			return 1;
+		}
 		while (fgets( buf, sizeof(buf), jfp )) {
 			line++;
 			if (!(ll = strlen( buf )) || buf[--ll] != '\n') {
@@ -1009,6 +1256,8 @@ sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *
 	svars->lfd = -1;
 	svars->uidval[0] = svars->uidval[1] = UIDVAL_BAD;
 	svars->srecadd = &svars->srecs;
+	if (StatsFile)
+		svars->tally.start = get_usecs();
 
 	for (t = 0; t < 2; t++) {
 		svars->orig_name[t] =
@@ -1038,6 +1287,10 @@ sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *
 		}
 	}
 
+	for (t = 0; t < 2; t++)
+		if (present[t] != BOX_ABSENT)
+			update_status( svars, t );
+
 	if (!prepare_state( svars )) {
 		svars->ret = SYNC_FAIL;
 		sync_bail2( svars );
@@ -1048,6 +1301,11 @@ sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *
 		sync_bail( svars );
 		return;
 	}
+	if (svars->unchanged) {
+		info( "Skipping unchanged boxes %s <=> %s\n", svars->orig_name[M], svars->orig_name[S] );
+		sync_bail( svars );
+		return;
+	}
 
 	sync_ref( svars );
 	for (t = 0; ; t++) {
@@ -1076,6 +1334,9 @@ box_confirmed( int sts, int uidvalidity, void *aux )
 	if (sts == DRV_OK) {
 		svars->state[t] |= ST_PRESENT;
 		svars->newuidval[t] = uidvalidity;
+		tally_phase( svars, PH_OPEN, t );
+		// The listed status may be unavailable or already outdated.
+		update_status( svars, t );
 	}
 	box_confirmed2( svars, t );
 }
@@ -1181,6 +1442,8 @@ box_opened( int sts, int uidvalidity, void *aux )
 		sync_bail( svars );
 	} else {
 		svars->newuidval[t] = uidvalidity;
+		tally_phase( svars, PH_OPEN, t );
+		update_status( svars, t );
 		box_opened2( svars, t );
 	}
 }
@@ -1202,6 +1465,14 @@ box_opened2( sync_vars_t *svars, int t )
 	ctx[1] = svars->ctx[1];
 	chan = svars->chan;
 
+	if (status_unchanged( svars, M ) && status_unchanged( svars, S ) && !svars->replayed) {
+		// Loading the boxes would only confirm that there is nothing to do.
+		info( "Skipping unchanged boxes %s <=> %s\n", svars->orig_name[M], svars->orig_name[S] );
+		svars->unchanged = 1;
+		sync_bail( svars );
+		return;
+	}
+
 	fails = 0;
 	for (t = 0; t < 2; t++)
 		if (svars->uidval[t] != UIDVAL_BAD && svars->uidval[t] != svars->newuidval[t])
@@ -1256,6 +1527,9 @@ box_opened2( sync_vars_t *svars, int t )
 				if (chan->ops[t] & OP_NEW)
 					opts[1-t] |= OPEN_FLAGS|OPEN_NEW_SIZE;
 			}
+			if ((chan->ops[t] & OP_NEW) && chan->detect_moves &&
+			    (svars->drv[t]->get_caps( ctx[t] ) & DRV_LINK))
+				opts[1-t] |= OPEN_FLAGS|OPEN_NEW_SIZE|OPEN_NEW_IDS;
 		}
 		if (chan->ops[t] & OP_EXPUNGE) {
 			opts[t] |= OPEN_EXPUNGE;
@@ -1392,6 +1666,7 @@ box_loaded( int sts, message_t *msgs, int total_msgs, int recent_msgs, void *aux
 		return;
 	INIT_SVARS(aux);
 	svars->state[t] |= ST_LOADED;
+	tally_phase( svars, PH_LOAD, t );
 	svars->msgs[t] = msgs;
 	info( "%s: %d messages, %d recent\n", str_ms[t], total_msgs, recent_msgs );
 
@@ -1844,6 +2119,11 @@ msg_copied( int sts, uint uid, copy_vars_t *vars )
 			vars->srec->status &= ~S_PENDING;
 			vars->srec->tuid[0] = 0;
 		}
+		svars->tally.counts.new_msgs[t]++;
+		if (vars->linked)
+			svars->tally.counts.linked_msgs[t]++;
+		else
+			svars->tally.counts.new_bytes[t] += vars->data.len;
 		break;
 	case SYNC_NOGOOD:
 		debug( "  -> killing (%u,%u)\n", vars->srec->uid[M], vars->srec->uid[S] );
@@ -1951,6 +2231,7 @@ static void
 msgs_new_done( sync_vars_t *svars, int t )
 {
 	svars->state[t] |= ST_FOUND_NEW;
+	tally_phase( svars, PH_NEW, t );
 	sync_close( svars, t );
 }
 
@@ -1965,6 +2246,7 @@ flags_set( int sts, void *aux )
 		else if (vars->dflags & F_DELETED)
 			vars->srec->wstate &= ~W_DEL(t);
 		flags_set_p2( svars, vars->srec, t );
+		svars->tally.counts.flag_ops[t]++;
 		break;
 	}
 	free( vars );
@@ -2020,6 +2302,7 @@ msgs_flags_set( sync_vars_t *svars, int t )
 
 	if (!(svars->state[t] & ST_SENT_FLAGS) || svars->flags_pending[t])
 		return;
+	tally_phase( svars, PH_FLAGS, t );
 
 	sync_ref( svars );
 
@@ -2086,6 +2369,7 @@ msg_trashed( int sts, void *aux )
 	debug( "  -> trashed %s %u\n", str_ms[t], vars->msg->uid );
 	jFprintf( svars, "T %d %u\n", t, vars->msg->uid );
 	free( vars );
+	svars->tally.counts.trash_ops[t]++;
 	trash_done[t]++;
 	stats();
 	svars->trash_pending[t]--;
@@ -2109,6 +2393,7 @@ msg_rtrashed( int sts, uint uid ATTR_UNUSED, copy_vars_t *vars )
 	debug( "  -> remote trashed %s %u\n", str_ms[t], vars->msg->uid );
 	jFprintf( svars, "T %d %u\n", t, vars->msg->uid );
 	free( vars );
+	svars->tally.counts.trash_ops[t]++;
 	trash_done[t]++;
 	stats();
 	svars->trash_pending[t]--;
@@ -2151,6 +2436,7 @@ box_closed_p2( sync_vars_t *svars, int t )
 	sync_rec_t *srec;
 
 	svars->state[t] |= ST_CLOSED;
+	tally_phase( svars, PH_CLOSE, t );
 	if (!(svars->state[1-t] & ST_CLOSED))
 		return;
 
@@ -2226,6 +2512,12 @@ sync_bail3( sync_vars_t *svars )
 {
 	free( svars->box_name[M] );
 	free( svars->box_name[S] );
+	free( svars->status[M] );
+	free( svars->status[S] );
+	free( svars->ostatus[M] );
+	free( svars->ostatus[S] );
+	if (StatsFile)
+		report_box_stats( svars );
 	sync_deref( svars );
 }
 
@@ -55,6 +55,7 @@ typedef struct channel_conf {
 	uint max_messages; /* for slave only */
 	signed char expire_unread;
 	char use_internal_date;
+	char detect_moves;
 } channel_conf_t;
 
 typedef struct group_conf {
@@ -69,6 +70,8 @@ extern group_conf_t *groups;
 
 extern const char *str_ms[2], *str_hl[2];
 
+extern FILE *StatsFile;
+
 #define SYNC_OK       0 /* assumed to be 0 */
 #define SYNC_FAIL     1
 #define SYNC_BAD(ms)  (4<<(ms))
@@ -83,4 +86,7 @@ extern const char *str_ms[2], *str_hl[2];
 void sync_boxes( store_t *ctx[], const char *names[], int present[], channel_conf_t *chan,
                  void (*cb)( int sts, void *aux ), void *aux );
 
+void start_chan_stats( void );
+void report_chan_stats( channel_conf_t *chan, int skipped );
+
 #endif
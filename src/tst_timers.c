@@ -23,7 +23,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 
 /* Just to satisfy the references in util.c */
 int DFlags;
@@ -32,16 +32,22 @@ const char *Home;
 typedef struct {
 	int id;
 	int first, other, morph_at, morph_to;
-	time_t start;
+	ullong start;
 	wakeup_t timer;
 	wakeup_t morph_timer;
 } tst_t;
 
+static int
+elapsed( tst_t *timer )
+{
+	return (int)(get_usecs() / 1000 - timer->start);
+}
+
 static void
 timer_start( tst_t *timer, int to )
 {
 	printf( "starting timer %d, should expire after %d\n", timer->id, to );
-	time( &timer->start );
+	timer->start = get_usecs() / 1000;
 	conf_wakeup( &timer->timer, to );
 }
 
@@ -51,7 +57,7 @@ timed_out( void *aux )
 	tst_t *timer = (tst_t *)aux;
 
 	printf( "timer %d expired after %d, repeat %d\n",
-	        timer->id, (int)(time( 0 ) - timer->start), timer->other );
+	        timer->id, elapsed( timer ), timer->other );
 	if (timer->other >= 0) {
 		timer_start( timer, timer->other );
 	} else {
@@ -67,17 +73,79 @@ morph_timed_out( void *aux )
 	tst_t *timer = (tst_t *)aux;
 
 	printf( "morphing timer %d after %d\n",
-	        timer->id, (int)(time( 0 ) - timer->start) );
+	        timer->id, elapsed( timer ) );
 	timer_start( timer, timer->morph_to );
 }
 
 static int nextid;
 
+/* Stress mode: arm, re-arm and cancel lots of timers with expiries spread
+ * over one second, and verify that they fire in order. */
+typedef struct {
+	wakeup_t timer;
+	ullong due;
+} stress_t;
+
+static ullong stress_last;
+static int stress_fired, stress_bad;
+
+static void
+stress_timed_out( void *aux )
+{
+	stress_t *st = (stress_t *)aux;
+
+	if (st->due < stress_last)
+		stress_bad++;
+	stress_last = st->due;
+	stress_fired++;
+}
+
+static int
+stress( int count )
+{
+	stress_t *sts = nfmalloc( count * sizeof(*sts) );
+	ullong t0, t1, t2;
+	int i, live = 0;
+
+	srand( 1 );
+	t0 = get_usecs();
+	for (i = 0; i < count; i++) {
+		init_wakeup( &sts[i].timer, stress_timed_out, &sts[i] );
+		conf_wakeup( &sts[i].timer, 1 + rand() % 1000 );
+	}
+	for (i = 0; i < count; i++) {
+		switch (i % 4) {
+		case 0:
+			conf_wakeup( &sts[i].timer, 1 + rand() % 1000 );
+			live++;
+			break;
+		case 1:
+			wipe_wakeup( &sts[i].timer );
+			break;
+		default:
+			live++;
+			break;
+		}
+	}
+	t1 = get_usecs();
+	// Check against the absolute expiry times.
+	for (i = 0; i < count; i++)
+		sts[i].due = sts[i].timer.timeout;
+	main_loop();
+	t2 = get_usecs();
+	printf( "%d timers: arming took %llu us, %d fired in %llu ms, %d out of order\n",
+	        count, t1 - t0, stress_fired, (t2 - t1) / 1000, stress_bad );
+	free( sts );
+	return stress_fired != live || stress_bad;
+}
+
 int
 main( int argc, char **argv )
 {
 	int i;
 
+	if (argc >= 2 && !strcmp( argv[1], "-s" ))
+		return stress( argc >= 3 ? atoi( argv[2] ) : 100000 );
 	for (i = 1; i < argc; i++) {
 		char *val = argv[i];
 		tst_t *timer = nfmalloc( sizeof(*timer) );
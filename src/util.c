@@ -23,12 +23,18 @@
 #include "common.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <ctype.h>
 #include <pwd.h>
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <signal.h>
+#endif
 
 static int need_nl;
 
@@ -631,6 +637,80 @@ bucketsForSize( int size )
 	}
 }
 
+/* Below this many items, spawning threads costs more than it saves. */
+#define PARALLEL_MIN_ITEMS 16
+#define PARALLEL_MAX_THREADS 8
+
+#ifdef HAVE_PTHREAD
+typedef struct {
+	void (*fn)( void *aux, void *item );
+	void *aux;
+	char *items;
+	int size, count, next;
+	pthread_mutex_t lock;
+} parallel_t;
+
+static void *
+parallel_worker( void *arg )
+{
+	parallel_t *par = (parallel_t *)arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock( &par->lock );
+		i = par->next++;
+		pthread_mutex_unlock( &par->lock );
+		if (i >= par->count)
+			return 0;
+		par->fn( par->aux, par->items + (size_t)i * par->size );
+	}
+}
+#endif
+
+/* Call fn for each of the count items of the given size, possibly from several
+ * threads at once, and return when all calls are done. The order of the calls
+ * is unspecified, so fn must touch nothing but its item and read-only state;
+ * in particular, it must not report errors itself. */
+void
+parallel_for( void (*fn)( void *aux, void *item ), void *aux, void *items, int size, int count )
+{
+	int i;
+
+#ifdef HAVE_PTHREAD
+	if (count >= 2 * PARALLEL_MIN_ITEMS) {
+		pthread_t threads[PARALLEL_MAX_THREADS - 1];
+		sigset_t all, old;
+		parallel_t par;
+		int nthreads = count / PARALLEL_MIN_ITEMS - 1;
+
+		if (nthreads > PARALLEL_MAX_THREADS - 1)
+			nthreads = PARALLEL_MAX_THREADS - 1;
+		par.fn = fn;
+		par.aux = aux;
+		par.items = (char *)items;
+		par.size = size;
+		par.count = count;
+		par.next = 0;
+		pthread_mutex_init( &par.lock, 0 );
+		// Signals are for the main thread only.
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create( &threads[i], 0, parallel_worker, &par ))
+				break;  // The remaining threads will pick up the slack.
+		nthreads = i;
+		pthread_sigmask( SIG_SETMASK, &old, 0 );
+		parallel_worker( &par );
+		for (i = 0; i < nthreads; i++)
+			pthread_join( threads[i], 0 );
+		pthread_mutex_destroy( &par.lock );
+		return;
+	}
+#endif
+	for (i = 0; i < count; i++)
+		fn( aux, (char *)items + (size_t)i * size );
+}
+
 static void
 list_prepend( list_head_t *head, list_head_t *to )
 {
@@ -654,17 +734,84 @@ list_unlink( list_head_t *head )
 	head->next = head->prev = 0;
 }
 
-static notifier_t *notifiers;
 static int changed;  /* Iterator may be invalid now. */
-#ifdef HAVE_SYS_POLL_H
+#ifdef HAVE_SYS_EPOLL_H
+/* The kernel keeps the interest list, so registration, modification and
+ * removal are O(1), and only ready fds are reported. */
+# include <sys/epoll.h>
+# define EPOLL_BATCH 64
+static int epfd = -1;
+static int nnotifiers;
+# define have_notifiers() (nnotifiers != 0)
+#else
+static notifier_t *notifiers;
+# define have_notifiers() (notifiers != 0)
+# ifdef HAVE_SYS_POLL_H
 static struct pollfd *pollfds;
 static int npolls, rpolls;
-#else
-# ifdef HAVE_SYS_SELECT_H
-#  include <sys/select.h>
+# else
+#  ifdef HAVE_SYS_SELECT_H
+#   include <sys/select.h>
+#  endif
 # endif
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+static void
+epoll_init( void )
+{
+	if ((epfd = epoll_create1( EPOLL_CLOEXEC )) < 0) {
+		perror( "epoll_create1() failed" );
+		abort();
+	}
+}
+
+static void
+epoll_update( int op, notifier_t *sn )
+{
+	struct epoll_event ev;
+
+	ev.events = ((sn->events & POLLIN) ? EPOLLIN : 0) | ((sn->events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = sn;
+	if (epoll_ctl( epfd, op, sn->fd, &ev )) {
+		perror( "epoll_ctl() failed in event loop" );
+		abort();
+	}
+}
+
+void
+init_notifier( notifier_t *sn, int fd, void (*cb)( int, void * ), void *aux )
+{
+	if (epfd < 0)
+		epoll_init();
+	sn->fd = fd;
+	sn->events = 0; /* POLLERR & POLLHUP implicit */
+	sn->cb = cb;
+	sn->aux = aux;
+	sn->next = 0;
+	epoll_update( EPOLL_CTL_ADD, sn );
+	nnotifiers++;
+}
+
+void
+conf_notifier( notifier_t *sn, int and_events, int or_events )
+{
+	int events = (sn->events & and_events) | or_events;
+
+	if (events != sn->events) {
+		sn->events = events;
+		epoll_update( EPOLL_CTL_MOD, sn );
+	}
+}
+
+void
+wipe_notifier( notifier_t *sn )
+{
+	epoll_update( EPOLL_CTL_DEL, sn );
+	nnotifiers--;
+	changed = 1;
+}
+#else
 void
 init_notifier( notifier_t *sn, int fd, void (*cb)( int, void * ), void *aux )
 {
@@ -721,14 +868,92 @@ wipe_notifier( notifier_t *sn )
 	}
 #endif
 }
+#endif
+
+ullong
+get_usecs( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (ullong)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-static time_t
+static ullong
 get_now( void )
 {
-	return time( 0 );
+	return get_usecs() / 1000;
 }
 
+/* Null timers are kept in a list, as they fire in LIFO order before any
+ * other timer. All others live in a binary min-heap ordered by expiry time
+ * and, to preserve FIFO order among equal times, by insertion sequence. */
 static list_head_t timers = { &timers, &timers };
+static wakeup_t **heap;  /* 1-based */
+static uint heap_used, heap_size;
+static ullong heap_seq;
+
+static int
+heap_less( wakeup_t *a, wakeup_t *b )
+{
+	return a->timeout < b->timeout || (a->timeout == b->timeout && a->seq < b->seq);
+}
+
+static void
+heap_place( wakeup_t *tmr, uint idx )
+{
+	heap[idx] = tmr;
+	tmr->heap_idx = idx;
+}
+
+static void
+heap_up( wakeup_t *tmr, uint idx )
+{
+	uint pidx;
+
+	for (; idx > 1 && heap_less( tmr, heap[pidx = idx / 2] ); idx = pidx)
+		heap_place( heap[pidx], idx );
+	heap_place( tmr, idx );
+}
+
+static void
+heap_down( wakeup_t *tmr, uint idx )
+{
+	uint cidx;
+
+	for (; (cidx = idx * 2) <= heap_used; idx = cidx) {
+		if (cidx < heap_used && heap_less( heap[cidx + 1], heap[cidx] ))
+			cidx++;
+		if (!heap_less( heap[cidx], tmr ))
+			break;
+		heap_place( heap[cidx], idx );
+	}
+	heap_place( tmr, idx );
+}
+
+static void
+heap_remove( wakeup_t *tmr )
+{
+	uint idx = tmr->heap_idx;
+	wakeup_t *last = heap[heap_used--];
+
+	tmr->heap_idx = 0;
+	if (last != tmr) {
+		if (idx > 1 && heap_less( last, heap[idx / 2] ))
+			heap_up( last, idx );
+		else
+			heap_down( last, idx );
+	}
+}
+
+static void
+unlink_wakeup( wakeup_t *tmr )
+{
+	if (tmr->links.next)
+		list_unlink( &tmr->links );
+	else if (tmr->heap_idx)
+		heap_remove( tmr );
+}
 
 void
 init_wakeup( wakeup_t *tmr, void (*cb)( void * ), void *aux )
@@ -736,70 +961,106 @@ init_wakeup( wakeup_t *tmr, void (*cb)( void * ), void *aux )
 	tmr->cb = cb;
 	tmr->aux = aux;
 	tmr->links.next = tmr->links.prev = 0;
+	tmr->heap_idx = 0;
 }
 
 void
 wipe_wakeup( wakeup_t *tmr )
 {
-	if (tmr->links.next)
-		list_unlink( &tmr->links );
+	unlink_wakeup( tmr );
 }
 
 void
 conf_wakeup( wakeup_t *tmr, int to )
 {
-	list_head_t *head, *succ;
-
-	if (to < 0) {
-		if (tmr->links.next)
-			list_unlink( &tmr->links );
-	} else {
-		time_t timeout = to;
-		if (!to) {
-			/* We always prepend null timers, to cluster related events. */
-			succ = timers.next;
-		} else {
-			timeout += get_now();
-			/* We start at the end in the expectation that the newest timer is likely to fire last
-			 * (which will be true only if all timeouts are equal, but it's an as good guess as any). */
-			for (succ = &timers; (head = succ->prev) != &timers; succ = head) {
-				if (head != &tmr->links && timeout > ((wakeup_t *)head)->timeout)
-					break;
-			}
-			assert( head != &tmr->links );
+	unlink_wakeup( tmr );
+	if (!to) {
+		/* We always prepend null timers, to cluster related events. */
+		list_prepend( &tmr->links, timers.next );
+	} else if (to > 0) {
+		tmr->timeout = get_now() + (uint)to;
+		tmr->seq = heap_seq++;
+		if (heap_used == heap_size) {
+			heap_size = heap_size ? heap_size * 2 : 64;
+			heap = nfrealloc( heap, (heap_size + 1) * sizeof(*heap) );
 		}
-		tmr->timeout = timeout;
-		if (succ != &tmr->links) {
-			if (tmr->links.next)
-				list_unlink( &tmr->links );
-			list_prepend( &tmr->links, succ );
+		heap_up( tmr, ++heap_used );
+	}
+}
+
+/* Fire the next due timer, if any. Otherwise, return the number of
+ * milliseconds until the next timer is due via timeout (-1 if none). */
+static int
+fire_timer( int *timeout )
+{
+	wakeup_t *tmr;
+	ullong now;
+
+	if (timers.next != &timers) {
+		tmr = (wakeup_t *)timers.next;
+		list_unlink( &tmr->links );
+	} else if (heap_used) {
+		tmr = heap[1];
+		if (tmr->timeout > (now = get_now())) {
+			*timeout = (tmr->timeout - now > INT_MAX) ? INT_MAX : (int)(tmr->timeout - now);
+			return 0;
 		}
+		heap_remove( tmr );
+	} else {
+		*timeout = -1;
+		return 0;
 	}
+	tmr->cb( tmr->aux );
+	return 1;
 }
 
 static void
 event_wait( void )
 {
-	list_head_t *head;
 	notifier_t *sn;
 	int m;
 
-#ifdef HAVE_SYS_POLL_H
-	int timeout = -1;
-	if ((head = timers.next) != &timers) {
-		wakeup_t *tmr = (wakeup_t *)head;
-		time_t delta = tmr->timeout;
-		if (!delta || (delta -= get_now()) <= 0) {
-			list_unlink( head );
-			tmr->cb( tmr->aux );
-			return;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event evs[EPOLL_BATCH];
+	int timeout, i, n;
+
+	if (fire_timer( &timeout ))
+		return;
+	if (epfd < 0)
+		epoll_init();
+	switch ((n = epoll_wait( epfd, evs, EPOLL_BATCH, timeout ))) {
+	case 0:
+		return;
+	case -1:
+		if (errno == EINTR)
+			return;  /* e.g., io_uring completion task work */
+		perror( "epoll_wait() failed in event loop" );
+		abort();
+	default:
+		break;
+	}
+	for (i = 0; i < n; i++) {
+		sn = (notifier_t *)evs[i].data.ptr;
+		m = ((evs[i].events & EPOLLIN) ? POLLIN : 0) | ((evs[i].events & EPOLLOUT) ? POLLOUT : 0) |
+		    ((evs[i].events & EPOLLERR) ? POLLERR : 0) | ((evs[i].events & EPOLLHUP) ? POLLHUP | POLLIN : 0);
+		sn->cb( m, sn->aux );
+		if (changed) {
+			/* Level-triggered, so any skipped events will be reported again. */
+			changed = 0;
+			break;
 		}
-		timeout = (int)delta * 1000;
 	}
+#elif defined(HAVE_SYS_POLL_H)
+	int timeout;
+
+	if (fire_timer( &timeout ))
+		return;
 	switch (poll( pollfds, npolls, timeout )) {
 	case 0:
 		return;
 	case -1:
+		if (errno == EINTR)
+			return;  /* e.g., io_uring completion task work */
 		perror( "poll() failed in event loop" );
 		abort();
 	default:
@@ -820,18 +1081,13 @@ event_wait( void )
 	struct timeval *timeout = 0;
 	struct timeval to_tv;
 	fd_set rfds, wfds, efds;
-	int fd;
-
-	if ((head = timers.next) != &timers) {
-		wakeup_t *tmr = (wakeup_t *)head;
-		time_t delta = tmr->timeout;
-		if (!delta || (delta -= get_now()) <= 0) {
-			list_unlink( head );
-			tmr->cb( tmr->aux );
-			return;
-		}
-		to_tv.tv_sec = delta;
-		to_tv.tv_usec = 0;
+	int fd, to_ms;
+
+	if (fire_timer( &to_ms ))
+		return;
+	if (to_ms >= 0) {
+		to_tv.tv_sec = to_ms / 1000;
+		to_tv.tv_usec = to_ms % 1000 * 1000;
 		timeout = &to_tv;
 	}
 	FD_ZERO( &rfds );
@@ -852,6 +1108,8 @@ event_wait( void )
 	case 0:
 		return;
 	case -1:
+		if (errno == EINTR)
+			return;  /* e.g., io_uring completion task work */
 		perror( "select() failed in event loop" );
 		abort();
 	default:
@@ -880,6 +1138,802 @@ event_wait( void )
 void
 main_loop( void )
 {
-	while (notifiers || timers.next != &timers)
+	while (have_notifiers() || timers.next != &timers || heap_used)
 		event_wait();
 }
+
+/* Blocking work is handed to a small pool of threads. Each queue's jobs are
+ * worked on one at a time and in order, so a store's file operations happen
+ * in the order they were issued. Completions are passed back through an
+ * eventfd (or a pipe), and are delivered from the main loop.
+ * Jobs may instead consist of io_uring operations. Such a job waits in its
+ * queue like any other, and its operations are handed to the ring by the
+ * main loop once everything before it in the queue is done. */
+
+#ifdef HAVE_PTHREAD
+# ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+# endif
+
+# define ASYNC_MAX_THREADS 4
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_idle_cond = PTHREAD_COND_INITIALIZER;
+static int async_threads, async_idle, async_busy;
+static async_queue_t *async_runq, **async_runq_tail = &async_runq;
+static async_job_t *async_done, **async_done_tail = &async_done;
+static int async_outstanding;  /* submitted, but not delivered yet */
+static int async_fds[2] = { -1, -1 };
+static notifier_t async_notifier;
+static int async_watching;
+
+static void async_notify( int events, void *aux );
+
+# if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_LINUX_IO_URING_H)
+#  include <linux/io_uring.h>
+#  ifdef IORING_FEAT_CQE_SKIP  /* Linux 5.17, which has all the operations we need */
+#   define USE_URING
+#  endif
+# endif
+#endif
+
+#ifdef USE_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+
+/* An io_uring, whose completions are signaled through the async eventfd.
+ * Submissions are collected over one main loop iteration, so they reach
+ * the kernel in batches. */
+# define URING_ENTRIES 256
+# define URING_FILES 64
+
+static int ring_fd = -1, ring_state;  /* 0: untried, 1: usable, -1: unavailable */
+static uint *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array, *cq_head, *cq_tail, *cq_mask;
+static uint sq_entries, sq_local_tail;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static int ring_unsubmitted;  /* SQEs not handed to the kernel yet */
+static int ring_inflight;  /* jobs with outstanding operations */
+static async_queue_t *async_ringq, **async_ringq_tail = &async_ringq;  /* queues with an io_uring job up next */
+static wakeup_t ring_tmr;
+static uchar ring_files[URING_FILES];  /* direct descriptor slots in use */
+#endif
+
+#ifdef HAVE_PTHREAD
+static void
+async_init_fds( void )
+{
+# ifdef HAVE_SYS_EVENTFD_H
+	if ((async_fds[0] = async_fds[1] = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK )) < 0) {
+		perror( "eventfd() failed" );
+		abort();
+	}
+# else
+	int i;
+
+	if (pipe( async_fds )) {
+		perror( "pipe() failed" );
+		abort();
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl( async_fds[i], F_SETFD, FD_CLOEXEC );
+		fcntl( async_fds[i], F_SETFL, O_NONBLOCK );
+	}
+# endif
+}
+
+static void
+async_signal( void )
+{
+	ssize_t ret;
+# ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+
+	ret = write( async_fds[1], &one, sizeof(one) );
+# else
+	ret = write( async_fds[1], "", 1 );
+# endif
+	(void)ret;  /* A full pipe has enough wakeups in it already. */
+}
+
+static void
+async_drain( void )
+{
+	char buf[64];
+
+# ifdef HAVE_SYS_EVENTFD_H
+	if (read( async_fds[0], buf, sizeof(buf) ) < 0)
+		return;  /* Nothing to consume; the counter is reset by one read. */
+# else
+	while (read( async_fds[0], buf, sizeof(buf) ) > 0);
+# endif
+}
+
+static void
+async_release( void )
+{
+	if (!async_outstanding && async_watching) {
+		wipe_notifier( &async_notifier );
+		async_watching = 0;
+	}
+}
+
+static void
+async_deliver( async_job_t *job, int canceled )
+{
+	job->queue->pending--;
+	async_outstanding--;
+	job->canceled = canceled;
+	job->done( job );
+}
+
+/* Take the oldest completion, or the oldest one of queue q if it is non-null. */
+static async_job_t *
+async_take_done( async_queue_t *q )
+{
+	async_job_t *job, **jobp;
+
+	pthread_mutex_lock( &async_lock );
+	for (jobp = &async_done; (job = *jobp); jobp = &job->next) {
+		if (!q || job->queue == q) {
+			if (!(*jobp = job->next))
+				async_done_tail = jobp;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &async_lock );
+	return job;
+}
+
+static void
+async_watch( void )
+{
+	if (async_fds[0] < 0)
+		async_init_fds();
+	if (!async_watching) {
+		init_notifier( &async_notifier, async_fds[0], async_notify, 0 );
+		conf_notifier( &async_notifier, 0, POLLIN );
+		async_watching = 1;
+	}
+}
+
+static void
+async_finished( async_job_t *job )
+{
+	job->next = 0;
+	*async_done_tail = job;
+	async_done_tail = &job->next;
+}
+
+/* Make q's next job runnable after the previous one is done; the lock is held. */
+static void
+async_advance( async_queue_t *q )
+{
+	if (!q->head)
+		return;
+	q->next = 0;
+# ifdef USE_URING
+	if (q->head->ring_ops) {
+		// Only the main loop may touch the ring.
+		*async_ringq_tail = q;
+		async_ringq_tail = &q->next;
+		return;
+	}
+# endif
+	*async_runq_tail = q;
+	async_runq_tail = &q->next;
+}
+
+static void async_work_one( void );
+static void *async_worker( void *arg );
+
+/* Have a worker thread pick up runnable jobs; the lock is held. */
+static void
+async_kick( void )
+{
+	if (async_idle) {
+		pthread_cond_signal( &async_work_cond );
+	} else if (async_threads < ASYNC_MAX_THREADS) {
+		pthread_t thread;
+		sigset_t all, old;
+
+		// Signals are for the main thread only.
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		if (!pthread_create( &thread, 0, async_worker, 0 )) {
+			pthread_detach( thread );
+			async_threads++;
+		}
+		pthread_sigmask( SIG_SETMASK, &old, 0 );
+	}
+	if (!async_threads) {
+		// No way to offload; do it ourselves.
+		while (async_runq)
+			async_work_one();
+	}
+}
+#endif
+
+#ifdef USE_URING
+static int
+ring_enter( uint to_submit, uint min_complete, uint flags )
+{
+	return (int)syscall( __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static int
+ring_register( uint opcode, void *arg, uint nargs )
+{
+	return (int)syscall( __NR_io_uring_register, ring_fd, opcode, arg, nargs );
+}
+
+/* Move the jobs whose operations all completed to the list of completions. */
+static int
+ring_reap( void )
+{
+	uint head, tail;
+	struct io_uring_cqe *cqe;
+	async_op_t *op;
+	async_job_t *job;
+	int n = 0;
+
+  again:
+	head = *cq_head;
+	tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+	for (; head != tail; head++, n++) {
+		cqe = &cqes[head & *cq_mask];
+		op = (async_op_t *)(uintptr_t)cqe->user_data;
+		op->res = cqe->res;
+		job = op->job;
+		if (!--job->ring_ops) {
+			job->queue->ring_busy = 0;
+			ring_inflight--;
+			pthread_mutex_lock( &async_lock );
+			async_finished( job );
+			async_advance( job->queue );
+			if (async_runq)
+				async_kick();
+			pthread_mutex_unlock( &async_lock );
+		}
+	}
+	__atomic_store_n( cq_head, head, __ATOMIC_RELEASE );
+	/* Completions which did not fit into the ring are held back by the kernel
+	 * until it is entered, and no further notification comes for them. */
+	if (__atomic_load_n( sq_flags, __ATOMIC_ACQUIRE ) & IORING_SQ_CQ_OVERFLOW) {
+		ring_enter( 0, 0, IORING_ENTER_GETEVENTS );
+		goto again;
+	}
+	return n;
+}
+
+static void
+ring_flush( void )
+{
+	int ret;
+
+	while (ring_unsubmitted) {
+		if ((ret = ring_enter( ring_unsubmitted, 0, 0 )) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				/* The completion queue overflowed; make room. */
+				if (!ring_reap())
+					ring_enter( 0, 1, IORING_ENTER_GETEVENTS );
+				continue;
+			}
+			perror( "io_uring_enter() failed" );
+			abort();
+		}
+		ring_unsubmitted -= ret;
+	}
+}
+
+static void
+ring_timeout( void *aux ATTR_UNUSED )
+{
+	ring_flush();
+}
+
+/* Reap completions until *busy drops to zero. */
+static void
+ring_wait( int *busy )
+{
+	ring_flush();
+	while (*busy) {
+		if (!ring_reap() && ring_enter( 0, 1, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR) {
+			perror( "io_uring_enter() failed" );
+			abort();
+		}
+	}
+}
+
+static int
+ring_init( void )
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	static const uchar need_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE,
+		IORING_OP_RENAMEAT, IORING_OP_UNLINKAT
+	};
+	int fds[URING_FILES];
+	size_t size = 0;
+	uint i;
+	char *ptr = MAP_FAILED;
+
+	memset( &p, 0, sizeof(p) );
+	if ((ring_fd = (int)syscall( __NR_io_uring_setup, URING_ENTRIES, &p )) < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP))
+		goto bail;
+	size = p.sq_off.array + p.sq_entries * sizeof(uint);
+	if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((ptr = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING )) == MAP_FAILED)
+		goto bail;
+	sq_head = (uint *)(ptr + p.sq_off.head);
+	sq_tail = (uint *)(ptr + p.sq_off.tail);
+	sq_mask = (uint *)(ptr + p.sq_off.ring_mask);
+	sq_flags = (uint *)(ptr + p.sq_off.flags);
+	sq_array = (uint *)(ptr + p.sq_off.array);
+	cq_head = (uint *)(ptr + p.cq_off.head);
+	cq_tail = (uint *)(ptr + p.cq_off.tail);
+	cq_mask = (uint *)(ptr + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+	sq_entries = p.sq_entries;
+	sq_local_tail = *sq_tail;
+	if ((sqes = mmap( 0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES )) == MAP_FAILED)
+		goto bail;
+	probe = nfcalloc( sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op) );
+	if (ring_register( IORING_REGISTER_PROBE, probe, 256 ) < 0) {
+		free( probe );
+		goto bail;
+	}
+	for (i = 0; i < as(need_ops); i++) {
+		if (need_ops[i] > probe->last_op || !(probe->ops[need_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			free( probe );
+			goto bail;
+		}
+	}
+	free( probe );
+	for (i = 0; i < URING_FILES; i++)
+		fds[i] = -1;
+	if (ring_register( IORING_REGISTER_FILES, fds, URING_FILES ) < 0)
+		goto bail;
+	if (async_fds[0] < 0)
+		async_init_fds();
+	if (ring_register( IORING_REGISTER_EVENTFD, &async_fds[0], 1 ) < 0)
+		goto bail;
+	init_wakeup( &ring_tmr, ring_timeout, 0 );
+	return 0;
+  bail:
+	if (sqes && sqes != MAP_FAILED)
+		munmap( sqes, sq_entries * sizeof(struct io_uring_sqe) );
+	if (ptr != MAP_FAILED)
+		munmap( ptr, size );
+	close( ring_fd );
+	ring_fd = -1;
+	return -1;
+}
+#endif
+
+/* Whether jobs may use io_uring operations instead of a worker thread. */
+int
+uring_available( void )
+{
+#ifdef USE_URING
+	if (!ring_state)
+		ring_state = ring_init() ? -1 : 1;
+	return ring_state > 0;
+#else
+	return 0;
+#endif
+}
+
+#ifdef USE_URING
+/* Make sure that the next n operations go to the kernel in one submission,
+ * which linked chains require. */
+static void
+ring_reserve( uint n )
+{
+	assert( n <= sq_entries );
+	if (sq_local_tail - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) + n > sq_entries)
+		ring_flush();
+}
+
+static void
+ring_prep( async_op_t *op )
+{
+	struct io_uring_sqe *sqe;
+	uint idx;
+
+	idx = sq_local_tail & *sq_mask;
+	sqe = &sqes[idx];
+	memset( sqe, 0, sizeof(*sqe) );
+	switch (op->type) {
+	case AOP_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = op->dfd;
+		sqe->addr = (uintptr_t)op->path;
+		sqe->open_flags = (uint)op->flags;  /* direct descriptors are never inherited */
+		sqe->len = 0600;
+		sqe->file_index = op->file + 1;
+		break;
+	case AOP_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = op->file;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->addr = (uintptr_t)op->buf;
+		sqe->len = op->len;
+		break;
+	case AOP_FSYNC:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = op->file;
+		sqe->flags = IOSQE_FIXED_FILE;
+		break;
+	case AOP_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = op->file + 1;
+		break;
+	case AOP_RENAME:
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = op->dfd;
+		sqe->addr = (uintptr_t)op->path;
+		sqe->len = (uint)op->ndfd;
+		sqe->addr2 = (uintptr_t)op->npath;
+		break;
+	default: /* AOP_UNLINK */
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = op->dfd;
+		sqe->addr = (uintptr_t)op->path;
+		break;
+	}
+	if (op->link)
+		sqe->flags |= IOSQE_IO_LINK;
+	sqe->user_data = (uintptr_t)op;
+	sq_array[idx] = idx;
+	/* The kernel looks at the tail only when it is entered, which happens after the SQE is filled. */
+	__atomic_store_n( sq_tail, ++sq_local_tail, __ATOMIC_RELEASE );
+	ring_unsubmitted++;
+}
+
+/* Take the io_uring job at the head of q; the lock is held. */
+static async_job_t *
+ring_take( async_queue_t *q )
+{
+	async_job_t *job = q->head;
+
+	if (!(q->head = job->next))
+		q->tail = &q->head;
+	q->ring_busy = 1;
+	ring_inflight++;
+	return job;
+}
+
+/* Hand job's operations to the ring. Making room in the ring may reap some
+ * of them already, so they were all counted when they were queued. */
+static void
+ring_start( async_job_t *job )
+{
+	async_op_t *op, *cop;
+	uint n;
+
+	for (op = job->ops; op; ) {
+		for (n = 1, cop = op; cop->link; cop = cop->next)
+			n++;
+		ring_reserve( n );
+		for (; n; n--, op = op->next)
+			ring_prep( op );
+	}
+	if (!pending_wakeup( &ring_tmr ))
+		conf_wakeup( &ring_tmr, 0 );
+}
+
+/* Start the io_uring jobs whose turn has come in their queues. */
+static void
+ring_start_due( void )
+{
+	async_queue_t *q;
+	async_job_t *job;
+
+	for (;;) {
+		pthread_mutex_lock( &async_lock );
+		if (!(q = async_ringq)) {
+			pthread_mutex_unlock( &async_lock );
+			return;
+		}
+		if (!(async_ringq = q->next))
+			async_ringq_tail = &async_ringq;
+		job = ring_take( q );
+		pthread_mutex_unlock( &async_lock );
+		ring_start( job );
+	}
+}
+#endif
+
+/* Queue one of job's operations, which is described by op. Operations go to
+ * the kernel in the order they were queued in; the ones marked as linked form
+ * a chain. The result ends up in op->res, as a negated errno on failure. */
+void
+queue_uring( async_job_t *job, async_op_t *op )
+{
+#ifdef USE_URING
+	op->job = job;
+	op->res = 0;
+	op->next = 0;
+	if (!job->ring_ops)
+		job->ops_tail = &job->ops;
+	*job->ops_tail = op;
+	job->ops_tail = &op->next;
+	job->ring_ops++;
+#else
+	(void)job; (void)op;
+	assert( !"io_uring is not available" );
+#endif
+}
+
+/* Have the operations queued for job submitted once the jobs submitted to q
+ * before are done, and job->done called from the main loop after all of the
+ * operations completed. */
+void
+submit_uring( async_queue_t *q, async_job_t *job )
+{
+#ifdef USE_URING
+	int start;
+
+	assert( job->ring_ops );
+	job->queue = q;
+	job->next = 0;
+	job->canceled = 0;
+	async_watch();
+	q->pending++;
+	async_outstanding++;
+	pthread_mutex_lock( &async_lock );
+	*q->tail = job;
+	q->tail = &job->next;
+	if ((start = !q->busy && !q->ring_busy && q->head == job))
+		ring_take( q );
+	pthread_mutex_unlock( &async_lock );
+	if (start)
+		ring_start( job );
+#else
+	(void)q; (void)job;
+	assert( !"io_uring is not available" );
+#endif
+}
+
+/* Allocate a direct descriptor slot of the ring, or return -1 if all are taken. */
+int
+alloc_uring_file( void )
+{
+#ifdef USE_URING
+	int i;
+
+	for (i = 0; i < URING_FILES; i++) {
+		if (!ring_files[i]) {
+			ring_files[i] = 1;
+			return i;
+		}
+	}
+#endif
+	return -1;
+}
+
+/* Release a slot; if it still holds a file, that is closed. */
+void
+free_uring_file( int slot, int open )
+{
+#ifdef USE_URING
+	if (open) {
+		struct io_uring_files_update up;
+		int fd = -1;
+
+		memset( &up, 0, sizeof(up) );
+		up.offset = slot;
+		up.fds = (uintptr_t)&fd;
+		ring_register( IORING_REGISTER_FILES_UPDATE, &up, 1 );
+	}
+	ring_files[slot] = 0;
+#else
+	(void)slot; (void)open;
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void
+async_notify( int events ATTR_UNUSED, void *aux ATTR_UNUSED )
+{
+	async_job_t *job;
+
+	async_drain();
+#ifdef USE_URING
+	if (ring_inflight)
+		ring_reap();
+	ring_start_due();
+#endif
+	while ((job = async_take_done( 0 )))
+		async_deliver( job, 0 );
+	async_release();
+}
+
+/* Work one job of the first runnable queue; the lock is held on entry and exit. */
+static void
+async_work_one( void )
+{
+	async_queue_t *q = async_runq;
+	async_job_t *job = q->head;
+
+	if (!(async_runq = q->next))
+		async_runq_tail = &async_runq;
+	if (!(q->head = job->next))
+		q->tail = &q->head;
+	q->busy = 1;
+	async_busy++;
+	pthread_mutex_unlock( &async_lock );
+	job->work( job );
+	pthread_mutex_lock( &async_lock );
+	async_busy--;
+	q->busy = 0;
+	async_advance( q );
+	async_finished( job );
+	async_signal();
+	pthread_cond_broadcast( &async_idle_cond );
+}
+
+static void *
+async_worker( void *arg ATTR_UNUSED )
+{
+	pthread_mutex_lock( &async_lock );
+	for (;;) {
+		while (!async_runq) {
+			async_idle++;
+			pthread_cond_wait( &async_work_cond, &async_lock );
+			async_idle--;
+		}
+		async_work_one();
+	}
+	return 0;
+}
+#endif
+
+void
+init_async_queue( async_queue_t *q )
+{
+	q->head = 0;
+	q->tail = &q->head;
+	q->next = 0;
+	q->busy = 0;
+	q->ring_busy = 0;
+	q->pending = 0;
+}
+
+/* Have job->work called on a worker thread, and job->done called from the
+ * main loop afterwards. Without threads, both are called right away. */
+void
+submit_async( async_queue_t *q, async_job_t *job )
+{
+	job->queue = q;
+	job->next = 0;
+	job->canceled = 0;
+#ifdef HAVE_PTHREAD
+	async_watch();
+	q->pending++;
+	async_outstanding++;
+	pthread_mutex_lock( &async_lock );
+	*q->tail = job;
+	q->tail = &job->next;
+	if (!q->busy && !q->ring_busy && q->head == job) {
+		q->next = 0;
+		*async_runq_tail = q;
+		async_runq_tail = &q->next;
+	}
+	async_kick();
+	pthread_mutex_unlock( &async_lock );
+#else
+	job->work( job );
+	job->done( job );
+#endif
+}
+
+/* Wait until the work of all jobs submitted to q is done.
+ * Their completions are delivered by the main loop as usual. */
+void
+wait_async( async_queue_t *q )
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &async_lock );
+	for (;;) {
+# ifdef USE_URING
+		// An io_uring job up next in any queue may be what holds up q.
+		if (async_ringq) {
+			pthread_mutex_unlock( &async_lock );
+			ring_start_due();
+			pthread_mutex_lock( &async_lock );
+			continue;
+		}
+		if (q->ring_busy) {
+			pthread_mutex_unlock( &async_lock );
+			ring_wait( &q->ring_busy );
+			pthread_mutex_lock( &async_lock );
+			continue;
+		}
+# endif
+		if (!q->head && !q->busy)
+			break;
+		pthread_cond_wait( &async_idle_cond, &async_lock );
+	}
+	pthread_mutex_unlock( &async_lock );
+#else
+	(void)q;
+#endif
+}
+
+/* Wait until the work of all jobs submitted to any queue is done. */
+void
+wait_all_async( void )
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &async_lock );
+	for (;;) {
+# ifdef USE_URING
+		if (async_ringq) {
+			pthread_mutex_unlock( &async_lock );
+			ring_start_due();
+			pthread_mutex_lock( &async_lock );
+			continue;
+		}
+		if (ring_inflight) {
+			pthread_mutex_unlock( &async_lock );
+			ring_wait( &ring_inflight );
+			pthread_mutex_lock( &async_lock );
+			continue;
+		}
+# endif
+		if (!async_runq && !async_busy)
+			break;
+		pthread_cond_wait( &async_idle_cond, &async_lock );
+	}
+	pthread_mutex_unlock( &async_lock );
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void
+async_finish( async_queue_t *q, int canceled )
+{
+	async_job_t *job;
+
+	while (q->pending) {
+		wait_async( q );
+		while ((job = async_take_done( q )))
+			async_deliver( job, canceled );
+	}
+	async_release();
+}
+#endif
+
+/* Deliver the completions of all jobs submitted to q right away,
+ * including the ones of jobs submitted by the completion callbacks. */
+void
+flush_async( async_queue_t *q )
+{
+#ifdef HAVE_PTHREAD
+	async_finish( q, 0 );
+#else
+	(void)q;
+#endif
+}
+
+/* Like flush_async(), but with job->canceled set, so the completion
+ * callbacks only release resources. */
+void
+cancel_async( async_queue_t *q )
+{
+#ifdef HAVE_PTHREAD
+	async_finish( q, 1 );
+#else
+	(void)q;
+#endif
+}